@@ -0,0 +1,122 @@
+
+/*
+ * Cycle thread - split process work around jack_cycle_signal()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cycle_thread.h"
+
+/*
+ * The time the next cycle is due, taken at the start of this one, as
+ * the cycle times move on once the next cycle starts.
+ * jack_get_cycle_times() knows it exactly; without it, assume one
+ * nominal period from the start of this cycle.
+ */
+static jack_time_t
+next_cycle_usecs (cycle_thread *ct, jack_time_t start, jack_nframes_t nframes)
+{
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs;
+    jack_time_t next_usecs;
+    float period_usecs;
+
+    if (jack_get_cycle_times (ct->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) == 0)
+        return next_usecs;
+
+    return start + (jack_time_t) nframes * 1000000 / jack_get_sample_rate (ct->client);
+}
+
+static void *
+cycle_thread_run (void *arg)
+{
+    cycle_thread *ct = (cycle_thread *) arg;
+
+    while (1) {
+        jack_nframes_t nframes = jack_cycle_wait (ct->client);
+        jack_time_t start = jack_get_time ();
+        jack_time_t due = next_cycle_usecs (ct, start, nframes);
+        jack_time_t signalled, done;
+        int status;
+
+        status = ct->critical (nframes, ct->arg);
+        jack_cycle_signal (ct->client, status);
+        if (status != 0)
+            return NULL;
+
+        signalled = jack_get_time ();
+        if (signalled - start > ct->stats.critical_max_usecs)
+            ct->stats.critical_max_usecs = signalled - start;
+        ct->stats.cycles++;
+
+        if (ct->deferred == NULL)
+            continue;
+
+        ct->deferred (nframes, ct->arg);
+
+        done = jack_get_time ();
+        ct->stats.deferred_total_usecs += done - signalled;
+        if (done - signalled > ct->stats.deferred_max_usecs)
+            ct->stats.deferred_max_usecs = done - signalled;
+        if (done > due) {
+            ct->stats.overruns++;
+            if (done - due > ct->stats.late_max_usecs)
+                ct->stats.late_max_usecs = done - due;
+        }
+    }
+
+    /* not reached */
+    return NULL;
+}
+
+int
+cycle_thread_init (cycle_thread *ct, jack_client_t *client,
+                   cycle_critical_fn critical, cycle_deferred_fn deferred, void *arg)
+{
+    memset (ct, 0, sizeof (*ct));
+    ct->client = client;
+    ct->critical = critical;
+    ct->deferred = deferred;
+    ct->arg = arg;
+
+    return jack_set_process_thread (client, cycle_thread_run, ct);
+}
+
+void
+cycle_thread_get_stats (cycle_thread *ct, cycle_stats *stats)
+{
+    /* the fields are only ever increased, a torn read is harmless */
+    memcpy (stats, (const void *) &ct->stats, sizeof (*stats));
+}
+
+void
+cycle_thread_report (cycle_thread *ct, const char *name, FILE *stream)
+{
+    cycle_stats stats;
+
+    cycle_thread_get_stats (ct, &stats);
+    fprintf (stream, "%s: %" PRIu64 " cycles, critical max %" PRIu64 " us, "
+             "deferred avg %" PRIu64 " us max %" PRIu64 " us, "
+             "%" PRIu64 " overruns (worst %" PRIu64 " us late)\n",
+             name, stats.cycles, (uint64_t) stats.critical_max_usecs,
+             (uint64_t) (stats.cycles ? stats.deferred_total_usecs / stats.cycles : 0),
+             (uint64_t) stats.deferred_max_usecs,
+             stats.overruns, (uint64_t) stats.late_max_usecs);
+}
@@ -0,0 +1,90 @@
+
+/*
+ * Cycle thread - split process work around jack_cycle_signal()
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __JACK_CYCLE_THREAD_H__
+#define __JACK_CYCLE_THREAD_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <jack/jack.h>
+#include <jack/types.h>
+
+    /*
+     * The critical part of a cycle produces everything the clients
+     * downstream in the graph wait for. It runs before
+     * jack_cycle_signal() and returns the status passed to it; a
+     * non-zero status ends the thread, like returning non-zero from a
+     * process callback.
+     *
+     * The deferred part runs after jack_cycle_signal(), in parallel
+     * with the rest of the graph. It is meant for work nobody waits
+     * for: metering, analysis, queueing to disk, sending to the
+     * network. It still shares the cycle budget, since the thread has
+     * to be back in jack_cycle_wait() before the next cycle starts.
+     */
+    typedef int (*cycle_critical_fn) (jack_nframes_t nframes, void *arg);
+    typedef void (*cycle_deferred_fn) (jack_nframes_t nframes, void *arg);
+
+    typedef struct _cycle_stats cycle_stats;
+
+    struct _cycle_stats {
+        uint64_t cycles;
+        uint64_t overruns;              // deferred work ended after the next cycle was due
+        jack_time_t critical_max_usecs;
+        jack_time_t deferred_max_usecs;
+        jack_time_t deferred_total_usecs;
+        jack_time_t late_max_usecs;     // furthest past the start of the next cycle
+    };
+
+    typedef struct _cycle_thread cycle_thread;
+
+    struct _cycle_thread {
+        jack_client_t *client;
+        cycle_critical_fn critical;
+        cycle_deferred_fn deferred;
+        void *arg;
+
+        // written by the process thread only
+        volatile cycle_stats stats;
+    };
+
+    /*
+     * Install the cycle thread as the process thread of client. Must
+     * be called before jack_activate(), and replaces
+     * jack_set_process_callback(). deferred may be NULL.
+     */
+    int cycle_thread_init (cycle_thread *ct, jack_client_t *client,
+                           cycle_critical_fn critical, cycle_deferred_fn deferred, void *arg);
+
+    /* Take a snapshot of the statistics, from any thread. */
+    void cycle_thread_get_stats (cycle_thread *ct, cycle_stats *stats);
+
+    /* Print a one line summary of the statistics to stream. */
+    void cycle_thread_report (cycle_thread *ct, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
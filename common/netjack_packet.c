@@ -59,6 +59,11 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <time.h>
+#endif
+
+#ifdef __linux__
+#include <linux/net_tstamp.h>
 #endif
 
 #include <errno.h>
@@ -119,6 +124,37 @@ packet_header_ntoh (jacknet_packet_header *pkthdr)
     pkthdr->fragment_nr = ntohl(pkthdr->fragment_nr);
 }
 
+void
+net_report_hton (jacknet_net_report *report)
+{
+    report->lost = htonl(report->lost);
+    report->late = htonl(report->late);
+    report->queue_depth = htonl(report->queue_depth);
+    report->kbps = htonl(report->kbps);
+}
+
+void
+net_report_ntoh (jacknet_net_report *report)
+{
+    report->lost = ntohl(report->lost);
+    report->late = ntohl(report->late);
+    report->queue_depth = ntohl(report->queue_depth);
+    report->kbps = ntohl(report->kbps);
+}
+
+// A variable sized packet is complete once its short last fragment
+// has arrived, so it must not fill its last fragment exactly.
+// Returns the size to send for pkt_size bytes of packet.
+int
+netjack_variable_packet_size (int pkt_size, int mtu)
+{
+    int fragment_payload_size = mtu - sizeof (jacknet_packet_header);
+
+    if ((pkt_size - sizeof (jacknet_packet_header)) % fragment_payload_size == 0)
+        return pkt_size + 1;
+    return pkt_size;
+}
+
 int get_sample_size (int bitdepth)
 {
     if (bitdepth == 8)
@@ -145,6 +181,14 @@ int jack_port_is_midi(const char *porttype)
 
 // fragment management functions.
 
+// framecnt wraps around, so a is before b when it is less than half
+// the range behind it.
+static inline int
+framecnt_before (jack_nframes_t a, jack_nframes_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
 packet_cache
 *packet_cache_new (int num_packets, int pkt_size, int mtu)
 {
@@ -167,6 +211,8 @@ packet_cache
     pcache->master_address_valid = 0;
     pcache->last_framecnt_retreived = 0;
     pcache->last_framecnt_retreived_valid = 0;
+    pcache->variable_size = 0;
+    pcache->late_packets = 0;
 
     if (pcache->packets == NULL) {
         jack_error ("could not allocate packet cache (2)");
@@ -176,6 +222,9 @@ packet_cache
     for (i = 0; i < num_packets; i++) {
         pcache->packets[i].valid = 0;
         pcache->packets[i].num_fragments = fragment_number;
+        pcache->packets[i].max_fragments = fragment_number;
+        pcache->packets[i].variable_size = 0;
+        pcache->packets[i].received_size = pkt_size;
         pcache->packets[i].packet_size = pkt_size;
         pcache->packets[i].mtu = mtu;
         pcache->packets[i].framecnt = 0;
@@ -238,26 +287,18 @@ cache_packet
     return retval;
 }
 
-// TODO: fix wrapping case... need to pass
-//       current expected frame here.
-//
-//       or just save framecount into packet_cache.
-
 cache_packet
 *packet_cache_get_oldest_packet (packet_cache *pcache)
 {
-    jack_nframes_t minimal_frame = JACK_MAX_FRAMES;
-    cache_packet *retval = &(pcache->packets[0]);
+    cache_packet *retval = NULL;
     int i;
 
     for (i = 0; i < pcache->size; i++) {
-        if (pcache->packets[i].valid && (pcache->packets[i].framecnt < minimal_frame)) {
-            minimal_frame = pcache->packets[i].framecnt;
+        if (pcache->packets[i].valid && (retval == NULL || framecnt_before (pcache->packets[i].framecnt, retval->framecnt)))
             retval = &(pcache->packets[i]);
-        }
     }
 
-    return retval;
+    return retval ? retval : &(pcache->packets[0]);
 }
 
 cache_packet
@@ -278,6 +319,7 @@ cache_packet_reset (cache_packet *pack)
 {
     int i;
     pack->valid = 0;
+    pack->num_fragments = pack->max_fragments;
 
     // XXX: i don't think this is necessary here...
     //      fragment array is cleared in _set_framecnt()
@@ -292,6 +334,8 @@ cache_packet_set_framecnt (cache_packet *pack, jack_nframes_t framecnt)
     int i;
 
     pack->framecnt = framecnt;
+    pack->num_fragments = pack->max_fragments;
+    pack->received_size = pack->packet_size;
 
     for (i = 0; i < pack->num_fragments; i++)
         pack->fragment_array[i] = 0;
@@ -315,7 +359,17 @@ cache_packet_add_fragment (cache_packet *pack, char *packet_buf, int rcv_len)
         return;
     }
 
+    // the short fragment is the last one of a variable sized packet
+    if (pack->variable_size && rcv_len < pack->mtu && fragment_nr < pack->max_fragments) {
+        pack->num_fragments = fragment_nr + 1;
+        pack->received_size = fragment_nr * fragment_payload_size + rcv_len;
+    }
+
     if (fragment_nr == 0) {
+        if (rcv_len > pack->packet_size || rcv_len > pack->mtu) {
+            jack_error ("too long packet received...");
+            return;
+        }
         memcpy (pack->packet_buf, packet_buf, rcv_len);
         pack->fragment_array[0] = 1;
 
@@ -499,10 +553,7 @@ void
 packet_cache_drain_socket( packet_cache *pcache, int sockfd )
 {
     char *rx_packet = alloca (pcache->mtu);
-    jacknet_packet_header *pkthdr = (jacknet_packet_header *) rx_packet;
     int rcv_len;
-    jack_nframes_t framecnt;
-    cache_packet *cpack;
     struct sockaddr_in sender_address;
 #ifdef WIN32
     int senderlen = sizeof( struct sockaddr_in );
@@ -522,25 +573,41 @@ packet_cache_drain_socket( packet_cache *pcache, int sockfd )
         if (rcv_len < 0)
             return;
 
-        if (pcache->master_address_valid) {
-            // Verify its from our master.
-            if (memcmp (&sender_address, &(pcache->master_address), senderlen) != 0)
-                continue;
-        } else {
-            // Setup this one as master
-            //printf( "setup master...\n" );
-            memcpy ( &(pcache->master_address), &sender_address, senderlen );
-            pcache->master_address_valid = 1;
-        }
+        packet_cache_add_datagram (pcache, rx_packet, rcv_len, &sender_address);
+    }
+}
 
-        framecnt = ntohl (pkthdr->framecnt);
-        if( pcache->last_framecnt_retreived_valid && (framecnt <= pcache->last_framecnt_retreived ))
-            continue;
+// Add one datagram, received by the caller, to the cache.
+// Used directly when the socket is read in another thread.
+
+void
+packet_cache_add_datagram( packet_cache *pcache, char *rx_packet, int rcv_len, struct sockaddr_in *sender_address )
+{
+    jacknet_packet_header *pkthdr = (jacknet_packet_header *) rx_packet;
+    jack_nframes_t framecnt;
+    cache_packet *cpack;
+
+    if (pcache->master_address_valid) {
+        // Verify its from our master.
+        if (memcmp (sender_address, &(pcache->master_address), sizeof (struct sockaddr_in)) != 0)
+            return;
+    } else {
+        // Setup this one as master
+        //printf( "setup master...\n" );
+        memcpy ( &(pcache->master_address), sender_address, sizeof (struct sockaddr_in) );
+        pcache->master_address_valid = 1;
+    }
 
-        cpack = packet_cache_get_packet (pcache, framecnt);
-        cache_packet_add_fragment (cpack, rx_packet, rcv_len);
-        cpack->recv_timestamp = jack_get_time();
+    framecnt = ntohl (pkthdr->framecnt);
+    if( pcache->last_framecnt_retreived_valid && !framecnt_before( pcache->last_framecnt_retreived, framecnt )) {
+        if (ntohl (pkthdr->fragment_nr) == 0)
+            pcache->late_packets++;
+        return;
     }
+
+    cpack = packet_cache_get_packet (pcache, framecnt);
+    cache_packet_add_fragment (cpack, rx_packet, rcv_len);
+    cpack->recv_timestamp = jack_get_time();
 }
 
 void
@@ -551,13 +618,40 @@ packet_cache_reset_master_address( packet_cache *pcache )
     pcache->last_framecnt_retreived_valid = 0;
 }
 
+// Accept packets shorter than the size the cache was made for.
+// packet_cache_retreive_packet_pointer() then returns the size received.
+void
+packet_cache_set_variable_size( packet_cache *pcache, int variable_size )
+{
+    int i;
+
+    pcache->variable_size = variable_size;
+    for (i = 0; i < pcache->size; i++)
+        pcache->packets[i].variable_size = variable_size;
+}
+
+// Number of complete packets at or after expected_framecnt.
+int
+packet_cache_get_queue_depth( packet_cache *pcache, jack_nframes_t expected_framecnt )
+{
+    int depth = 0;
+    int i;
+
+    for (i = 0; i < pcache->size; i++) {
+        cache_packet *cpack = &(pcache->packets[i]);
+        if (cpack->valid && cache_packet_is_complete( cpack ) && !framecnt_before( cpack->framecnt, expected_framecnt ))
+            depth++;
+    }
+    return depth;
+}
+
 void
 packet_cache_clear_old_packets (packet_cache *pcache, jack_nframes_t framecnt )
 {
     int i;
 
     for (i = 0; i < pcache->size; i++) {
-        if (pcache->packets[i].valid && (pcache->packets[i].framecnt < framecnt)) {
+        if (pcache->packets[i].valid && framecnt_before (pcache->packets[i].framecnt, framecnt)) {
             cache_packet_reset (&(pcache->packets[i]));
         }
     }
@@ -594,11 +688,16 @@ packet_cache_retreive_packet_pointer( packet_cache *pcache, jack_nframes_t frame
     pcache->last_framecnt_retreived_valid = 1;
     pcache->last_framecnt_retreived = framecnt;
 
+    if (cpack->variable_size)
+        return cpack->received_size;
     return pkt_size;
 }
 
+// Free a complete packet, but keep the older ones, which may still
+// complete when their fragments arrive out of order.
+
 int
-packet_cache_release_packet( packet_cache *pcache, jack_nframes_t framecnt )
+packet_cache_drop_packet( packet_cache *pcache, jack_nframes_t framecnt )
 {
     int i;
     cache_packet *cpack = NULL;
@@ -621,6 +720,16 @@ packet_cache_release_packet( packet_cache *pcache, jack_nframes_t framecnt )
     }
 
     cache_packet_reset (cpack);
+
+    return 0;
+}
+
+int
+packet_cache_release_packet( packet_cache *pcache, jack_nframes_t framecnt )
+{
+    if( packet_cache_drop_packet( pcache, framecnt ) )
+        return -1;
+
     packet_cache_clear_old_packets( pcache, framecnt );
 
     return 0;
@@ -634,7 +743,7 @@ packet_cache_get_fill( packet_cache *pcache, jack_nframes_t expected_framecnt )
     for (i = 0; i < pcache->size; i++) {
         cache_packet *cpack = &(pcache->packets[i]);
         if (cpack->valid && cache_packet_is_complete( cpack ))
-            if( cpack->framecnt >= expected_framecnt )
+            if( !framecnt_before( cpack->framecnt, expected_framecnt ) )
                 num_packets_before_us += 1;
     }
 
@@ -658,7 +767,7 @@ packet_cache_get_next_available_framecnt( packet_cache *pcache, jack_nframes_t e
             continue;
         }
 
-        if( cpack->framecnt < expected_framecnt )
+        if( framecnt_before( cpack->framecnt, expected_framecnt ) )
             continue;
 
         if( (cpack->framecnt - expected_framecnt) > best_offset ) {
@@ -693,7 +802,7 @@ packet_cache_get_highest_available_framecnt( packet_cache *pcache, jack_nframes_
             continue;
         }
 
-        if (cpack->framecnt < best_value) {
+        if (retval && framecnt_before (cpack->framecnt, best_value)) {
             continue;
         }
 
@@ -740,12 +849,141 @@ packet_cache_find_latency( packet_cache *pcache, jack_nframes_t expected_framecn
     return retval;
 }
 // fragmented packet IO
+
+/*
+ * Set up pacing for sockfd. With txtime, try to hand the timing to the
+ * kernel; returns -1 if the socket does not take SO_TXTIME, in which
+ * case the pacer times the fragments itself.
+ */
+int
+netjack_pacer_init (netjack_pacer *pacer, int sockfd, jack_time_t spread_usecs, int txtime)
+{
+    memset (pacer, 0, sizeof (*pacer));
+    pacer->spread_usecs = spread_usecs;
+
+    if (txtime) {
+#ifdef SO_TXTIME
+        struct sock_txtime config = { CLOCK_MONOTONIC, 0 };
+
+        if (setsockopt (sockfd, SOL_SOCKET, SO_TXTIME, &config, sizeof (config)) == 0) {
+            pacer->txtime = 1;
+            return 0;
+        }
+#endif
+        return -1;
+    }
+    return 0;
+}
+
+static void
+pacer_account (netjack_pacer *pacer, jack_time_t sent, jack_time_t gap_target)
+{
+    if (pacer->fragments > 0) {
+        jack_time_t gap = sent > pacer->last_usecs ? sent - pacer->last_usecs : 0;
+
+        pacer->gap_total_usecs += gap;
+        if (pacer->fragments == 1 || gap < pacer->gap_min_usecs)
+            pacer->gap_min_usecs = gap;
+
+        /* closer than half the planned gap counts as back to back */
+        if (2 * gap < gap_target) {
+            if (++pacer->burst > pacer->burst_max)
+                pacer->burst_max = pacer->burst;
+        } else {
+            pacer->burst = 1;
+        }
+    } else {
+        pacer->burst = pacer->burst_max = 1;
+    }
+    pacer->gap_target_usecs = gap_target;
+    pacer->last_usecs = sent;
+    pacer->fragments++;
+}
+
+/* Send one fragment at due, or right away without a pacer. */
+static void
+netjack_send_fragment (netjack_pacer *pacer, int sockfd, char *buf, int len, int flags,
+                       struct sockaddr *addr, int addr_size, jack_time_t due, jack_time_t gap_target)
+{
+    jack_time_t now;
+    int err;
+
+    if (pacer == NULL) {
+        err = sendto (sockfd, buf, len, flags, addr, addr_size);
+    } else if (pacer->txtime) {
+#ifdef SO_TXTIME
+        struct timespec mono;
+        struct iovec iov = { buf, len };
+        char control[CMSG_SPACE (sizeof (uint64_t))];
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        uint64_t txtime;
+
+        /* jack_get_time() need not run on CLOCK_MONOTONIC, so only
+         * its distance to due is used */
+        now = jack_get_time ();
+        clock_gettime (CLOCK_MONOTONIC, &mono);
+        txtime = (uint64_t) mono.tv_sec * 1000000000 + mono.tv_nsec;
+        if (due > now)
+            txtime += (due - now) * 1000;
+
+        memset (&msg, 0, sizeof (msg));
+        memset (control, 0, sizeof (control));
+        msg.msg_name = addr;
+        msg.msg_namelen = addr_size;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof (control);
+        cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (uint64_t));
+        memcpy (CMSG_DATA (cmsg), &txtime, sizeof (txtime));
+
+        err = sendmsg (sockfd, &msg, flags);
+        pacer_account (pacer, due > now ? due : now, gap_target);
+#else
+        err = -1;
+#endif
+    } else {
+        now = jack_get_time ();
+        if (due > now) {
+#ifdef WIN32
+            Sleep ((due - now) / 1000);
+#else
+            struct timespec pause = { (due - now) / 1000000, ((due - now) % 1000000) * 1000 };
+            nanosleep (&pause, NULL);
+#endif
+        }
+        err = sendto (sockfd, buf, len, flags, addr, addr_size);
+        pacer_account (pacer, jack_get_time (), gap_target);
+    }
+
+    if( err < 0 ) {
+        //printf( "error in send\n" );
+        perror( "send" );
+    }
+}
+
 void
 netjack_sendto (int sockfd, char *packet_buf, int pkt_size, int flags, struct sockaddr *addr, int addr_size, int mtu)
+{
+    netjack_sendto_paced (NULL, sockfd, packet_buf, pkt_size, flags, addr, addr_size, mtu);
+}
+
+/*
+ * Send a packet in fragments of at most mtu bytes. With a pacer, the
+ * fragments are spread evenly over its spread_usecs, starting now or
+ * when the previous packet is done, whichever is later.
+ */
+void
+netjack_sendto_paced (netjack_pacer *pacer, int sockfd, char *packet_buf, int pkt_size, int flags, struct sockaddr *addr, int addr_size, int mtu)
 {
     int frag_cnt = 0;
     char *tx_packet, *dataX;
     jacknet_packet_header *pkthdr;
+    jack_time_t start = 0, gap = 0;
 
     tx_packet = alloca (mtu + 10);
     dataX = tx_packet + sizeof (jacknet_packet_header);
@@ -753,17 +991,21 @@ netjack_sendto (int sockfd, char *packet_buf, int pkt_size, int flags, struct so
 
     int fragment_payload_size = mtu - sizeof (jacknet_packet_header);
 
+    if (pacer) {
+        int num_fragments = pkt_size <= mtu ? 1
+                            : (pkt_size - sizeof (jacknet_packet_header) + fragment_payload_size - 1) / fragment_payload_size;
+        jack_time_t now = jack_get_time ();
+
+        start = pacer->next_usecs > now ? pacer->next_usecs : now;
+        gap = pacer->spread_usecs / num_fragments;
+        pacer->next_usecs = start + pacer->spread_usecs;
+    }
+
     if (pkt_size <= mtu) {
-        int err;
         pkthdr = (jacknet_packet_header *) packet_buf;
         pkthdr->fragment_nr = htonl (0);
-        err = sendto(sockfd, packet_buf, pkt_size, flags, addr, addr_size);
-        if( err < 0 ) {
-            //printf( "error in send\n" );
-            perror( "send" );
-        }
+        netjack_send_fragment (pacer, sockfd, packet_buf, pkt_size, flags, addr, addr_size, start, gap);
     } else {
-        int err;
         // Copy the packet header to the tx pack first.
         memcpy(tx_packet, packet_buf, sizeof (jacknet_packet_header));
 
@@ -771,10 +1013,11 @@ netjack_sendto (int sockfd, char *packet_buf, int pkt_size, int flags, struct so
         char *packet_bufX = packet_buf + sizeof (jacknet_packet_header);
 
         while (packet_bufX < (packet_buf + pkt_size - fragment_payload_size)) {
-            pkthdr->fragment_nr = htonl (frag_cnt++);
+            pkthdr->fragment_nr = htonl (frag_cnt);
             memcpy (dataX, packet_bufX, fragment_payload_size);
-            sendto (sockfd, tx_packet, mtu, flags, addr, addr_size);
+            netjack_send_fragment (pacer, sockfd, tx_packet, mtu, flags, addr, addr_size, start + frag_cnt * gap, gap);
             packet_bufX += fragment_payload_size;
+            frag_cnt++;
         }
 
         int last_payload_size = packet_buf + pkt_size - packet_bufX;
@@ -783,14 +1026,27 @@ netjack_sendto (int sockfd, char *packet_buf, int pkt_size, int flags, struct so
         //jack_log("last fragment_count = %d, payload_size = %d\n", fragment_count, last_payload_size);
 
         // sendto(last_pack_size);
-        err = sendto(sockfd, tx_packet, last_payload_size + sizeof(jacknet_packet_header), flags, addr, addr_size);
-        if( err < 0 ) {
-            //printf( "error in send\n" );
-            perror( "send" );
-        }
+        netjack_send_fragment (pacer, sockfd, tx_packet, last_payload_size + sizeof(jacknet_packet_header), flags,
+                               addr, addr_size, start + frag_cnt * gap, gap);
     }
 }
 
+void
+netjack_pacer_report (netjack_pacer *pacer, const char *name, FILE *stream)
+{
+    netjack_pacer stats;
+
+    /* a torn read of the counters only skews one report */
+    memcpy (&stats, pacer, sizeof (stats));
+    if (stats.fragments < 2)
+        return;
+    fprintf (stream, "%s: %llu fragments %s, gap avg %llu us min %llu us (planned %llu us), longest burst %d fragments\n",
+             name, (unsigned long long) stats.fragments, stats.txtime ? "scheduled" : "sent",
+             (unsigned long long) (stats.gap_total_usecs / (stats.fragments - 1)),
+             (unsigned long long) stats.gap_min_usecs, (unsigned long long) stats.gap_target_usecs,
+             stats.burst_max);
+}
+
 void
 decode_midi_buffer (uint32_t *buffer_uint32, unsigned int buffer_size_uint32, jack_default_audio_sample_t* buf)
 {
@@ -1299,6 +1555,70 @@ render_jack_ports_to_payload_opus (JSList *playback_ports, JSList *playback_srcs
         chn++;
     }
 }
+
+// Adaptive Opus: the channels follow each other, each as its length
+// and as many bytes, so the packet shrinks with the bitrate.
+// Channels missing from a truncated packet are concealed.
+void
+render_payload_to_jack_ports_opus_packed (void *packet_payload, int payload_size, JSList *capture_ports, JSList *capture_srcs, jack_nframes_t nframes)
+{
+    JSList *node = capture_ports;
+    JSList *src_node = capture_srcs;
+    unsigned char *packet_bufX = (unsigned char *)packet_payload;
+    unsigned char *packet_end = packet_bufX + payload_size;
+
+    while (node != NULL) {
+        jack_port_t *port = (jack_port_t *) node->data;
+        jack_default_audio_sample_t* buf = jack_port_get_buffer (port, nframes);
+        OpusCustomDecoder *decoder = (OpusCustomDecoder*) src_node->data;
+        unsigned short len = 0;
+
+        if (packet_bufX + CDO <= packet_end) {
+            memcpy(&len, packet_bufX, CDO);
+            len = ntohs(len);
+        }
+        if (packet_bufX + CDO + len <= packet_end && len > 0) {
+            opus_custom_decode_float( decoder, packet_bufX + CDO, len, buf, nframes );
+            packet_bufX += CDO + len;
+        } else {
+            opus_custom_decode_float( decoder, NULL, 0, buf, nframes );
+            packet_bufX = packet_end;
+        }
+
+        src_node = jack_slist_next (src_node);
+        node = jack_slist_next (node);
+    }
+}
+
+// Returns the size of the payload written.
+int
+render_jack_ports_to_payload_opus_packed (JSList *playback_ports, JSList *playback_srcs, jack_nframes_t nframes, void *packet_payload, jack_nframes_t bytes_per_channel)
+{
+    JSList *node = playback_ports;
+    JSList *src_node = playback_srcs;
+    unsigned char *packet_bufX = (unsigned char *)packet_payload;
+    float *floatbuf = alloca (sizeof(float) * nframes );
+
+    while (node != NULL) {
+        jack_port_t *port = (jack_port_t *) node->data;
+        jack_default_audio_sample_t* buf = jack_port_get_buffer (port, nframes);
+        OpusCustomEncoder *encoder = (OpusCustomEncoder*) src_node->data;
+        int encoded_bytes;
+        unsigned short len;
+
+        memcpy( floatbuf, buf, nframes * sizeof(float) );
+        encoded_bytes = opus_custom_encode_float( encoder, floatbuf, nframes, packet_bufX + CDO, bytes_per_channel - CDO );
+        if (encoded_bytes < 0)
+            encoded_bytes = 0;
+        len = htons(encoded_bytes);
+        memcpy(packet_bufX, &len, CDO);
+        packet_bufX += CDO + encoded_bytes;
+
+        src_node = jack_slist_next( src_node );
+        node = jack_slist_next (node);
+    }
+    return packet_bufX - (unsigned char *)packet_payload;
+}
 #endif
 
 /* Wrapper functions with bitdepth argument... */
@@ -36,6 +36,8 @@ extern "C"
 #include <jack/types.h>
 #include <jack/jslist.h>
 #include <jack/midiport.h>
+#include <stdio.h>
+#include <stdint.h>
 
 // The Packet Header.
 
@@ -67,6 +69,18 @@ extern "C"
         jack_nframes_t fragment_nr;
     };
 
+    // Receiver report, sent in front of the payload in adaptive Opus
+    // mode. The counters only grow, so a lost report loses nothing.
+
+    typedef struct _jacknet_net_report jacknet_net_report;
+
+    struct _jacknet_net_report {
+        jack_nframes_t lost;            // packets missed at their deadline
+        jack_nframes_t late;            // packets that arrived after it
+        jack_nframes_t queue_depth;     // complete packets waiting in the cache
+        jack_nframes_t kbps;            // bitrate the reporting side sends at
+    };
+
     typedef union _int_float int_float_t;
 
     union _int_float {
@@ -82,6 +96,9 @@ extern "C"
         int		    num_fragments;
         int		    packet_size;
         int		    mtu;
+        int		    max_fragments;
+        int		    variable_size;
+        int		    received_size;
         jack_time_t	    recv_timestamp;
         jack_nframes_t  framecnt;
         char *	    fragment_array;
@@ -98,6 +115,32 @@ extern "C"
         int master_address_valid;
         jack_nframes_t last_framecnt_retreived;
         int last_framecnt_retreived_valid;
+        int variable_size;
+        jack_nframes_t late_packets;
+    };
+
+    // Paced sending: the fragments of a packet go out evenly spread
+    // over spread_usecs instead of back to back, so a period does not
+    // hit the switch as one burst. The kernel does the timing when
+    // txtime is set (SO_TXTIME, needs the fq qdisc), otherwise the
+    // sending thread sleeps between fragments.
+
+    typedef struct _netjack_pacer netjack_pacer;
+
+    struct _netjack_pacer {
+        jack_time_t spread_usecs;
+        int txtime;
+        jack_time_t next_usecs;         // the next packet does not start earlier
+        jack_time_t last_usecs;         // the last fragment went out, or is due
+
+        // burstiness achieved, as timed in user space or as scheduled
+        // for the kernel. Written by the sending thread only.
+        uint64_t fragments;
+        jack_time_t gap_total_usecs;
+        jack_time_t gap_min_usecs;
+        jack_time_t gap_target_usecs;
+        int burst;                      // fragments in the current back to back run
+        int burst_max;
     };
 
     // fragment cache function prototypes
@@ -115,10 +158,15 @@ extern "C"
     int	cache_packet_is_complete(cache_packet *pack);
 
     void packet_cache_drain_socket( packet_cache *pcache, int sockfd );
+    void packet_cache_add_datagram( packet_cache *pcache, char *rx_packet, int rcv_len, struct sockaddr_in *sender_address );
     void packet_cache_reset_master_address( packet_cache *pcache );
+    void packet_cache_set_variable_size( packet_cache *pcache, int variable_size );
+    int packet_cache_get_queue_depth( packet_cache *pcache, jack_nframes_t expected_framecnt );
     float packet_cache_get_fill( packet_cache *pcache, jack_nframes_t expected_framecnt );
     int packet_cache_retreive_packet_pointer( packet_cache *pcache, jack_nframes_t framecnt, char **packet_buf, int pkt_size, jack_time_t *timestamp );
     int packet_cache_release_packet( packet_cache *pcache, jack_nframes_t framecnt );
+    int packet_cache_drop_packet( packet_cache *pcache, jack_nframes_t framecnt );
+    void packet_cache_clear_old_packets( packet_cache *pcache, jack_nframes_t framecnt );
     int packet_cache_get_next_available_framecnt( packet_cache *pcache, jack_nframes_t expected_framecnt, jack_nframes_t *framecnt );
     int packet_cache_get_highest_available_framecnt( packet_cache *pcache, jack_nframes_t *framecnt );
     int packet_cache_find_latency( packet_cache *pcache, jack_nframes_t expected_framecnt, jack_nframes_t *framecnt );
@@ -127,11 +175,21 @@ extern "C"
 
     int netjack_poll_deadline (int sockfd, jack_time_t deadline);
     void netjack_sendto(int sockfd, char *packet_buf, int pkt_size, int flags, struct sockaddr *addr, int addr_size, int mtu);
+    int netjack_pacer_init(netjack_pacer *pacer, int sockfd, jack_time_t spread_usecs, int txtime);
+    void netjack_sendto_paced(netjack_pacer *pacer, int sockfd, char *packet_buf, int pkt_size, int flags, struct sockaddr *addr, int addr_size, int mtu);
+    void netjack_pacer_report(netjack_pacer *pacer, const char *name, FILE *stream);
     int get_sample_size(int bitdepth);
     void packet_header_hton(jacknet_packet_header *pkthdr);
     void packet_header_ntoh(jacknet_packet_header *pkthdr);
+    void net_report_hton(jacknet_net_report *report);
+    void net_report_ntoh(jacknet_net_report *report);
+    int netjack_variable_packet_size(int pkt_size, int mtu);
     void render_payload_to_jack_ports(int bitdepth, void *packet_payload, jack_nframes_t net_period_down, JSList *capture_ports, JSList *capture_srcs, jack_nframes_t nframes, int dont_htonl_floats );
     void render_jack_ports_to_payload(int bitdepth, JSList *playback_ports, JSList *playback_srcs, jack_nframes_t nframes, void *packet_payload, jack_nframes_t net_period_up, int dont_htonl_floats );
+#if HAVE_OPUS
+    void render_payload_to_jack_ports_opus_packed(void *packet_payload, int payload_size, JSList *capture_ports, JSList *capture_srcs, jack_nframes_t nframes);
+    int render_jack_ports_to_payload_opus_packed(JSList *playback_ports, JSList *playback_srcs, jack_nframes_t nframes, void *packet_payload, jack_nframes_t bytes_per_channel);
+#endif
 
     // XXX: This is sort of deprecated:
     //      This one waits forever. an is not using ppoll
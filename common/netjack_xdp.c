@@ -0,0 +1,604 @@
+
+/*
+ * NetJack - AF_XDP transport
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <jack/jack.h>
+
+#include "netjack_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_NUM_FRAMES 4096         // half receive, half send
+#define XDP_RING_SIZE 2048
+#define XDP_HEADERS (sizeof (struct ethhdr) + sizeof (struct iphdr) + sizeof (struct udphdr))
+#define XDP_ARP_WAIT_MSECS 1000
+
+typedef struct {
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    uint32_t mask;
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    void *map;
+    size_t map_size;
+} xdp_ring_t;
+
+struct _netjack_xdp {
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    char *umem;
+    size_t umem_size;
+    xdp_ring_t fill;
+    xdp_ring_t comp;
+    xdp_ring_t rx;
+    xdp_ring_t tx;
+    uint64_t free_frames[XDP_NUM_FRAMES / 2];   // for sending
+    int num_free;
+
+    unsigned char src_mac[ETH_ALEN];
+    unsigned char dst_mac[ETH_ALEN];
+    uint32_t src_ip;                // network order from here on
+    uint32_t dst_ip;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t ip_id;
+
+    uint64_t rx_datagrams;
+    uint64_t tx_datagrams;
+    uint64_t tx_dropped;
+};
+
+/*
+ * The producer and consumer indices are shared with the kernel, so
+ * they are read with acquire and written with release semantics.
+ */
+static inline uint32_t
+ring_load (uint32_t *index)
+{
+    return __atomic_load_n (index, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+ring_store (uint32_t *index, uint32_t value)
+{
+    __atomic_store_n (index, value, __ATOMIC_RELEASE);
+}
+
+static int
+ring_map (xdp_ring_t *ring, int fd, struct xdp_ring_offset *off, size_t entry_size, off_t pgoff)
+{
+    ring->map_size = off->desc + XDP_RING_SIZE * entry_size;
+    ring->map = mmap (NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->mask = XDP_RING_SIZE - 1;
+    ring->producer = (uint32_t *) ((char *) ring->map + off->producer);
+    ring->consumer = (uint32_t *) ((char *) ring->map + off->consumer);
+    ring->flags = (uint32_t *) ((char *) ring->map + off->flags);
+    ring->ring = (char *) ring->map + off->desc;
+    ring->cached_prod = ring_load (ring->producer);
+    ring->cached_cons = ring_load (ring->consumer);
+    return 0;
+}
+
+static long
+bpf (int cmd, union bpf_attr *attr)
+{
+    return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+#define INSN(c, d, s, o, i) ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/*
+ * Redirect IPv4 UDP datagrams for port to the socket bound to the
+ * queue they arrived on, and pass everything else. bpf_redirect_map()
+ * passes as well when no socket is bound to that queue.
+ */
+static int
+load_program (int map_fd, uint16_t port)
+{
+    const int pass = 20;
+    struct bpf_insn prog[] = {
+        INSN (BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),                 // r6 = ctx
+        INSN (BPF_LDX | BPF_W | BPF_MEM, 2, 6, 0, 0),                   // r2 = data
+        INSN (BPF_LDX | BPF_W | BPF_MEM, 3, 6, 4, 0),                   // r3 = data_end
+        INSN (BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        INSN (BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HEADERS),
+        INSN (BPF_JMP | BPF_JGT | BPF_X, 4, 3, pass - 6, 0),            // too short
+        INSN (BPF_LDX | BPF_H | BPF_MEM, 5, 2, 12, 0),
+        INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 8, htons (ETH_P_IP)),
+        INSN (BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14, 0),
+        INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 10, 0x45),        // IPv4 without options
+        INSN (BPF_LDX | BPF_B | BPF_MEM, 5, 2, 23, 0),
+        INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 12, IPPROTO_UDP),
+        INSN (BPF_LDX | BPF_H | BPF_MEM, 5, 2, 36, 0),
+        INSN (BPF_JMP | BPF_JNE | BPF_K, 5, 0, pass - 14, htons (port)),
+        INSN (BPF_LDX | BPF_W | BPF_MEM, 2, 6, 16, 0),                  // r2 = rx_queue_index
+        INSN (BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        INSN (0, 0, 0, 0, 0),
+        INSN (BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+        INSN (BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        INSN (BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),          // pass:
+        INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t) (uintptr_t) prog;
+    attr.insn_cnt = sizeof (prog) / sizeof (prog[0]);
+    attr.license = (uint64_t) (uintptr_t) "GPL";
+    return bpf (BPF_PROG_LOAD, &attr);
+}
+
+/*
+ * Look the MAC address of ip up in the ARP table, after a datagram to
+ * the discard port made the kernel resolve it.
+ */
+static int
+resolve_mac (const char *ifname, uint32_t ip, unsigned char *mac)
+{
+    struct sockaddr_in probe;
+    int msecs, fd;
+
+    fd = socket (AF_INET, SOCK_DGRAM, 0);
+    memset (&probe, 0, sizeof (probe));
+    probe.sin_family = AF_INET;
+    probe.sin_port = htons (9);
+    probe.sin_addr.s_addr = ip;
+    sendto (fd, "", 0, 0, (struct sockaddr *) &probe, sizeof (probe));
+    close (fd);
+
+    for (msecs = 0; msecs < XDP_ARP_WAIT_MSECS; msecs += 10) {
+        FILE *arp = fopen ("/proc/net/arp", "r");
+        char line[256], addr[64], hwaddr[64], dev[IFNAMSIZ + 1];
+        unsigned int type, flags;
+
+        if (arp == NULL)
+            return -1;
+        while (fgets (line, sizeof (line), arp)) {
+            if (sscanf (line, "%63s 0x%x 0x%x %63s %*s %16s", addr, &type, &flags, hwaddr, dev) != 5)
+                continue;
+            if (inet_addr (addr) != ip || strcmp (dev, ifname) != 0 || !(flags & 0x2))
+                continue;
+            fclose (arp);
+            return sscanf (hwaddr, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                           &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5]) == 6 ? 0 : -1;
+        }
+        fclose (arp);
+        usleep (10000);
+    }
+    return -1;
+}
+
+/* The MAC address, IPv4 address, netmask and mtu of ifname. */
+static int
+interface_addresses (const char *ifname, unsigned char *mac, uint32_t *ip, uint32_t *netmask, int *ifmtu)
+{
+    struct ifreq ifr;
+    int fd = socket (AF_INET, SOCK_DGRAM, 0);
+    int err = 0;
+
+    memset (&ifr, 0, sizeof (ifr));
+    strncpy (ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl (fd, SIOCGIFHWADDR, &ifr) == 0)
+        memcpy (mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    else
+        err = -1;
+    if (ioctl (fd, SIOCGIFADDR, &ifr) == 0)
+        *ip = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr.s_addr;
+    else
+        err = -1;
+    if (ioctl (fd, SIOCGIFNETMASK, &ifr) == 0)
+        *netmask = ((struct sockaddr_in *) &ifr.ifr_netmask)->sin_addr.s_addr;
+    else
+        err = -1;
+    if (ioctl (fd, SIOCGIFMTU, &ifr) == 0)
+        *ifmtu = ifr.ifr_mtu;
+    else
+        err = -1;
+    close (fd);
+    return err;
+}
+
+static int
+setup_socket (netjack_xdp *xdp, int ifindex, int queue_id)
+{
+    struct xdp_umem_reg umem_reg;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen = sizeof (off);
+    int ring_size = XDP_RING_SIZE;
+    uint32_t i;
+
+    xdp->fd = socket (AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd < 0)
+        return -1;
+
+    xdp->umem_size = (size_t) XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    xdp->umem = mmap (NULL, xdp->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xdp->umem == MAP_FAILED) {
+        xdp->umem = NULL;
+        return -1;
+    }
+
+    memset (&umem_reg, 0, sizeof (umem_reg));
+    umem_reg.addr = (uint64_t) (uintptr_t) xdp->umem;
+    umem_reg.len = xdp->umem_size;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+    if (setsockopt (xdp->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof (umem_reg))
+            || setsockopt (xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof (ring_size))
+            || setsockopt (xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof (ring_size))
+            || setsockopt (xdp->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof (ring_size))
+            || setsockopt (xdp->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof (ring_size))
+            || getsockopt (xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+        return -1;
+
+    if (ring_map (&xdp->fill, xdp->fd, &off.fr, sizeof (uint64_t), XDP_UMEM_PGOFF_FILL_RING)
+            || ring_map (&xdp->comp, xdp->fd, &off.cr, sizeof (uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)
+            || ring_map (&xdp->rx, xdp->fd, &off.rx, sizeof (struct xdp_desc), XDP_PGOFF_RX_RING)
+            || ring_map (&xdp->tx, xdp->fd, &off.tx, sizeof (struct xdp_desc), XDP_PGOFF_TX_RING))
+        return -1;
+
+    /* the lower half of the frames is for receiving, up to the fill ring */
+    for (i = 0; i < XDP_NUM_FRAMES / 2 && i < XDP_RING_SIZE; i++)
+        ((uint64_t *) xdp->fill.ring)[i] = (uint64_t) i * XDP_FRAME_SIZE;
+    xdp->fill.cached_prod = i;
+    ring_store (xdp->fill.producer, i);
+    for (xdp->num_free = 0; xdp->num_free < XDP_NUM_FRAMES / 2; xdp->num_free++)
+        xdp->free_frames[xdp->num_free] = (uint64_t) (XDP_NUM_FRAMES / 2 + xdp->num_free) * XDP_FRAME_SIZE;
+
+    memset (&sxdp, 0, sizeof (sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue_id;
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    return bind (xdp->fd, (struct sockaddr *) &sxdp, sizeof (sxdp));
+}
+
+static int
+attach_program (netjack_xdp *xdp, int ifindex, int queue_id, uint16_t rx_port)
+{
+    union bpf_attr attr;
+    uint32_t key = queue_id;
+    int value = xdp->fd;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof (uint32_t);
+    attr.value_size = sizeof (int);
+    attr.max_entries = queue_id + 1;
+    xdp->map_fd = bpf (BPF_MAP_CREATE, &attr);
+    if (xdp->map_fd < 0)
+        return -1;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uint64_t) (uintptr_t) &key;
+    attr.value = (uint64_t) (uintptr_t) &value;
+    if (bpf (BPF_MAP_UPDATE_ELEM, &attr))
+        return -1;
+
+    xdp->prog_fd = load_program (xdp->map_fd, rx_port);
+    if (xdp->prog_fd < 0)
+        return -1;
+
+    /* a link goes away with the process, however it ends */
+    memset (&attr, 0, sizeof (attr));
+    attr.link_create.prog_fd = xdp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    xdp->link_fd = bpf (BPF_LINK_CREATE, &attr);
+    return xdp->link_fd < 0 ? -1 : 0;
+}
+
+netjack_xdp *
+netjack_xdp_open (const char *ifname, int queue_id, struct sockaddr_in *remote,
+                  uint16_t src_port, uint16_t rx_port, int mtu)
+{
+    netjack_xdp *xdp;
+    uint32_t netmask;
+    int ifmtu;
+    int ifindex = if_nametoindex (ifname);
+
+    if (ifindex == 0) {
+        fprintf (stderr, "AF_XDP: no interface %s\n", ifname);
+        return NULL;
+    }
+    if (mtu + XDP_HEADERS > XDP_FRAME_SIZE) {
+        fprintf (stderr, "AF_XDP: an mtu of %d does not fit a frame\n", mtu);
+        return NULL;
+    }
+
+    xdp = calloc (1, sizeof (netjack_xdp));
+    if (xdp == NULL)
+        return NULL;
+    xdp->fd = xdp->map_fd = xdp->prog_fd = xdp->link_fd = -1;
+    xdp->dst_ip = remote->sin_addr.s_addr;
+    xdp->dst_port = remote->sin_port;
+    xdp->src_port = htons (src_port);
+
+    if (interface_addresses (ifname, xdp->src_mac, &xdp->src_ip, &netmask, &ifmtu)) {
+        fprintf (stderr, "AF_XDP: %s has no IPv4 address\n", ifname);
+        goto fail;
+    }
+    /* there is no IP fragmentation on this path */
+    if (mtu + (int) (sizeof (struct iphdr) + sizeof (struct udphdr)) > ifmtu) {
+        fprintf (stderr, "AF_XDP: an mtu of %d does not fit the mtu of %s\n", mtu, ifname);
+        goto fail;
+    }
+    if ((xdp->src_ip & netmask) != (xdp->dst_ip & netmask)) {
+        fprintf (stderr, "AF_XDP: the peer is not on the link of %s\n", ifname);
+        goto fail;
+    }
+    if (resolve_mac (ifname, xdp->dst_ip, xdp->dst_mac)) {
+        fprintf (stderr, "AF_XDP: cannot resolve the MAC address of the peer\n");
+        goto fail;
+    }
+    if (setup_socket (xdp, ifindex, queue_id)) {
+        fprintf (stderr, "AF_XDP: cannot set up the socket: %s\n", strerror (errno));
+        goto fail;
+    }
+    if (attach_program (xdp, ifindex, queue_id, rx_port)) {
+        fprintf (stderr, "AF_XDP: cannot attach to %s: %s\n", ifname, strerror (errno));
+        goto fail;
+    }
+    return xdp;
+
+fail:
+    netjack_xdp_close (xdp);
+    return NULL;
+}
+
+void
+netjack_xdp_close (netjack_xdp *xdp)
+{
+    xdp_ring_t *rings[] = { &xdp->fill, &xdp->comp, &xdp->rx, &xdp->tx };
+    unsigned int i;
+
+    if (xdp->link_fd >= 0)
+        close (xdp->link_fd);
+    if (xdp->prog_fd >= 0)
+        close (xdp->prog_fd);
+    if (xdp->map_fd >= 0)
+        close (xdp->map_fd);
+    for (i = 0; i < sizeof (rings) / sizeof (rings[0]); i++)
+        if (rings[i]->map)
+            munmap (rings[i]->map, rings[i]->map_size);
+    if (xdp->fd >= 0)
+        close (xdp->fd);
+    if (xdp->umem)
+        munmap (xdp->umem, xdp->umem_size);
+    free (xdp);
+}
+
+static uint16_t
+ip_checksum (const void *data, int len)
+{
+    const uint16_t *words = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *words++;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/*
+ * Take a send frame and return where its UDP payload goes, or NULL
+ * with the frames or the ring all in use.
+ */
+static char *
+frame_begin (netjack_xdp *xdp, uint64_t *addr)
+{
+    uint32_t done = ring_load (xdp->comp.producer) - xdp->comp.cached_cons;
+
+    /* frames the kernel has sent are free again */
+    while (done--) {
+        xdp->free_frames[xdp->num_free++] = ((uint64_t *) xdp->comp.ring)[xdp->comp.cached_cons & xdp->comp.mask];
+        xdp->comp.cached_cons++;
+    }
+    ring_store (xdp->comp.consumer, xdp->comp.cached_cons);
+
+    if (xdp->num_free == 0 || xdp->tx.cached_prod - ring_load (xdp->tx.consumer) >= XDP_RING_SIZE) {
+        xdp->tx_dropped++;
+        return NULL;
+    }
+    *addr = xdp->free_frames[--xdp->num_free];
+    return xdp->umem + *addr + XDP_HEADERS;
+}
+
+/* Put the headers in front of len bytes of payload and queue the frame. */
+static void
+frame_commit (netjack_xdp *xdp, uint64_t addr, int len)
+{
+    char *frame = xdp->umem + addr;
+    struct ethhdr *eth = (struct ethhdr *) frame;
+    struct iphdr *ip = (struct iphdr *) (eth + 1);
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+    struct xdp_desc *desc;
+
+    memcpy (eth->h_dest, xdp->dst_mac, ETH_ALEN);
+    memcpy (eth->h_source, xdp->src_mac, ETH_ALEN);
+    eth->h_proto = htons (ETH_P_IP);
+
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tos = 0;
+    ip->tot_len = htons (sizeof (struct iphdr) + sizeof (struct udphdr) + len);
+    ip->id = htons (xdp->ip_id++);
+    ip->frag_off = htons (0x4000);      // don't fragment
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->check = 0;
+    ip->saddr = xdp->src_ip;
+    ip->daddr = xdp->dst_ip;
+    ip->check = ip_checksum (ip, sizeof (struct iphdr));
+
+    udp->source = xdp->src_port;
+    udp->dest = xdp->dst_port;
+    udp->len = htons (sizeof (struct udphdr) + len);
+    udp->check = 0;                     // optional over IPv4
+
+    desc = &((struct xdp_desc *) xdp->tx.ring)[xdp->tx.cached_prod & xdp->tx.mask];
+    desc->addr = addr;
+    desc->len = XDP_HEADERS + len;
+    desc->options = 0;
+    xdp->tx.cached_prod++;
+    xdp->tx_datagrams++;
+}
+
+/* Hand the queued frames to the kernel, waking it if it asks for it. */
+static void
+tx_flush (netjack_xdp *xdp)
+{
+    ring_store (xdp->tx.producer, xdp->tx.cached_prod);
+    if (ring_load (xdp->tx.flags) & XDP_RING_NEED_WAKEUP)
+        sendto (xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+void
+netjack_xdp_sendto (netjack_xdp *xdp, char *packet_buf, int pkt_size, int mtu)
+{
+    int fragment_payload_size = mtu - sizeof (jacknet_packet_header);
+    char *packet_bufX = packet_buf + sizeof (jacknet_packet_header);
+    char *packet_end = packet_buf + pkt_size;
+    int frag_cnt = 0;
+
+    /* unlike netjack_sendto(), every fragment is built in its frame
+     * and all of them go out with one wakeup */
+    do {
+        int payload_size = packet_end - packet_bufX;
+        jacknet_packet_header *pkthdr;
+        uint64_t addr;
+        char *dataX;
+
+        if (payload_size > fragment_payload_size)
+            payload_size = fragment_payload_size;
+        if ((dataX = frame_begin (xdp, &addr)) == NULL)
+            break;
+        pkthdr = (jacknet_packet_header *) dataX;
+        memcpy (pkthdr, packet_buf, sizeof (jacknet_packet_header));
+        pkthdr->fragment_nr = htonl (frag_cnt++);
+        memcpy (pkthdr + 1, packet_bufX, payload_size);
+        frame_commit (xdp, addr, sizeof (jacknet_packet_header) + payload_size);
+        packet_bufX += payload_size;
+    } while (packet_bufX < packet_end);
+
+    tx_flush (xdp);
+}
+
+void
+netjack_xdp_drain (netjack_xdp *xdp, packet_cache *pcache)
+{
+    uint32_t received = ring_load (xdp->rx.producer) - xdp->rx.cached_cons;
+    uint32_t n;
+
+    for (n = 0; n < received; n++) {
+        struct xdp_desc *desc = &((struct xdp_desc *) xdp->rx.ring)[xdp->rx.cached_cons & xdp->rx.mask];
+        char *frame = xdp->umem + desc->addr;
+        struct iphdr *ip = (struct iphdr *) (frame + sizeof (struct ethhdr));
+        struct udphdr *udp = (struct udphdr *) (ip + 1);
+        int len = ntohs (udp->len) - (int) sizeof (struct udphdr);
+
+        /* the program has checked the headers up to the UDP port */
+        if (len > 0 && (uint32_t) len + XDP_HEADERS <= desc->len) {
+            struct sockaddr_in sender;
+
+            memset (&sender, 0, sizeof (sender));
+            sender.sin_family = AF_INET;
+            sender.sin_port = udp->source;
+            sender.sin_addr.s_addr = ip->saddr;
+            packet_cache_add_datagram (pcache, (char *) (udp + 1), len, &sender);
+            xdp->rx_datagrams++;
+        }
+
+        /* and the frame goes back to be filled again */
+        ((uint64_t *) xdp->fill.ring)[xdp->fill.cached_prod & xdp->fill.mask] = desc->addr & ~((uint64_t) XDP_FRAME_SIZE - 1);
+        xdp->fill.cached_prod++;
+        xdp->rx.cached_cons++;
+    }
+    if (received == 0)
+        return;
+
+    ring_store (xdp->rx.consumer, xdp->rx.cached_cons);
+    ring_store (xdp->fill.producer, xdp->fill.cached_prod);
+    if (ring_load (xdp->fill.flags) & XDP_RING_NEED_WAKEUP)
+        recvfrom (xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+int
+netjack_xdp_poll_deadline (netjack_xdp *xdp, int sockfd, jack_time_t deadline)
+{
+    struct pollfd fds[2];
+    jack_time_t now = jack_get_time ();
+
+    if (ring_load (xdp->rx.producer) != xdp->rx.cached_cons)
+        return 1;
+    if (now >= deadline)
+        return 0;
+
+    fds[0].fd = xdp->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sockfd;
+    fds[1].events = POLLIN;
+    return poll (fds, 2, (deadline - now + 999) / 1000) > 0;
+}
+
+void
+netjack_xdp_report (netjack_xdp *xdp, const char *name, FILE *stream)
+{
+    fprintf (stream, "%s: AF_XDP %" PRIu64 " datagrams received, %" PRIu64 " sent, %" PRIu64 " dropped on a full ring\n",
+             name, xdp->rx_datagrams, xdp->tx_datagrams, xdp->tx_dropped);
+}
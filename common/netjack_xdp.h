@@ -0,0 +1,73 @@
+
+/*
+ * NetJack - AF_XDP transport
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __JACK_NET_XDP_H__
+#define __JACK_NET_XDP_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <jack/types.h>
+
+#include "netjack_packet.h"
+
+    /*
+     * Fragments go straight between a UMEM shared with the kernel and
+     * the interface, bypassing the UDP stack. A small XDP program
+     * redirects the UDP datagrams for our port on one queue of the
+     * interface to the socket; everything else, including our
+     * datagrams arriving on other queues, passes on to the stack as
+     * before, so the UDP socket has to be drained as well.
+     *
+     * Generic (SKB) mode only, so any interface works, veth pairs
+     * included. The peer has to be on the link: frames are addressed
+     * to its MAC address from the ARP table.
+     */
+    typedef struct _netjack_xdp netjack_xdp;
+
+    /*
+     * Attach to queue_id of ifname, sending from src_port to remote
+     * and receiving on rx_port, ports in host order. Returns NULL,
+     * with the reason on stderr, if AF_XDP cannot be used.
+     */
+    netjack_xdp *netjack_xdp_open (const char *ifname, int queue_id, struct sockaddr_in *remote,
+                                   uint16_t src_port, uint16_t rx_port, int mtu);
+    void netjack_xdp_close (netjack_xdp *xdp);
+
+    /* Send a packet in fragments of at most mtu bytes, like netjack_sendto(). */
+    void netjack_xdp_sendto (netjack_xdp *xdp, char *packet_buf, int pkt_size, int mtu);
+
+    /* Add the datagrams received so far to the cache. */
+    void netjack_xdp_drain (netjack_xdp *xdp, packet_cache *pcache);
+
+    /* Like netjack_poll_deadline(), waiting on the XDP socket and sockfd. */
+    int netjack_xdp_poll_deadline (netjack_xdp *xdp, int sockfd, jack_time_t deadline);
+
+    void netjack_xdp_report (netjack_xdp *xdp, const char *name, FILE *stream);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,310 @@
+
+/*
+ * Resampler - one interface over several sample rate converters
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <samplerate.h>
+
+#if defined (__SSE2__) && !defined (__sun__)
+#include <emmintrin.h>
+#endif
+
+#if defined (__ARM_NEON__) || defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "resampler.h"
+
+#if HAVE_ZITA_RESAMPLER
+// resampler_zita.cc
+void *vresampler_new (int hlen, double ratio);
+void vresampler_free (void *vr);
+int vresampler_process (void *vr, float *in, int in_frames, float *out, int out_frames,
+                        double rratio, int *used);
+#endif
+
+/*
+ * The polyphase filter is a Blackman-Harris windowed sinc of 2 * hlen
+ * taps, tabulated at POLYPHASE_PHASES fractional positions between two
+ * input samples. An output sample takes the two phases around its
+ * position and interpolates between their results.
+ */
+#define POLYPHASE_PHASES 256
+
+static const int src_types[RESAMPLER_MAX_QUALITY + 1] = {
+    SRC_LINEAR, SRC_ZERO_ORDER_HOLD, SRC_SINC_FASTEST, SRC_SINC_MEDIUM_QUALITY, SRC_SINC_BEST_QUALITY
+};
+#if HAVE_ZITA_RESAMPLER
+static const int vresampler_hlens[RESAMPLER_MAX_QUALITY + 1] = { 16, 24, 32, 48, 64 };
+#endif
+static const int polyphase_hlens[RESAMPLER_MAX_QUALITY + 1] = { 4, 8, 16, 24, 32 };
+
+static const char *type_names[RESAMPLER_NUM_TYPES] = { "src", "vresampler", "polyphase" };
+
+struct _resampler {
+    resampler_type type;
+    double ratio;
+
+    SRC_STATE *src;
+    void *vresampler;
+
+    int hlen;
+    int taps;                       // 2 * hlen, a multiple of 8
+    float *table;                   // POLYPHASE_PHASES + 1 rows of taps
+    float *work;                    // taps of history, then the input
+    int max_input;
+    double pos;                     // of the next output sample in work
+};
+
+int
+resampler_type_from_name (const char *name, resampler_type *type)
+{
+    int t;
+
+    for (t = 0; t < RESAMPLER_NUM_TYPES; t++) {
+        if (strcmp (name, type_names[t]) == 0) {
+            *type = (resampler_type) t;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *
+resampler_type_name (resampler_type type)
+{
+    return type_names[type];
+}
+
+int
+resampler_type_available (resampler_type type)
+{
+#if !HAVE_ZITA_RESAMPLER
+    if (type == RESAMPLER_VRESAMPLER)
+        return 0;
+#endif
+    return type < RESAMPLER_NUM_TYPES;
+}
+
+static double
+blackman_harris (double u)
+{
+    return 0.35875 + 0.48829 * cos (M_PI * u) + 0.14128 * cos (2 * M_PI * u) + 0.01168 * cos (3 * M_PI * u);
+}
+
+/*
+ * Cut off below the lower of the two Nyquist frequencies, leaving the
+ * window room for its transition band.
+ */
+static void
+polyphase_make_table (resampler *rs)
+{
+    double cutoff = (rs->ratio < 1.0 ? rs->ratio : 1.0) * (1.0 - 3.0 / rs->taps);
+    int p, k;
+
+    for (p = 0; p <= POLYPHASE_PHASES; p++) {
+        float *row = rs->table + p * rs->taps;
+        double sum = 0.0;
+
+        for (k = 0; k < rs->taps; k++) {
+            double x = k - (rs->hlen - 1) - (double) p / POLYPHASE_PHASES;
+            double h = cutoff;
+
+            if (x != 0.0)
+                h = sin (M_PI * cutoff * x) / (M_PI * x);
+            row[k] = h * blackman_harris (x / rs->hlen);
+            sum += row[k];
+        }
+        for (k = 0; k < rs->taps; k++)
+            row[k] /= sum;
+    }
+}
+
+static inline float
+dot_product (const float *a, const float *b, int n)
+{
+    int k;
+#if defined (__SSE2__) && !defined (__sun__)
+    __m128 sum0 = _mm_setzero_ps ();
+    __m128 sum1 = _mm_setzero_ps ();
+
+    for (k = 0; k < n; k += 8) {
+        sum0 = _mm_add_ps (sum0, _mm_mul_ps (_mm_loadu_ps (a + k), _mm_loadu_ps (b + k)));
+        sum1 = _mm_add_ps (sum1, _mm_mul_ps (_mm_loadu_ps (a + k + 4), _mm_loadu_ps (b + k + 4)));
+    }
+    sum0 = _mm_add_ps (sum0, sum1);
+    sum0 = _mm_add_ps (sum0, _mm_movehl_ps (sum0, sum0));
+    sum0 = _mm_add_ss (sum0, _mm_shuffle_ps (sum0, sum0, 1));
+    return _mm_cvtss_f32 (sum0);
+#elif defined (__ARM_NEON__) || defined (__ARM_NEON)
+    float32x4_t sum0 = vdupq_n_f32 (0.0f);
+    float32x4_t sum1 = vdupq_n_f32 (0.0f);
+    float32x2_t sum;
+
+    for (k = 0; k < n; k += 8) {
+        sum0 = vmlaq_f32 (sum0, vld1q_f32 (a + k), vld1q_f32 (b + k));
+        sum1 = vmlaq_f32 (sum1, vld1q_f32 (a + k + 4), vld1q_f32 (b + k + 4));
+    }
+    sum0 = vaddq_f32 (sum0, sum1);
+    sum = vadd_f32 (vget_low_f32 (sum0), vget_high_f32 (sum0));
+    return vget_lane_f32 (vpadd_f32 (sum, sum), 0);
+#else
+    float sum = 0.0f;
+
+    for (k = 0; k < n; k++)
+        sum += a[k] * b[k];
+    return sum;
+#endif
+}
+
+static int
+polyphase_process (resampler *rs, float *in, int in_frames, float *out, int out_frames,
+                   double ratio, int *used)
+{
+    double step = 1.0 / ratio;
+    double pos = rs->pos;
+    int frames, n, keep;
+
+    frames = rs->taps + in_frames;
+    memcpy (rs->work + rs->taps, in, in_frames * sizeof (float));
+
+    for (n = 0; n < out_frames; n++) {
+        int i = (int) pos;
+        double phase = (pos - i) * POLYPHASE_PHASES;
+        int p = (int) phase;
+        const float *x;
+        float y0, y1;
+
+        if (i + rs->hlen >= frames)
+            break;
+        x = rs->work + i - rs->hlen + 1;
+        y0 = dot_product (rs->table + p * rs->taps, x, rs->taps);
+        y1 = dot_product (rs->table + (p + 1) * rs->taps, x, rs->taps);
+        out[n] = y0 + (y1 - y0) * (float) (phase - p);
+        pos += step;
+    }
+
+    /* keep the history from the first sample the next output needs */
+    keep = (int) pos - rs->hlen + 1;
+    if (keep > in_frames)
+        keep = in_frames;
+    memmove (rs->work, rs->work + keep, rs->taps * sizeof (float));
+    rs->pos = pos - keep;
+
+    *used = keep;
+    return n;
+}
+
+resampler *
+resampler_new (resampler_type type, int quality, double ratio, int max_input)
+{
+    resampler *rs;
+
+    if (!resampler_type_available (type) || quality < 0 || quality > RESAMPLER_MAX_QUALITY || max_input < 1)
+        return NULL;
+
+    rs = calloc (1, sizeof (resampler));
+    if (rs == NULL)
+        return NULL;
+    rs->type = type;
+    rs->ratio = ratio;
+    rs->max_input = max_input;
+
+    switch (type) {
+        case RESAMPLER_SRC:
+            rs->src = src_new (src_types[quality], 1, NULL);
+            if (rs->src == NULL)
+                goto fail;
+            break;
+        case RESAMPLER_VRESAMPLER:
+#if HAVE_ZITA_RESAMPLER
+            rs->vresampler = vresampler_new (vresampler_hlens[quality], ratio);
+#endif
+            if (rs->vresampler == NULL)
+                goto fail;
+            break;
+        case RESAMPLER_POLYPHASE:
+            rs->hlen = polyphase_hlens[quality];
+            rs->taps = 2 * rs->hlen;
+            rs->pos = rs->hlen;
+            rs->table = malloc ((POLYPHASE_PHASES + 1) * rs->taps * sizeof (float));
+            rs->work = calloc (rs->taps + max_input, sizeof (float));
+            if (rs->table == NULL || rs->work == NULL)
+                goto fail;
+            polyphase_make_table (rs);
+            break;
+        default:
+            goto fail;
+    }
+    return rs;
+
+fail:
+    resampler_free (rs);
+    return NULL;
+}
+
+void
+resampler_free (resampler *rs)
+{
+    if (rs->src)
+        src_delete (rs->src);
+#if HAVE_ZITA_RESAMPLER
+    if (rs->vresampler)
+        vresampler_free (rs->vresampler);
+#endif
+    free (rs->table);
+    free (rs->work);
+    free (rs);
+}
+
+int
+resampler_process (resampler *rs, float *in, int in_frames, float *out, int out_frames,
+                   double ratio, int *used)
+{
+    SRC_DATA src;
+
+    /* called from the process callback, so work was sized up front */
+    if (in_frames > rs->max_input)
+        in_frames = rs->max_input;
+
+    switch (rs->type) {
+        case RESAMPLER_SRC:
+            src.data_in = in;
+            src.input_frames = in_frames;
+            src.data_out = out;
+            src.output_frames = out_frames;
+            src.end_of_input = 0;
+            src.src_ratio = ratio;
+            src_process (rs->src, &src);
+            *used = src.input_frames_used;
+            return src.output_frames_gen;
+#if HAVE_ZITA_RESAMPLER
+        case RESAMPLER_VRESAMPLER:
+            return vresampler_process (rs->vresampler, in, in_frames, out, out_frames, ratio / rs->ratio, used);
+#endif
+        case RESAMPLER_POLYPHASE:
+            return polyphase_process (rs, in, in_frames, out, out_frames, ratio, used);
+        default:
+            *used = 0;
+            return 0;
+    }
+}
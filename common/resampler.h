@@ -0,0 +1,67 @@
+
+/*
+ * Resampler - one interface over several sample rate converters
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#ifndef __JACK_RESAMPLER_H__
+#define __JACK_RESAMPLER_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    typedef enum {
+        RESAMPLER_SRC,              // libsamplerate
+        RESAMPLER_VRESAMPLER,       // zita-resampler, where built with it
+        RESAMPLER_POLYPHASE,        // built in windowed sinc, SSE or NEON
+        RESAMPLER_NUM_TYPES
+    } resampler_type;
+
+#define RESAMPLER_MAX_QUALITY 4
+
+    typedef struct _resampler resampler;
+
+    /* "src", "vresampler" or "polyphase"; returns -1 for anything else. */
+    int resampler_type_from_name (const char *name, resampler_type *type);
+    const char *resampler_type_name (resampler_type type);
+    int resampler_type_available (resampler_type type);
+
+    /*
+     * A converter for one channel. quality goes from 0, cheapest, to
+     * RESAMPLER_MAX_QUALITY; ratio is the output rate over the input
+     * rate it is set up for, and max_input the most input frames that
+     * will be given at once. Returns NULL if type is not available.
+     */
+    resampler *resampler_new (resampler_type type, int quality, double ratio, int max_input);
+    void resampler_free (resampler *rs);
+
+    /*
+     * Convert in_frames of input at ratio, which may move a little
+     * from the one given to resampler_new(), into at most out_frames.
+     * Returns the number of frames written to out, and the input it
+     * took in *used; the rest of the input has to be given again.
+     * Does not allocate, input beyond max_input is left unused.
+     */
+    int resampler_process (resampler *rs, float *in, int in_frames, float *out, int out_frames,
+                           double ratio, int *used);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
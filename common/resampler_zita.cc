@@ -0,0 +1,58 @@
+
+/*
+ * Resampler - zita-resampler backend
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+#include <zita-resampler/vresampler.h>
+
+// C linkage for resampler.c, which has the only prototypes.
+
+extern "C" void *
+vresampler_new (int hlen, double ratio)
+{
+    VResampler *vr = new VResampler ();
+
+    if (vr->setup (ratio, 1, hlen)) {
+        delete vr;
+        return 0;
+    }
+    return vr;
+}
+
+extern "C" void
+vresampler_free (void *arg)
+{
+    delete (VResampler *) arg;
+}
+
+extern "C" int
+vresampler_process (void *arg, float *in, int in_frames, float *out, int out_frames,
+                    double rratio, int *used)
+{
+    VResampler *vr = (VResampler *) arg;
+
+    vr->set_rratio (rratio);
+    vr->inp_count = in_frames;
+    vr->inp_data = in;
+    vr->out_count = out_frames;
+    vr->out_data = out;
+    vr->process ();
+
+    *used = in_frames - vr->inp_count;
+    return out_frames - vr->out_count;
+}
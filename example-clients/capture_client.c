@@ -34,6 +34,8 @@
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
+#include <cycle_thread.h>
+
 typedef struct _thread_info {
 	pthread_t thread_id;
 	SNDFILE *sf;
@@ -62,6 +64,7 @@ pthread_mutex_t disk_thread_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t  data_ready = PTHREAD_COND_INITIALIZER;
 long overruns = 0;
 jack_client_t *client;
+cycle_thread process_thread;
 
 static void signal_handler(int sig)
 {
@@ -118,8 +121,22 @@ disk_thread (void *arg)
 	return 0;
 }
 
+/* Only fetch the buffers before the rest of the graph is signalled:
+ * the data stays valid until the next cycle, and nothing waits for
+ * the copy to the disk thread. */
 static int
 process (jack_nframes_t nframes, void *arg)
+{
+	unsigned chn;
+
+	for (chn = 0; chn < nports; chn++)
+		in[chn] = jack_port_get_buffer (ports[chn], nframes);
+
+	return 0;
+}
+
+static void
+process_deferred (jack_nframes_t nframes, void *arg)
 {
 	unsigned chn;
 	size_t i;
@@ -127,10 +144,7 @@ process (jack_nframes_t nframes, void *arg)
 
 	/* Do nothing until we're ready to begin. */
 	if ((!info->can_process) || (!info->can_capture))
-		return 0;
-
-	for (chn = 0; chn < nports; chn++)
-		in[chn] = jack_port_get_buffer (ports[chn], nframes);
+		return;
 
 	/* Sndfile requires interleaved data.  It is simpler here to
 	 * just queue interleaved samples to a single ringbuffer. */
@@ -152,8 +166,6 @@ process (jack_nframes_t nframes, void *arg)
 		pthread_cond_signal (&data_ready);
 		pthread_mutex_unlock (&disk_thread_lock);
 	}
-
-	return 0;
 }
 
 static void
@@ -206,6 +218,7 @@ run_disk_thread (jack_thread_info_t *info)
 	info->can_capture = 1;
 	pthread_join (info->thread_id, NULL);
 	sf_close (info->sf);
+	cycle_thread_report (&process_thread, "jackrec", stderr);
 	if (overruns > 0) {
 		fprintf (stderr,
 			 "jackrec failed with %ld overruns.\n", overruns);
@@ -325,7 +338,10 @@ main (int argc, char *argv[])
 
 	setup_disk_thread (&thread_info);
 
-	jack_set_process_callback (client, process, &thread_info);
+	if (cycle_thread_init (&process_thread, client, process, process_deferred, &thread_info)) {
+		fprintf (stderr, "cannot set process thread\n");
+		exit (1);
+	}
 	jack_on_shutdown (client, jack_shutdown, &thread_info);
 
 	if (jack_activate (client)) {
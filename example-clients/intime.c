@@ -2,6 +2,7 @@
  *  intime.c -- JACK internal timebase master example client.
  *
  *  To run: first start `jackd', then `jack_load intime intime 6/8,180bpm'.
+ *  To follow a tempo map: `jack_load intime intime map=/path/to/file'.
  */
 
 /*  Copyright (C) 2003 Jack O'Quin.
@@ -23,7 +24,9 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <jack/jack.h>
 
 /* Time and tempo variables, global to the entire transport timeline.
@@ -96,6 +99,217 @@ timebbt (jack_transport_state_t state, jack_nframes_t nframes,
 	}
 }
 
+/* Tempo map.
+ *
+ * A map file holds one change per line, "bar[|beat] bpm [meter]", for
+ * example "1 120 4/4", "17|3 96.5" or "33 72 6/8".  Blank lines and
+ * text after '#' are ignored.  Changes must be in order, a meter may
+ * only change on the first beat of a bar and carries on until the next
+ * meter change.  The map starts at 1|1 with 4/4 at 120bpm unless its
+ * first line says otherwise.
+ *
+ * Every change starts a segment of constant tempo and meter.  Its
+ * start time and beat are computed once when the map is loaded, so the
+ * callback finds the segment holding a frame by binary search after a
+ * locate, or by stepping to the next one while rolling, and derives the
+ * BBT from the frame directly.  Nothing is accumulated from one cycle to
+ * the next, so rounding cannot build up however long the transport
+ * rolls.
+ */
+typedef struct {
+	double start_secs;		/* time of the segment start */
+	double start_beat;		/* beats since 1|1 at the segment start */
+	double beats_per_second;
+	double bar_start_beat;		/* beats since 1|1 at the last meter change */
+	int32_t bar;			/* bar number of the last meter change */
+	float beats_per_bar;
+	float beat_type;
+	double beats_per_minute;
+} tempo_segment_t;
+
+tempo_segment_t *tempo_map = NULL;
+int tempo_map_size = 0;
+int tempo_map_current = 0;		/* used by the process thread only */
+
+static int
+tempo_map_find (double secs)
+{
+	int lo = 0;
+	int hi = tempo_map_size - 1;
+
+	/* the last segment starting at or before secs */
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (tempo_map[mid].start_secs <= secs)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+static int
+tempo_map_load (const char *path)
+{
+	FILE *file;
+	char line[256];
+	int lineno = 0;
+	int allocated = 0;
+	tempo_segment_t seg;
+
+	if ((file = fopen (path, "r")) == NULL) {
+		fprintf (stderr, "cannot open tempo map %s\n", path);
+		return -1;
+	}
+
+	memset (&seg, 0, sizeof (seg));
+	seg.bar = 1;
+	seg.beats_per_bar = time_beats_per_bar;
+	seg.beat_type = time_beat_type;
+	seg.beats_per_minute = time_beats_per_minute;
+	seg.beats_per_second = seg.beats_per_minute / 60.0;
+
+	while (fgets (line, sizeof (line), file)) {
+		char *comment = strchr (line, '#');
+		int32_t bar, beat = 1;
+		double bpm, beat_pos;
+		float bpb, type;
+		char *p;
+		int n;
+
+		lineno++;
+		if (comment)
+			*comment = '\0';
+		if (strspn (line, " \t\r\n") == strlen (line))
+			continue;
+
+		p = line;
+		bar = strtol (p, &p, 10);
+		if (*p == '|')
+			beat = strtol (p + 1, &p, 10);
+		n = sscanf (p, " %lf %f/%f", &bpm, &bpb, &type);
+		if (n != 1 && n != 3) {
+			fprintf (stderr, "%s:%d: expected \"bar[|beat] bpm [meter]\"\n", path, lineno);
+			goto error;
+		}
+		if (bpm <= 0 || (n == 3 && (bpb < 1 || type <= 0))) {
+			fprintf (stderr, "%s:%d: invalid tempo or meter\n", path, lineno);
+			goto error;
+		}
+		if (bar < seg.bar || beat < 1 || beat > seg.beats_per_bar || (n == 3 && beat != 1)) {
+			fprintf (stderr, "%s:%d: invalid position %" PRIi32 "|%" PRIi32 "\n", path, lineno, bar, beat);
+			goto error;
+		}
+
+		/* close the previous segment at this position */
+		beat_pos = seg.bar_start_beat + (bar - seg.bar) * (double) seg.beats_per_bar + (beat - 1);
+		if (tempo_map_size > 0 && beat_pos <= seg.start_beat) {
+			fprintf (stderr, "%s:%d: change is not after the previous one\n", path, lineno);
+			goto error;
+		}
+		seg.start_secs += (beat_pos - seg.start_beat) / seg.beats_per_second;
+		seg.start_beat = beat_pos;
+		seg.beats_per_minute = bpm;
+		seg.beats_per_second = bpm / 60.0;
+		if (n == 3) {
+			seg.bar = bar;
+			seg.bar_start_beat = beat_pos;
+			seg.beats_per_bar = bpb;
+			seg.beat_type = type;
+		}
+
+		/* a map not starting at 1|1 gets the defaults up to its first change */
+		if (tempo_map_size == 0 && beat_pos > 0) {
+			tempo_segment_t first = seg;
+
+			first.start_secs = first.start_beat = first.bar_start_beat = 0;
+			first.bar = 1;
+			first.beats_per_bar = time_beats_per_bar;
+			first.beat_type = time_beat_type;
+			first.beats_per_minute = time_beats_per_minute;
+			first.beats_per_second = time_beats_per_minute / 60.0;
+			tempo_map = malloc ((allocated = 64) * sizeof (tempo_segment_t));
+			if (tempo_map == NULL)
+				goto error;
+			tempo_map[tempo_map_size++] = first;
+		}
+
+		if (tempo_map_size == allocated) {
+			tempo_segment_t *grown;
+
+			allocated = allocated ? allocated * 2 : 64;
+			if ((grown = realloc (tempo_map, allocated * sizeof (tempo_segment_t))) == NULL)
+				goto error;
+			tempo_map = grown;
+		}
+		tempo_map[tempo_map_size++] = seg;
+	}
+	fclose (file);
+
+	if (tempo_map_size == 0) {
+		fprintf (stderr, "tempo map %s is empty\n", path);
+		return -1;
+	}
+	fprintf (stderr, "tempo map with %d segments, %.3f seconds up to the last change\n",
+		 tempo_map_size, tempo_map[tempo_map_size - 1].start_secs);
+	return 0;
+
+error:
+	fclose (file);
+	free (tempo_map);
+	tempo_map = NULL;
+	tempo_map_size = 0;
+	return -1;
+}
+
+/* Tempo map timebase callback.
+ *
+ * Runs in the process thread.  Realtime, must not wait.
+ */
+void
+timemap (jack_transport_state_t state, jack_nframes_t nframes,
+	 jack_position_t *pos, int new_pos, void *arg)
+{
+	double secs = pos->frame / (double) pos->frame_rate;
+	const tempo_segment_t *seg;
+	double beats;			/* beats since 1|1 */
+	double bar_beats;		/* beats since the last meter change */
+	double bars;
+	double beat;
+
+	if (new_pos || secs < tempo_map[tempo_map_current].start_secs) {
+		tempo_map_current = tempo_map_find (secs);
+	} else {
+		/* rolling on: at most a step or two per cycle */
+		while (tempo_map_current + 1 < tempo_map_size
+		       && tempo_map[tempo_map_current + 1].start_secs <= secs)
+			tempo_map_current++;
+	}
+	seg = &tempo_map[tempo_map_current];
+
+	beats = seg->start_beat + (secs - seg->start_secs) * seg->beats_per_second;
+	bar_beats = beats - seg->bar_start_beat;
+	bars = floor (bar_beats / seg->beats_per_bar);
+	beat = bar_beats - bars * seg->beats_per_bar;
+	if (beat < 0.0) {
+		beat = 0.0;
+	} else if (beat >= seg->beats_per_bar) {
+		/* rounded up to the next bar */
+		bars += 1.0;
+		beat = 0.0;
+	}
+
+	pos->valid = JackPositionBBT;
+	pos->beats_per_bar = seg->beats_per_bar;
+	pos->beat_type = seg->beat_type;
+	pos->ticks_per_beat = time_ticks_per_beat;
+	pos->beats_per_minute = seg->beats_per_minute;
+	pos->bar = seg->bar + (int32_t) bars;
+	pos->beat = (int32_t) beat + 1;
+	pos->tick = (int32_t) ((beat - floor (beat)) * time_ticks_per_beat);
+	pos->bar_start_tick = (seg->bar_start_beat + bars * seg->beats_per_bar) * time_ticks_per_beat;
+}
+
 /* experimental timecode callback
  *
  * Fill in extended timecode fields using the trivial assumption that
@@ -127,8 +341,16 @@ int
 jack_initialize (jack_client_t *client, const char *load_init)
 {
 	JackTimebaseCallback callback = timebbt;
+	int rc;
+
+	if (strncmp(load_init, "map=", 4) == 0) {
+		if (tempo_map_load(load_init + 4) != 0)
+			return 1;	/* terminate */
+		callback = timemap;
+		goto install;
+	}
 
-	int rc = sscanf(load_init, " %f/%f, %lf bpm ", &time_beats_per_bar,
+	rc = sscanf(load_init, " %f/%f, %lf bpm ", &time_beats_per_bar,
 			&time_beat_type, &time_beats_per_minute);
 
 	if (rc > 0) {
@@ -141,6 +363,7 @@ jack_initialize (jack_client_t *client, const char *load_init)
 			callback = timecode;
 	}
 
+install:
 	if (jack_set_timebase_callback(client, 0, callback, NULL) != 0) {
 		fprintf (stderr, "Unable to take over timebase.\n");
 		return 1;		/* terminate */
@@ -157,4 +380,5 @@ void
 jack_finish (void *arg)
 {
 	fprintf (stderr, "Internal timebase client exiting.\n");
+	free (tempo_map);
 }
@@ -0,0 +1,383 @@
+/** @file latency_compensator.c
+ *
+ * @brief Multichannel delay compensation client, based on latent_client.c
+ *
+ * Each input is delayed so that all paths arriving at this client line
+ * up with the one having the largest upstream capture latency. The added
+ * latency is reported to JACK just as latent_client does. Extra per
+ * channel delays can be changed at runtime by writing "channel frames"
+ * lines to standard input; delay changes are crossfaded over one period.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+
+#include <jack/jack.h>
+
+#define DEFAULT_CHANNELS 2
+#define DEFAULT_MAX_DELAY 65536
+
+typedef struct {
+	jack_port_t *input_port;
+	jack_port_t *output_port;
+	jack_default_audio_sample_t *ring;
+	jack_nframes_t delay;			/* delay used by the process thread */
+	volatile jack_nframes_t target_delay;	/* delay requested by the other threads */
+	jack_nframes_t extra_delay;		/* user supplied delay on top of the alignment */
+	jack_nframes_t upstream;		/* upstream capture latency (max) */
+} channel_t;
+
+jack_client_t *client;
+channel_t *channels;
+unsigned int nchannels = DEFAULT_CHANNELS;
+jack_nframes_t max_delay = DEFAULT_MAX_DELAY;
+jack_nframes_t ring_size;
+jack_nframes_t ring_mask;
+jack_nframes_t write_index;
+jack_default_audio_sample_t *fade_buffer;
+int auto_align = 1;
+volatile jack_nframes_t reported_latency;
+
+/**
+ * Copy the period just written, delay frames back, out of the ring
+ * with at most two memcpy() calls.
+ */
+static void
+ring_read (const jack_default_audio_sample_t *ring, jack_nframes_t delay,
+	   jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	jack_nframes_t start = (write_index - delay) & ring_mask;
+	jack_nframes_t first = ring_size - start;
+
+	if (first >= nframes) {
+		memcpy (out, ring + start, nframes * sizeof (jack_default_audio_sample_t));
+	} else {
+		memcpy (out, ring + start, first * sizeof (jack_default_audio_sample_t));
+		memcpy (out + first, ring, (nframes - first) * sizeof (jack_default_audio_sample_t));
+	}
+}
+
+static void
+ring_write (jack_default_audio_sample_t *ring, const jack_default_audio_sample_t *in, jack_nframes_t nframes)
+{
+	jack_nframes_t first = ring_size - write_index;
+
+	if (first >= nframes) {
+		memcpy (ring + write_index, in, nframes * sizeof (jack_default_audio_sample_t));
+	} else {
+		memcpy (ring + write_index, in, first * sizeof (jack_default_audio_sample_t));
+		memcpy (ring, in + first, (nframes - first) * sizeof (jack_default_audio_sample_t));
+	}
+}
+
+/**
+ * The process callback writes every input period into its ring and
+ * reads the delayed period back. If the delay of a channel changed, the
+ * period is rendered at both delays and crossfaded.
+ */
+int
+process (jack_nframes_t nframes, void *arg)
+{
+	unsigned int c;
+	jack_nframes_t k;
+
+	for (c = 0; c < nchannels; c++) {
+		channel_t *ch = &channels[c];
+		jack_default_audio_sample_t *in = jack_port_get_buffer (ch->input_port, nframes);
+		jack_default_audio_sample_t *out = jack_port_get_buffer (ch->output_port, nframes);
+		jack_nframes_t target = ch->target_delay;
+
+		ring_write (ch->ring, in, nframes);
+
+		if (target == ch->delay) {
+			ring_read (ch->ring, ch->delay, out, nframes);
+			continue;
+		}
+
+		ring_read (ch->ring, ch->delay, out, nframes);
+		ring_read (ch->ring, target, fade_buffer, nframes);
+		for (k = 0; k < nframes; k++) {
+			float g = (float) k / nframes;
+			out[k] += g * (fade_buffer[k] - out[k]);
+		}
+		ch->delay = target;
+	}
+
+	/* the write index is shared by all channels, so advance it once */
+	write_index = (write_index + nframes) & ring_mask;
+
+	return 0;
+}
+
+/**
+ * Derive the per channel delays from the upstream latencies. Runs
+ * outside the process thread and only publishes the new targets.
+ */
+static void
+update_delays (void)
+{
+	jack_nframes_t worst = 0;
+	unsigned int c;
+
+	for (c = 0; c < nchannels; c++) {
+		if (auto_align && channels[c].upstream > worst) {
+			worst = channels[c].upstream;
+		}
+	}
+
+	for (c = 0; c < nchannels; c++) {
+		channel_t *ch = &channels[c];
+		jack_nframes_t delay = ch->extra_delay;
+
+		if (auto_align) {
+			delay += worst - ch->upstream;
+		}
+		if (delay > max_delay) {
+			fprintf (stderr, "channel %u needs a delay of %" PRIu32 " frames, limited to %" PRIu32 "\n",
+				 c + 1, delay, max_delay);
+			delay = max_delay;
+		}
+		ch->target_delay = delay;
+	}
+}
+
+void
+latency_cb (jack_latency_callback_mode_t mode, void *arg)
+{
+	jack_latency_range_t range;
+	unsigned int c;
+
+	if (mode == JackCaptureLatency) {
+		jack_nframes_t aligned = 0;
+
+		for (c = 0; c < nchannels; c++) {
+			jack_port_get_latency_range (channels[c].input_port, mode, &range);
+			channels[c].upstream = range.max;
+		}
+		update_delays ();
+
+		/* without extra delays every output carries the same latency */
+		for (c = 0; c < nchannels; c++) {
+			jack_nframes_t total = channels[c].upstream + channels[c].target_delay;
+			if (total > aligned) {
+				aligned = total;
+			}
+		}
+		for (c = 0; c < nchannels; c++) {
+			range.min = range.max = channels[c].upstream + channels[c].target_delay;
+			jack_port_set_latency_range (channels[c].output_port, mode, &range);
+		}
+		reported_latency = aligned;
+	} else {
+		for (c = 0; c < nchannels; c++) {
+			jack_port_get_latency_range (channels[c].output_port, mode, &range);
+			range.min += channels[c].target_delay;
+			range.max += channels[c].target_delay;
+			jack_port_set_latency_range (channels[c].input_port, mode, &range);
+		}
+	}
+}
+
+int
+buffer_size_cb (jack_nframes_t nframes, void *arg)
+{
+	jack_nframes_t size = 1;
+	unsigned int c;
+
+	/* the ring has to hold the longest delay plus one period */
+	while (size < max_delay + nframes) {
+		size <<= 1;
+	}
+
+	free (fade_buffer);
+	fade_buffer = calloc (nframes, sizeof (jack_default_audio_sample_t));
+	if (fade_buffer == NULL) {
+		return -1;
+	}
+
+	if (size == ring_size) {
+		return 0;
+	}
+
+	for (c = 0; c < nchannels; c++) {
+		free (channels[c].ring);
+		channels[c].ring = calloc (size, sizeof (jack_default_audio_sample_t));
+		if (channels[c].ring == NULL) {
+			return -1;
+		}
+	}
+	ring_size = size;
+	ring_mask = size - 1;
+	write_index = 0;
+	return 0;
+}
+
+/**
+ * JACK calls this shutdown_callback if the server ever shuts down or
+ * decides to disconnect the client.
+ */
+void
+jack_shutdown (void *arg)
+{
+	fprintf(stderr, "JACK shut down, exiting ...\n");
+	exit (1);
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: jack_latency_compensator [ -c channels ] [ -m max-delay ] [ -n ] [ -d delay,... ]\n");
+	fprintf (stderr, "        -c, --channels <n>     Number of channels (default: %d)\n", DEFAULT_CHANNELS);
+	fprintf (stderr, "        -m, --max-delay <n>    Longest delay in frames (default: %d)\n", DEFAULT_MAX_DELAY);
+	fprintf (stderr, "        -n, --no-align         Do not align to the upstream latencies\n");
+	fprintf (stderr, "        -d, --delays <list>    Comma separated extra delay per channel in frames\n");
+	fprintf (stderr, "While running, \"channel frames\" lines on stdin change the extra delay of a channel.\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	const char *client_name = "latency_compensator";
+	const char *server_name = NULL;
+	jack_options_t options = JackNullOption;
+	jack_status_t status;
+	const char *delays = NULL;
+	char line[256];
+	unsigned int c;
+	int opt;
+	int option_index;
+	struct option long_options[] = {
+		{ "channels", 1, 0, 'c' },
+		{ "max-delay", 1, 0, 'm' },
+		{ "no-align", 0, 0, 'n' },
+		{ "delays", 1, 0, 'd' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long (argc, argv, "c:m:nd:h", long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'c':
+			nchannels = atoi (optarg);
+			break;
+		case 'm':
+			max_delay = atoi (optarg);
+			break;
+		case 'n':
+			auto_align = 0;
+			break;
+		case 'd':
+			delays = optarg;
+			break;
+		case 'h':
+			usage ();
+			exit (0);
+		default:
+			usage ();
+			exit (1);
+		}
+	}
+
+	if (nchannels < 1) {
+		usage ();
+		exit (1);
+	}
+
+	channels = calloc (nchannels, sizeof (channel_t));
+	if (channels == NULL) {
+		fprintf (stderr, "no memory");
+		exit(1);
+	}
+
+	for (c = 0; delays && c < nchannels; c++) {
+		channels[c].extra_delay = strtoul (delays, NULL, 10);
+		if ((delays = strchr (delays, ',')) != NULL) {
+			delays++;
+		}
+	}
+	update_delays ();
+	for (c = 0; c < nchannels; c++) {
+		channels[c].delay = channels[c].target_delay;
+	}
+
+	/* open a client connection to the JACK server */
+
+	client = jack_client_open (client_name, options, &status, server_name);
+	if (client == NULL) {
+		fprintf (stderr, "jack_client_open() failed, "
+			 "status = 0x%2.0x\n", status);
+		if (status & JackServerFailed) {
+			fprintf (stderr, "Unable to connect to JACK server\n");
+		}
+		exit (1);
+	}
+	if (status & JackNameNotUnique) {
+		client_name = jack_get_client_name(client);
+		fprintf (stderr, "unique name `%s' assigned\n", client_name);
+	}
+
+	if (buffer_size_cb (jack_get_buffer_size (client), NULL)) {
+		fprintf (stderr, "no memory");
+		exit (1);
+	}
+
+	jack_set_process_callback (client, process, 0);
+	jack_set_buffer_size_callback (client, buffer_size_cb, 0);
+	jack_set_latency_callback (client, latency_cb, 0);
+	jack_on_shutdown (client, jack_shutdown, 0);
+
+	for (c = 0; c < nchannels; c++) {
+		char name[32];
+
+		snprintf (name, sizeof (name), "in_%u", c + 1);
+		channels[c].input_port = jack_port_register (client, name,
+							     JACK_DEFAULT_AUDIO_TYPE,
+							     JackPortIsInput, 0);
+		snprintf (name, sizeof (name), "out_%u", c + 1);
+		channels[c].output_port = jack_port_register (client, name,
+							      JACK_DEFAULT_AUDIO_TYPE,
+							      JackPortIsOutput, 0);
+		if ((channels[c].input_port == NULL) || (channels[c].output_port == NULL)) {
+			fprintf(stderr, "no more JACK ports available\n");
+			exit (1);
+		}
+	}
+
+	if (jack_activate (client)) {
+		fprintf (stderr, "cannot activate client");
+		exit (1);
+	}
+
+	/* keep running until stopped by the user, taking delay changes */
+
+	while (fgets (line, sizeof (line), stdin)) {
+		unsigned int chan;
+		unsigned long frames;
+
+		if (sscanf (line, "%u %lu", &chan, &frames) != 2 || chan < 1 || chan > nchannels) {
+			fprintf (stderr, "expected \"channel frames\" with channel between 1 and %u\n", nchannels);
+			continue;
+		}
+		channels[chan - 1].extra_delay = frames;
+		update_delays ();
+		jack_recompute_total_latencies (client);
+		printf ("channel %u delayed by %" PRIu32 " frames, output latency %" PRIu32 " frames\n",
+			chan, channels[chan - 1].target_delay, reported_latency);
+	}
+
+#ifdef WIN32
+	Sleep (-1);
+#else
+	sleep (-1);
+#endif
+
+	jack_client_close (client);
+	return 0;
+}
@@ -0,0 +1,543 @@
+/** @file matrix_client.c
+ *
+ * @brief This client extends thru_client to an N x M gain matrix, as used
+ * for monitor mixes and downmixes.
+ *
+ * Only the cells with a non-zero gain are kept, one list per output, so
+ * a sparse routing costs no more than the connections it makes. Gain
+ * changes are ramped over a number of frames to avoid clicks. They can
+ * be written to standard input, or set on the client as JACK metadata
+ * under MATRIX_GAINS_KEY, with one "input output gain" line per cell;
+ * gains are linear unless followed by "dB".
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <getopt.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <jack/jack.h>
+#include <jack/ringbuffer.h>
+#include <jack/metadata.h>
+#include <jack/uuid.h>
+
+#define MATRIX_GAINS_KEY "urn:jack-example-tools:matrix:gains"
+#define DEFAULT_RAMP_FRAMES 256
+#define UPDATE_QUEUE_SIZE 4096
+
+typedef struct
+{
+    unsigned short input;
+    unsigned short output;
+    float gain;
+} cell_update_t;
+
+typedef struct
+{
+    unsigned int input;
+    float gain;
+    float target;
+    float step;
+    jack_nframes_t ramp_left;
+} cell_t;
+
+typedef struct
+{
+    cell_t *cells;          /* active cells feeding this output */
+    unsigned int count;
+} output_mix_t;
+
+jack_port_t **input_ports;
+jack_port_t **output_ports;
+jack_default_audio_sample_t **input_buffers;
+output_mix_t *mixes;
+unsigned int ninputs = 2;
+unsigned int noutputs = 2;
+jack_nframes_t ramp_frames = DEFAULT_RAMP_FRAMES;
+jack_ringbuffer_t *updates;
+pthread_mutex_t updates_lock = PTHREAD_MUTEX_INITIALIZER;
+jack_uuid_t client_uuid;
+jack_client_t *client;
+
+static void signal_handler ( int sig )
+{
+    jack_client_close ( client );
+    fprintf ( stderr, "signal received, exiting ...\n" );
+    exit ( 0 );
+}
+
+/**
+ * Apply a queued gain change to the cell list of its output. A new cell
+ * starts silent and ramps up, a cell ramping to zero is dropped from
+ * the list once the ramp is over.
+ */
+static void
+apply_update ( const cell_update_t *update )
+{
+    output_mix_t *mix = &mixes[update->output];
+    cell_t *cell = NULL;
+    unsigned int c;
+
+    for ( c = 0; c < mix->count; c++ )
+    {
+        if ( mix->cells[c].input == update->input )
+        {
+            cell = &mix->cells[c];
+            break;
+        }
+    }
+
+    if ( cell == NULL )
+    {
+        if ( update->gain == 0.0f )
+            return;
+        cell = &mix->cells[mix->count++];
+        cell->input = update->input;
+        cell->gain = 0.0f;
+    }
+
+    cell->target = update->gain;
+    if ( ramp_frames > 0 )
+    {
+        cell->step = ( cell->target - cell->gain ) / ramp_frames;
+        cell->ramp_left = ramp_frames;
+    }
+    else
+    {
+        cell->gain = cell->target;
+        cell->ramp_left = 0;
+    }
+}
+
+/**
+ * Add a ramping cell to an output buffer.
+ */
+static void
+mix_ramp ( cell_t *cell, const jack_default_audio_sample_t * restrict in,
+           jack_default_audio_sample_t * restrict out, jack_nframes_t nframes )
+{
+    jack_nframes_t ramp = ( cell->ramp_left < nframes ) ? cell->ramp_left : nframes;
+    const float gain = cell->gain;
+    const float step = cell->step;
+    float level;
+    jack_nframes_t k;
+
+    for ( k = 0; k < ramp; k++ )
+        out[k] += ( gain + ( k + 1 ) * step ) * in[k];
+
+    cell->ramp_left -= ramp;
+    cell->gain = ( cell->ramp_left == 0 ) ? cell->target : gain + ramp * step;
+    level = cell->gain;
+
+    for ( k = ramp; k < nframes; k++ )
+        out[k] += level * in[k];
+}
+
+/**
+ * Add four cells with constant gains to an output buffer. Summing four
+ * inputs per pass reads and writes the output a quarter as often; the
+ * loop is a chain of multiply-adds that the compiler vectorizes and,
+ * where the target has them, turns into FMA instructions.
+ */
+static void
+mix_steady4 ( const jack_default_audio_sample_t * const *in, const float *gain,
+              jack_default_audio_sample_t * restrict out, jack_nframes_t nframes )
+{
+    const jack_default_audio_sample_t * restrict in0 = in[0];
+    const jack_default_audio_sample_t * restrict in1 = in[1];
+    const jack_default_audio_sample_t * restrict in2 = in[2];
+    const jack_default_audio_sample_t * restrict in3 = in[3];
+    const float g0 = gain[0], g1 = gain[1], g2 = gain[2], g3 = gain[3];
+    jack_nframes_t k;
+
+    for ( k = 0; k < nframes; k++ )
+        out[k] += g0 * in0[k] + g1 * in1[k] + g2 * in2[k] + g3 * in3[k];
+}
+
+static void
+mix_steady ( const jack_default_audio_sample_t * restrict in, float gain,
+             jack_default_audio_sample_t * restrict out, jack_nframes_t nframes )
+{
+    jack_nframes_t k;
+
+    for ( k = 0; k < nframes; k++ )
+        out[k] += gain * in[k];
+}
+
+/**
+ * The process callback for this JACK application is called in a
+ * special realtime thread once for each audio cycle.
+ *
+ * Pending gain changes are taken from the lock-free queue first, then
+ * every output sums its active cells.
+ */
+
+int
+process ( jack_nframes_t nframes, void *arg )
+{
+    cell_update_t update;
+    unsigned int i, o, c;
+
+    while ( jack_ringbuffer_read_space ( updates ) >= sizeof ( update ) )
+    {
+        jack_ringbuffer_read ( updates, ( char * ) &update, sizeof ( update ) );
+        apply_update ( &update );
+    }
+
+    for ( i = 0; i < ninputs; i++ )
+        input_buffers[i] = jack_port_get_buffer ( input_ports[i], nframes );
+
+    for ( o = 0; o < noutputs; o++ )
+    {
+        output_mix_t *mix = &mixes[o];
+        jack_default_audio_sample_t *out = jack_port_get_buffer ( output_ports[o], nframes );
+        const jack_default_audio_sample_t *in[4];
+        float gain[4];
+        unsigned int pending = 0;
+
+        memset ( out, 0, nframes * sizeof ( jack_default_audio_sample_t ) );
+
+        for ( c = 0; c < mix->count; c++ )
+        {
+            cell_t *cell = &mix->cells[c];
+
+            if ( cell->ramp_left > 0 )
+            {
+                mix_ramp ( cell, input_buffers[cell->input], out, nframes );
+                continue;
+            }
+            in[pending] = input_buffers[cell->input];
+            gain[pending] = cell->gain;
+            if ( ++pending == 4 )
+            {
+                mix_steady4 ( in, gain, out, nframes );
+                pending = 0;
+            }
+        }
+        for ( c = 0; c < pending; c++ )
+            mix_steady ( in[c], gain[c], out, nframes );
+
+        /* drop the cells that have faded out */
+        for ( c = 0; c < mix->count; )
+        {
+            if ( mix->cells[c].gain == 0.0f && mix->cells[c].ramp_left == 0 )
+                mix->cells[c] = mix->cells[--mix->count];
+            else
+                c++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Parse "input output gain" lines, with 1-based port numbers, and queue
+ * them for the process thread. Returns the number of cells queued.
+ */
+static int
+queue_gains ( const char *text )
+{
+    int queued = 0;
+
+    while ( *text )
+    {
+        cell_update_t update;
+        unsigned int input, output;
+        double gain;
+        char buf[256];
+        char *end;
+        int consumed;
+        size_t len = strcspn ( text, "\n" );
+
+        snprintf ( buf, sizeof ( buf ), "%.*s", ( int ) len, text );
+        if ( sscanf ( buf, " %u %u%n", &input, &output, &consumed ) == 2 )
+        {
+            gain = strtod ( buf + consumed, &end );
+            if ( end != buf + consumed && input >= 1 && input <= ninputs && output >= 1 && output <= noutputs )
+            {
+                if ( strncmp ( end, "dB", 2 ) == 0 )
+                    gain = ( gain <= -144.0 ) ? 0.0 : pow ( 10.0, gain / 20.0 );
+                update.input = input - 1;
+                update.output = output - 1;
+                update.gain = gain;
+                pthread_mutex_lock ( &updates_lock );
+                if ( jack_ringbuffer_write_space ( updates ) >= sizeof ( update ) )
+                {
+                    jack_ringbuffer_write ( updates, ( const char * ) &update, sizeof ( update ) );
+                    queued++;
+                }
+                else
+                {
+                    fprintf ( stderr, "gain queue full, dropping %u %u\n", input, output );
+                }
+                pthread_mutex_unlock ( &updates_lock );
+            }
+            else
+            {
+                fprintf ( stderr, "ignoring bad matrix cell \"%s\"\n", buf );
+            }
+        }
+
+        text += len;
+        if ( *text )
+            text++;
+    }
+    return queued;
+}
+
+/**
+ * Re-read the gains whenever MATRIX_GAINS_KEY is set on this client.
+ */
+void
+property_change ( jack_uuid_t subject, const char *key, jack_property_change_t change, void *arg )
+{
+    char *value = NULL;
+    char *type = NULL;
+
+    if ( change == PropertyDeleted || key == NULL || strcmp ( key, MATRIX_GAINS_KEY ) != 0
+            || jack_uuid_compare ( subject, client_uuid ) != 0 )
+        return;
+
+    if ( jack_get_property ( subject, key, &value, &type ) == 0 )
+    {
+        queue_gains ( value );
+        jack_free ( value );
+        if ( type )
+            jack_free ( type );
+    }
+}
+
+/**
+ * JACK calls this shutdown_callback if the server ever shuts down or
+ * decides to disconnect the client.
+ */
+void
+jack_shutdown ( void *arg )
+{
+    free ( input_ports );
+    free ( output_ports );
+    exit ( 1 );
+}
+
+static void
+usage ( void )
+{
+    fprintf ( stderr, "usage: jack_matrix_client [ -i inputs ] [ -o outputs ] [ -r frames ] [ -z ] [ name [ server ] ]\n" );
+    fprintf ( stderr, "        -i, --inputs <n>     Number of input ports (default: 2)\n" );
+    fprintf ( stderr, "        -o, --outputs <n>    Number of output ports (default: 2)\n" );
+    fprintf ( stderr, "        -r, --ramp <n>       Gain ramp length in frames (default: %d)\n", DEFAULT_RAMP_FRAMES );
+    fprintf ( stderr, "        -z, --silent         Start with all cells at zero instead of straight through\n" );
+    fprintf ( stderr, "Gains are read as \"input output gain[dB]\" lines from stdin or from the\n" );
+    fprintf ( stderr, "%s property of the client.\n", MATRIX_GAINS_KEY );
+}
+
+int
+main ( int argc, char *argv[] )
+{
+    unsigned int i;
+    const char *client_name;
+    const char *server_name = NULL;
+    jack_options_t options = JackNullOption;
+    jack_status_t status;
+    char *uuid;
+    char line[256];
+    int silent = 0;
+    int opt;
+    int option_index;
+    struct option long_options[] =
+    {
+        { "inputs", 1, 0, 'i' },
+        { "outputs", 1, 0, 'o' },
+        { "ramp", 1, 0, 'r' },
+        { "silent", 0, 0, 'z' },
+        { "help", 0, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ( ( opt = getopt_long ( argc, argv, "i:o:r:zh", long_options, &option_index ) ) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'i':
+            ninputs = atoi ( optarg );
+            break;
+        case 'o':
+            noutputs = atoi ( optarg );
+            break;
+        case 'r':
+            ramp_frames = atoi ( optarg );
+            break;
+        case 'z':
+            silent = 1;
+            break;
+        case 'h':
+            usage ();
+            exit ( 0 );
+        default:
+            usage ();
+            exit ( 1 );
+        }
+    }
+
+    if ( ninputs < 1 || ninputs > 65535 || noutputs < 1 || noutputs > 65535 )
+    {
+        usage ();
+        exit ( 1 );
+    }
+
+    if ( optind < argc )        /* client name specified? */
+    {
+        client_name = argv[optind];
+        if ( optind + 1 < argc )    /* server name specified? */
+        {
+            server_name = argv[optind + 1];
+            options |= JackServerName;
+        }
+    }
+    else              /* use basename of argv[0] */
+    {
+        client_name = strrchr ( argv[0], '/' );
+        if ( client_name == 0 )
+        {
+            client_name = argv[0];
+        }
+        else
+        {
+            client_name++;
+        }
+    }
+
+    /* every output can hold a cell for each input, so the process
+       thread never allocates */
+
+    input_ports = ( jack_port_t** ) calloc ( ninputs, sizeof ( jack_port_t* ) );
+    output_ports = ( jack_port_t** ) calloc ( noutputs, sizeof ( jack_port_t* ) );
+    input_buffers = ( jack_default_audio_sample_t** ) calloc ( ninputs, sizeof ( jack_default_audio_sample_t* ) );
+    mixes = ( output_mix_t* ) calloc ( noutputs, sizeof ( output_mix_t ) );
+    updates = jack_ringbuffer_create ( UPDATE_QUEUE_SIZE * sizeof ( cell_update_t ) );
+    if ( !input_ports || !output_ports || !input_buffers || !mixes || !updates )
+    {
+        fprintf ( stderr, "no memory\n" );
+        exit ( 1 );
+    }
+    for ( i = 0; i < noutputs; i++ )
+    {
+        mixes[i].cells = ( cell_t* ) calloc ( ninputs, sizeof ( cell_t ) );
+        if ( mixes[i].cells == NULL )
+        {
+            fprintf ( stderr, "no memory\n" );
+            exit ( 1 );
+        }
+        if ( !silent && i < ninputs )
+        {
+            mixes[i].cells[0].input = i;
+            mixes[i].cells[0].gain = mixes[i].cells[0].target = 1.0f;
+            mixes[i].count = 1;
+        }
+    }
+
+    /* open a client connection to the JACK server */
+
+    client = jack_client_open ( client_name, options, &status, server_name );
+    if ( client == NULL )
+    {
+        fprintf ( stderr, "jack_client_open() failed, "
+                  "status = 0x%2.0x\n", status );
+        if ( status & JackServerFailed )
+        {
+            fprintf ( stderr, "Unable to connect to JACK server\n" );
+        }
+        exit ( 1 );
+    }
+    if ( status & JackServerStarted )
+    {
+        fprintf ( stderr, "JACK server started\n" );
+    }
+    if ( status & JackNameNotUnique )
+    {
+        client_name = jack_get_client_name ( client );
+        fprintf ( stderr, "unique name `%s' assigned\n", client_name );
+    }
+
+    uuid = jack_client_get_uuid ( client );
+    if ( uuid == NULL || jack_uuid_parse ( uuid, &client_uuid ) )
+    {
+        fprintf ( stderr, "cannot get the client UUID, metadata control disabled\n" );
+    }
+    else if ( jack_set_property_change_callback ( client, property_change, 0 ) )
+    {
+        fprintf ( stderr, "cannot set property change callback, metadata control disabled\n" );
+    }
+    jack_free ( uuid );
+
+    jack_set_process_callback ( client, process, 0 );
+    jack_on_shutdown ( client, jack_shutdown, 0 );
+
+    for ( i = 0; i < ninputs; i++ )
+    {
+        char port_name[32];
+
+        snprintf ( port_name, sizeof ( port_name ), "input_%u", i + 1 );
+        input_ports[i] = jack_port_register ( client, port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0 );
+        if ( input_ports[i] == NULL )
+        {
+            fprintf ( stderr, "no more JACK ports available\n" );
+            exit ( 1 );
+        }
+    }
+    for ( i = 0; i < noutputs; i++ )
+    {
+        char port_name[32];
+
+        snprintf ( port_name, sizeof ( port_name ), "output_%u", i + 1 );
+        output_ports[i] = jack_port_register ( client, port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0 );
+        if ( output_ports[i] == NULL )
+        {
+            fprintf ( stderr, "no more JACK ports available\n" );
+            exit ( 1 );
+        }
+    }
+
+    /* Tell the JACK server that we are ready to roll.  Our
+     * process() callback will start running now. */
+
+    if ( jack_activate ( client ) )
+    {
+        fprintf ( stderr, "cannot activate client" );
+        exit ( 1 );
+    }
+
+    /* install a signal handler to properly quits jack client */
+#ifdef WIN32
+    signal ( SIGINT, signal_handler );
+    signal ( SIGABRT, signal_handler );
+    signal ( SIGTERM, signal_handler );
+#else
+    signal ( SIGQUIT, signal_handler );
+    signal ( SIGTERM, signal_handler );
+    signal ( SIGHUP, signal_handler );
+    signal ( SIGINT, signal_handler );
+#endif
+
+    /* take gain changes from stdin until it is closed */
+
+    while ( fgets ( line, sizeof ( line ), stdin ) )
+        queue_gains ( line );
+
+    while (1)
+    {
+#ifdef WIN32
+        Sleep ( 1000 );
+#else
+        sleep ( 1 );
+#endif
+    }
+
+    jack_client_close ( client );
+    exit ( 0 );
+}
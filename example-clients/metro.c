@@ -30,8 +30,27 @@
 #include <jack/jack.h>
 #include <jack/transport.h>
 
+#define MAX_CLICKS 8
+#define DEFAULT_BEATS_PER_BAR 4
+
 typedef jack_default_audio_sample_t sample_t;
 
+/* One click being played from the click table. start is the first
+   frame of the current cycle it sounds in, pos the read position in
+   table samples at that frame. */
+typedef struct {
+	int active;
+	jack_nframes_t start;
+	float pos;
+	float rate;
+	float gain;
+} click_t;
+
+/* click levels: muted, subdivision, beat, accent, the accent is also
+   played a fifth higher */
+static const float level_gain[4] = { 0.0f, 0.35f, 0.7f, 1.0f };
+static const float level_rate[4] = { 1.0f, 1.0f, 1.0f, 1.5f };
+
 const double PI = 3.14;
 
 jack_client_t *client;
@@ -45,6 +64,20 @@ long offset = 0;
 int transport_aware = 0;
 jack_transport_state_t transport_state;
 
+int bbt_aware = 0;
+int subdivisions = 1;
+const char *accent_pattern = NULL;
+sample_t *click_table;
+click_t clicks[MAX_CLICKS];
+
+/* beat position tracking of the BBT mode, owned by the process thread */
+int tracking = 0;
+double last_beats;
+double last_beats_per_frame;
+jack_nframes_t last_frame;
+jack_nframes_t last_nframes;
+int64_t last_unit;
+
 static void signal_handler(int sig)
 {
 	jack_client_close(client);
@@ -64,7 +97,10 @@ usage ()
 "              [ --decay OR -d decay (in percent of duration) ]\n"
 "              [ --name OR -n jack name for metronome client ]\n"
 "              [ --transport OR -t transport aware ]\n"
-"              --bpm OR -b beats per minute\n"
+"              [ --bbt OR -B follow the transport BBT position ]\n"
+"              [ --pattern OR -p accent levels per beat (0-3, default 32) ]\n"
+"              [ --subdivide OR -s clicks per beat ]\n"
+"              --bpm OR -b beats per minute (optional with -B)\n"
 );
 }
 
@@ -104,9 +140,179 @@ process_audio (jack_nframes_t nframes)
 	*/
 }
 
+static int
+beat_level (int64_t beat, int beats_per_bar)
+{
+	int in_bar = ((beat % beats_per_bar) + beats_per_bar) % beats_per_bar;
+
+	if (accent_pattern == NULL) {
+		return in_bar == 0 ? 3 : 2;
+	}
+	return accent_pattern[in_bar % strlen (accent_pattern)] - '0';
+}
+
+/* Start a click offset frames into the cycle, the fraction becomes the
+   initial read position so the click lands between samples. */
+static void
+start_click (double offset, int level)
+{
+	click_t *c = &clicks[0];
+	int i;
+
+	if (level_gain[level] == 0.0f) {
+		return;
+	}
+	for (i = 0; i < MAX_CLICKS; i++) {
+		if (!clicks[i].active) {
+			c = &clicks[i];
+			break;
+		}
+		if (clicks[i].pos > c->pos) {
+			c = &clicks[i];
+		}
+	}
+	if (offset < 0) {
+		offset = 0;
+	}
+	c->active = 1;
+	c->start = (jack_nframes_t) ceil (offset);
+	c->rate = level_rate[level];
+	c->gain = level_gain[level];
+	c->pos = (c->start - offset) * c->rate;
+}
+
+/* Mix the active clicks with linear interpolation, at most MAX_CLICKS
+   passes over the buffer whatever the tempo. */
+static void
+render_clicks (sample_t *buffer, jack_nframes_t nframes)
+{
+	const float end = tone_length;
+	int i;
+
+	memset (buffer, 0, sizeof (sample_t) * nframes);
+
+	for (i = 0; i < MAX_CLICKS; i++) {
+		click_t *c = &clicks[i];
+		float pos = c->pos;
+		float rate = c->rate;
+		float gain = c->gain;
+		jack_nframes_t n;
+
+		if (!c->active) {
+			continue;
+		}
+		for (n = c->start; n < nframes && pos < end; n++) {
+			int k = (int) pos;
+			float f = pos - k;
+			buffer[n] += gain * (click_table[k] + f * (click_table[k + 1] - click_table[k]));
+			pos += rate;
+		}
+		c->pos = pos;
+		c->start = 0;
+		if (pos >= end) {
+			c->active = 0;
+		}
+	}
+}
+
+/* Where the transport is in beats at the start of the cycle. With a
+   timebase master this comes from the BBT fields, otherwise from the
+   frame and the tempo given on the command line. As ticks are whole
+   numbers, a rolling transport keeps its own fractional position and
+   only resyncs when the BBT moves by more than a tick from it. */
+static int
+transport_beats (const jack_position_t *pos, double *beats, double *beats_per_frame, int *beats_per_bar)
+{
+	jack_nframes_t rate = pos->frame_rate ? pos->frame_rate : sr;
+	double tolerance = 0.0;
+
+	if (pos->valid & JackPositionBBT) {
+		if (pos->beats_per_minute <= 0 || pos->ticks_per_beat <= 0 || pos->beats_per_bar < 1) {
+			return -1;
+		}
+		*beats_per_bar = (int) pos->beats_per_bar;
+		*beats_per_frame = pos->beats_per_minute / (60.0 * rate);
+		*beats = (pos->bar - 1) * (double) *beats_per_bar + (pos->beat - 1)
+			 + pos->tick / pos->ticks_per_beat;
+		if (pos->valid & JackBBTFrameOffset) {
+			*beats += pos->bbt_offset * *beats_per_frame;
+		}
+		tolerance = 1.0 / pos->ticks_per_beat;
+	} else if (bpm > 0) {
+		*beats_per_bar = DEFAULT_BEATS_PER_BAR;
+		*beats_per_frame = bpm / (60.0 * rate);
+		*beats = pos->frame * *beats_per_frame;
+	} else {
+		return -1;
+	}
+
+	if (tracking && pos->frame == last_frame + last_nframes) {
+		double predicted = last_beats + last_nframes * last_beats_per_frame;
+		if (fabs (*beats - predicted) <= tolerance + 1e-9) {
+			*beats = predicted;
+		}
+	}
+	return 0;
+}
+
+static void
+process_bbt (jack_nframes_t nframes)
+{
+	sample_t *buffer = (sample_t *) jack_port_get_buffer (output_port, nframes);
+	jack_position_t pos;
+	double beats, beats_per_frame, unit, frames_per_unit;
+	int beats_per_bar;
+	int started = 0;
+	int64_t k;
+
+	if (jack_transport_query (client, &pos) != JackTransportRolling
+	    || transport_beats (&pos, &beats, &beats_per_frame, &beats_per_bar) != 0) {
+		memset (clicks, 0, sizeof (clicks));
+		tracking = 0;
+		process_silence (nframes);
+		return;
+	}
+
+	/* clicks fall on multiples of 1/subdivisions beat, find the ones
+	   inside this cycle at their exact fractional frame */
+	unit = beats * subdivisions;
+	frames_per_unit = 1.0 / (beats_per_frame * subdivisions);
+	for (k = (int64_t) ceil (unit - 1e-6); started < MAX_CLICKS; k++) {
+		double offset = (k - unit) * frames_per_unit;
+		int64_t beat;
+
+		if (offset >= nframes) {
+			break;
+		}
+		if (tracking && k == last_unit) {
+			continue;
+		}
+		beat = k / subdivisions;
+		if (k % subdivisions) {
+			start_click (offset, 1);
+		} else {
+			start_click (offset, beat_level (beat, beats_per_bar));
+		}
+		last_unit = k;
+		started++;
+	}
+
+	render_clicks (buffer, nframes);
+
+	tracking = 1;
+	last_beats = beats;
+	last_beats_per_frame = beats_per_frame;
+	last_frame = pos.frame;
+	last_nframes = nframes;
+}
+
 static int
 process (jack_nframes_t nframes, void *arg)
 {
+	if (bbt_aware) {
+		process_bbt (nframes);
+		return 0;
+	}
 	if (transport_aware) {
 		jack_position_t pos;
 
@@ -137,7 +343,7 @@ main (int argc, char *argv[])
 	char *bpm_string = "bpm";
 	jack_status_t status;
 
-	const char *options = "f:A:D:a:d:b:n:thv";
+	const char *options = "f:A:D:a:d:b:n:tBp:s:hv";
 	struct option long_options[] =
 	{
 		{"frequency", 1, 0, 'f'},
@@ -148,6 +354,9 @@ main (int argc, char *argv[])
 		{"bpm", 1, 0, 'b'},
 		{"name", 1, 0, 'n'},
 		{"transport", 0, 0, 't'},
+		{"bbt", 0, 0, 'B'},
+		{"pattern", 1, 0, 'p'},
+		{"subdivide", 1, 0, 's'},
 		{"help", 0, 0, 'h'},
 		{"verbose", 0, 0, 'v'},
 		{0, 0, 0, 0}
@@ -202,6 +411,22 @@ main (int argc, char *argv[])
 		case 't':
 			transport_aware = 1;
 			break;
+		case 'B':
+			bbt_aware = 1;
+			break;
+		case 'p':
+			if (optarg[0] == '\0' || strspn (optarg, "0123") != strlen (optarg)) {
+				fprintf (stderr, "invalid accent pattern\n");
+				return -1;
+			}
+			accent_pattern = optarg;
+			break;
+		case 's':
+			if ((subdivisions = atoi (optarg)) < 1) {
+				fprintf (stderr, "invalid subdivision\n");
+				return -1;
+			}
+			break;
 		default:
 			fprintf (stderr, "unknown option %c\n", opt);
 		case 'h':
@@ -209,7 +434,7 @@ main (int argc, char *argv[])
 			return -1;
 		}
 	}
-	if (!got_bpm) {
+	if (!got_bpm && !bbt_aware) {
 		fprintf (stderr, "bpm not specified\n");
 		usage ();
 		return -1;
@@ -230,13 +455,13 @@ main (int argc, char *argv[])
 	sr = jack_get_sample_rate (client);
 
 	/* setup wave table parameters */
-	wave_length = 60 * sr / bpm;
+	wave_length = bpm ? 60 * sr / bpm : 0;
 	tone_length = sr * dur_arg / 1000;
 	attack_length = tone_length * attack_percent / 100;
 	decay_length = tone_length * decay_percent / 100;
 	scale = 2 * PI * freq / sr;
 
-	if (tone_length >= wave_length) {
+	if (tone_length == 0 || (!bbt_aware && tone_length >= wave_length)) {
 		fprintf (stderr, "invalid duration (tone length = %u, wave length = %u\n", tone_length, wave_length);
 		return -1;
 	}
@@ -245,8 +470,10 @@ main (int argc, char *argv[])
 		return -1;
 	}
 
-	/* Build the wave table */
+	/* Build the wave table, the click table holds the tone alone plus a
+	   silent guard sample for the interpolation */
 	wave = (sample_t *) malloc (wave_length * sizeof(sample_t));
+	click_table = (sample_t *) malloc ((tone_length + 1) * sizeof(sample_t));
 	amp = (double *) malloc (tone_length * sizeof(double));
 
 	for (i = 0; i < attack_length; i++) {
@@ -259,10 +486,11 @@ main (int argc, char *argv[])
 		amp[i] = - max_amp * (i - (double) tone_length) / ((double) decay_length);
 	}
 	for (i = 0; i < (int)tone_length; i++) {
-		wave[i] = amp[i] * sin (scale * i);
+		click_table[i] = amp[i] * sin (scale * i);
 	}
-	for (i = tone_length; i < (int)wave_length; i++) {
-		wave[i] = 0;
+	click_table[tone_length] = 0;
+	for (i = 0; i < (int)wave_length; i++) {
+		wave[i] = i < (int)tone_length ? click_table[i] : 0;
 	}
 
 	if (jack_activate (client)) {
@@ -296,5 +524,6 @@ main (int argc, char *argv[])
 error:
 	free(amp);
 	free(wave);
+	free(click_table);
 	exit (0);
 }
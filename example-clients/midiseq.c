@@ -21,15 +21,22 @@
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 jack_client_t *client;
 jack_port_t *output_port;
 
-unsigned char* note_frqs;
-jack_nframes_t* note_starts;
-jack_nframes_t* note_lengths;
-jack_nframes_t num_notes;
+/* A note on or note off, at a frame offset within the loop */
+typedef struct {
+	jack_nframes_t time;
+	unsigned char data[3];
+} seq_event_t;
+
+seq_event_t* events;
+jack_nframes_t num_events;
+jack_nframes_t event_index;
 jack_nframes_t loop_nsamp;
 jack_nframes_t loop_index;
 
@@ -43,46 +50,134 @@ static void signal_handler(int sig)
 static void usage()
 {
 	fprintf(stderr, "usage: jack_midiseq name nsamp [startindex note nsamp] ...... [startindex note nsamp]\n");
+	fprintf(stderr, "       jack_midiseq name nsamp -f file\n");
 	fprintf(stderr, "eg: jack_midiseq Sequencer 24000 0 60 8000 12000 63 8000\n");
 	fprintf(stderr, "will play a 1/2 sec loop (if srate is 48khz) with a c4 note at the start of the loop\n");
-    fprintf(stderr, "that lasts for 8000 samples, then a d4# that starts at 1/4 sec that lasts for 8000 samples\n");
+	fprintf(stderr, "that lasts for 8000 samples, then a d4# that starts at 1/4 sec that lasts for 8000 samples\n");
+	fprintf(stderr, "with -f, the \"startindex note nsamp\" triples are read from file\n");
 }
 
 static int process(jack_nframes_t nframes, void *arg)
 {
-	int i,j;
+	jack_nframes_t pos = 0;
 	void* port_buf = jack_port_get_buffer(output_port, nframes);
 	unsigned char* buffer;
 	jack_midi_clear_buffer(port_buf);
-	/*memset(buffer, 0, nframes*sizeof(jack_default_audio_sample_t));*/
-
-	for (i = 0; i < nframes; i++) {
-		for (j = 0; j < num_notes; j++) {
-			if (note_starts[j] == loop_index) {
-				if ((buffer = jack_midi_event_reserve(port_buf, i, 3))) {
-					/* printf("wrote a note on, port buffer = 0x%x, event buffer = 0x%x\n", port_buf, buffer); */
-					buffer[2] = 64;		/* velocity */
-					buffer[1] = note_frqs[j];
-					buffer[0] = 0x90;	/* note on */
-				}
-			} else if (note_starts[j] + note_lengths[j] == loop_index) {
-				if ((buffer = jack_midi_event_reserve(port_buf, i, 3))) {
-					/* printf("wrote a note off, port buffer = 0x%x, event buffer = 0x%x\n", port_buf, buffer); */
-					buffer[2] = 64;		/* velocity */
-					buffer[1] = note_frqs[j];
-					buffer[0] = 0x80;	/* note off */
+
+	/* walk the sorted event list from where the last cycle stopped, only
+	   touching the events that fall into this period */
+
+	while (pos < nframes) {
+		jack_nframes_t span = nframes - pos;
+		jack_nframes_t end;
+
+		if (span > loop_nsamp - loop_index) {
+			span = loop_nsamp - loop_index;
+		}
+		end = loop_index + span;
+
+		while (event_index < num_events && events[event_index].time < end) {
+			seq_event_t* ev = &events[event_index++];
+			if ((buffer = jack_midi_event_reserve(port_buf, pos + ev->time - loop_index, 3))) {
+				buffer[0] = ev->data[0];
+				buffer[1] = ev->data[1];
+				buffer[2] = ev->data[2];
+			}
+		}
+
+		pos += span;
+		loop_index = end;
+		if (loop_index >= loop_nsamp) {
+			loop_index = 0;
+			event_index = 0;
+		}
+	}
+	return 0;
+}
+
+static int compare_events(const void* a, const void* b)
+{
+	const seq_event_t* ea = (const seq_event_t*) a;
+	const seq_event_t* eb = (const seq_event_t*) b;
+
+	if (ea->time != eb->time) {
+		return ea->time < eb->time ? -1 : 1;
+	}
+	/* note offs go first, so a note can be retriggered on the same frame */
+	return (int) ea->data[0] - (int) eb->data[0];
+}
+
+static void add_note(jack_nframes_t start, unsigned char note, jack_nframes_t length)
+{
+	if (start >= loop_nsamp) {
+		fprintf(stderr, "note %d at %u starts after the end of the loop, ignored\n", note, start);
+		return;
+	}
+
+	events[num_events].time = start;
+	events[num_events].data[0] = 0x90;	/* note on */
+	events[num_events].data[1] = note;
+	events[num_events].data[2] = 64;	/* velocity */
+	num_events++;
+
+	events[num_events].time = (jack_nframes_t) (((uint64_t) start + length) % loop_nsamp);
+	events[num_events].data[0] = 0x80;	/* note off */
+	events[num_events].data[1] = note;
+	events[num_events].data[2] = 64;	/* velocity */
+	num_events++;
+}
+
+static int load_pattern(const char* path)
+{
+	FILE* fp;
+	char line[256];
+	size_t max_events = 0;
+	unsigned int start, note, length;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "cannot open pattern file %s\n", path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char* p = line;
+		int n;
+
+		lineno++;
+		while (sscanf(p, "%u %u %u%n", &start, &note, &length, &n) == 3) {
+			if (num_events + 2 > max_events) {
+				seq_event_t* tmp;
+				max_events = max_events ? max_events * 2 : 1024;
+				if ((tmp = realloc(events, max_events * sizeof(seq_event_t))) == NULL) {
+					fprintf(stderr, "out of memory\n");
+					fclose(fp);
+					return -1;
 				}
+				events = tmp;
 			}
+			add_note(start, note, length);
+			p += n;
+		}
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			p++;
+		}
+		if (*p && *p != '#') {
+			fprintf(stderr, "%s:%d: expected \"startindex note nsamp\" triples\n", path, lineno);
+			fclose(fp);
+			return -1;
 		}
-		loop_index = loop_index+1 >= loop_nsamp ? 0 : loop_index+1;
 	}
+
+	fclose(fp);
 	return 0;
 }
 
 int main(int narg, char **args)
 {
 	int i;
-	if ((narg<6) || ((narg-3)%3 != 0)) {
+	int from_file = (narg == 5 && strcmp(args[3], "-f") == 0);
+	if (!from_file && ((narg<6) || ((narg-3)%3 != 0))) {
 		usage();
 		exit(1);
 	}
@@ -94,16 +189,25 @@ int main(int narg, char **args)
 	output_port = jack_port_register (client, "out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
 
 	loop_index = 0;
-	num_notes = (narg - 3)/3;
-	note_frqs = malloc(num_notes*sizeof(unsigned char));
-	note_starts = malloc(num_notes*sizeof(jack_nframes_t));
-	note_lengths = malloc(num_notes*sizeof(jack_nframes_t));
+	event_index = 0;
+	num_events = 0;
 	loop_nsamp = atoi(args[2]);
-	for (i = 0; i < num_notes; i++) {
-		note_starts[i] = atoi(args[3 + 3*i]);
-		note_frqs[i] = atoi(args[4 + 3*i]);
-		note_lengths[i] = atoi(args[5 + 3*i]);
+	if (loop_nsamp == 0) {
+		usage();
+		exit(1);
+	}
+	if (from_file) {
+		if (load_pattern(args[4])) {
+			jack_client_close(client);
+			exit(1);
+		}
+	} else {
+		events = malloc((narg - 3)/3 * 2 * sizeof(seq_event_t));
+		for (i = 3; i < narg; i += 3) {
+			add_note(atoi(args[i]), atoi(args[i + 1]), atoi(args[i + 2]));
+		}
 	}
+	qsort(events, num_events, sizeof(seq_event_t), compare_events);
 
 	if (jack_activate(client)) {
 		fprintf (stderr, "cannot activate client");
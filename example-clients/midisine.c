@@ -24,15 +24,39 @@
 #include <signal.h>
 #include <math.h>
 #include <inttypes.h>
+#include <getopt.h>
 
 #include <jack/jack.h>
 #include <jack/midiport.h>
 
+#define MAX_VOICES 256
+#define RAMP_FRAMES 64		/* attack and release time of a voice */
+#define BLOCK_FRAMES 128	/* frames rendered from one phase anchor */
+
+enum {
+	VOICE_IDLE,
+	VOICE_ON,
+	VOICE_RELEASED
+};
+
+typedef struct {
+	float phase;		/* in cycles, [0, 1) */
+	float inc;		/* cycles per frame */
+	float gain;
+	float step;		/* gain change per frame while ramping */
+	float target;
+	jack_nframes_t ramp_left;
+	uint32_t age;
+	unsigned char note;
+	unsigned char state;
+} voice_t;
+
 jack_port_t *input_port;
 jack_port_t *output_port;
-jack_default_audio_sample_t ramp=0.0;
-jack_default_audio_sample_t note_on;
-unsigned char note = 0;
+voice_t voices[MAX_VOICES];
+int polyphony = 1;
+float voice_gain = 1.0f;
+uint32_t voice_clock = 0;
 jack_default_audio_sample_t note_frqs[128];
 
 jack_client_t *client;
@@ -49,57 +73,215 @@ static void calc_note_frqs(jack_default_audio_sample_t srate)
 	int i;
 	for(i=0; i<128; i++)
 	{
-		note_frqs[i] = (2.0 * 440.0 / 32.0) * pow(2, (((jack_default_audio_sample_t)i - 9.0) / 12.0)) / srate;
+		note_frqs[i] = (440.0 / 32.0) * pow(2, (((jack_default_audio_sample_t)i - 9.0) / 12.0)) / srate;
 	}
 }
 
-static int process(jack_nframes_t nframes, void *arg)
+/*
+ * sin(2 pi t) for t in [0, 1). The argument is folded into a quarter
+ * period and evaluated with an odd minimax polynomial, which keeps the
+ * error below 1e-6 and has no branches, so the render loops below can
+ * be vectorized by the compiler.
+ */
+static inline float poly_sin(float t)
+{
+	float x = 0.5f - t;		/* sin(2 pi t) == sin(2 pi x), x in (-0.5, 0.5] */
+	float a = fabsf(x);
+	float z, z2, s;
+
+	a = (a < 0.5f - a) ? a : 0.5f - a;
+	z = 6.28318531f * a;
+	z2 = z * z;
+	s = z * (0.99999661f + z2 * (-0.16664824f + z2 * (0.00830629f + z2 * -0.00018363f)));
+	return copysignf(s, x);
+}
+
+/*
+ * Add nframes of one voice to out. The phase of every frame is derived
+ * from the phase at the start of the block rather than accumulated, so
+ * there is no dependency between frames and the loops vectorize.
+ */
+static void render_voice(voice_t *v, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	while (nframes > 0) {
+		jack_nframes_t len = (nframes < BLOCK_FRAMES) ? nframes : BLOCK_FRAMES;
+		jack_nframes_t ramp = (v->ramp_left < len) ? v->ramp_left : len;
+		const float phase = v->phase;
+		const float inc = v->inc;
+		const float gain = v->gain;
+		const float step = v->step;
+		float level;
+		float p;
+		int k;
+
+		for (k = 0; k < (int)ramp; k++) {
+			p = phase + k * inc;
+			p -= (int)p;
+			out[k] += (gain + (k + 1) * step) * poly_sin(p);
+		}
+		if (ramp > 0) {
+			v->ramp_left -= ramp;
+			v->gain = (v->ramp_left == 0) ? v->target : gain + ramp * step;
+		}
+		level = v->gain;
+		for (k = ramp; k < (int)len; k++) {
+			p = phase + k * inc;
+			p -= (int)p;
+			out[k] += level * poly_sin(p);
+		}
+
+		p = phase + len * inc;
+		v->phase = p - (int)p;
+		out += len;
+		nframes -= len;
+	}
+
+	if (v->state == VOICE_RELEASED && v->ramp_left == 0) {
+		v->state = VOICE_IDLE;
+	}
+}
+
+static void voice_ramp(voice_t *v, float target)
+{
+	v->target = target;
+	v->step = (target - v->gain) / RAMP_FRAMES;
+	v->ramp_left = RAMP_FRAMES;
+}
+
+/*
+ * Pick a voice for a new note: the one already playing it, an idle one,
+ * or else the oldest voice, preferring released ones.
+ */
+static voice_t *voice_alloc(unsigned char note)
+{
+	voice_t *best = NULL;
+	int i;
+
+	for (i = 0; i < polyphony; i++) {
+		voice_t *v = &voices[i];
+		if (v->state != VOICE_IDLE && v->note == note) {
+			return v;
+		}
+		if (v->state == VOICE_IDLE) {
+			if (best == NULL || best->state != VOICE_IDLE) {
+				best = v;
+			}
+		} else if (best == NULL || (best->state != VOICE_IDLE &&
+					    (v->state > best->state ||
+					     (v->state == best->state && v->age < best->age)))) {
+			best = v;
+		}
+	}
+	if (best->state == VOICE_IDLE) {
+		best->phase = 0.0f;
+		best->gain = 0.0f;
+	}
+	return best;
+}
+
+static void note_on(unsigned char note, unsigned char velocity)
+{
+	voice_t *v = voice_alloc(note);
+
+	v->note = note;
+	v->inc = note_frqs[note];
+	v->state = VOICE_ON;
+	v->age = voice_clock++;
+	voice_ramp(v, voice_gain * velocity / 127.f);
+}
+
+static void note_off(unsigned char note)
 {
 	int i;
+
+	for (i = 0; i < polyphony; i++) {
+		voice_t *v = &voices[i];
+		if (v->state == VOICE_ON && v->note == note) {
+			v->state = VOICE_RELEASED;
+			voice_ramp(v, 0.0f);
+		}
+	}
+}
+
+static void all_notes_off(void)
+{
+	int i;
+
+	for (i = 0; i < polyphony; i++) {
+		if (voices[i].state == VOICE_ON) {
+			voices[i].state = VOICE_RELEASED;
+			voice_ramp(&voices[i], 0.0f);
+		}
+	}
+}
+
+static void handle_event(const jack_midi_event_t *event)
+{
+	const jack_midi_data_t *data = event->buffer;
+
+	if (event->size < 3) {
+		return;
+	}
+	switch (data[0] & 0xf0) {
+	case 0x90:
+		if (data[2] == 0) {
+			note_off(data[1] & 0x7f);
+		} else {
+			note_on(data[1] & 0x7f, data[2]);
+		}
+		break;
+	case 0x80:
+		note_off(data[1] & 0x7f);
+		break;
+	case 0xb0:
+		/* all sound off, all notes off */
+		if (data[1] == 120 || data[1] == 123) {
+			all_notes_off();
+		}
+		break;
+	}
+}
+
+static void render(jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	int i;
+
+	for (i = 0; i < polyphony; i++) {
+		if (voices[i].state != VOICE_IDLE) {
+			render_voice(&voices[i], out, nframes);
+		}
+	}
+}
+
+/*
+ * The period is rendered in segments between MIDI events, so every
+ * event takes effect on its own frame.
+ */
+static int process(jack_nframes_t nframes, void *arg)
+{
 	void* port_buf = jack_port_get_buffer(input_port, nframes);
 	jack_default_audio_sample_t *out = (jack_default_audio_sample_t *) jack_port_get_buffer (output_port, nframes);
 	jack_midi_event_t in_event;
-	jack_nframes_t event_index = 0;
 	jack_nframes_t event_count = jack_midi_get_event_count(port_buf);
-	if(event_count > 1)
-	{
-		printf(" midisine: have %d events\n", event_count);
-		for(i=0; i<event_count; i++)
-		{
-			jack_midi_event_get(&in_event, port_buf, i);
-			printf("    event %d time is %d. 1st byte is 0x%x\n", i, in_event.time, *(in_event.buffer));
+	jack_nframes_t event_index;
+	jack_nframes_t pos = 0;
+
+	memset(out, 0, nframes * sizeof(jack_default_audio_sample_t));
+
+	for (event_index = 0; event_index < event_count; event_index++) {
+		if (jack_midi_event_get(&in_event, port_buf, event_index) != 0) {
+			continue;
 		}
-/*		printf("1st byte of 1st event addr is %p\n", in_events[0].buffer);*/
-	}
-	jack_midi_event_get(&in_event, port_buf, 0);
-	for(i = 0; i < nframes; i++)
-	{
-		if ((in_event.time == i) && (event_index < event_count))
-		{
-			if (((*(in_event.buffer) & 0xf0)) == 0x90)
-			{
-				/* note on */
-				note = *(in_event.buffer + 1);
-				if (*(in_event.buffer + 2) == 0) {
-					note_on = 0.0;
-				} else {
-					note_on = (float)(*(in_event.buffer + 2)) / 127.f;
-				}
-			}
-			else if (((*(in_event.buffer)) & 0xf0) == 0x80)
-			{
-				/* note off */
-				note = *(in_event.buffer + 1);
-				note_on = 0.0;
-			}
-			event_index++;
-			if(event_index < event_count)
-				jack_midi_event_get(&in_event, port_buf, event_index);
+		if (in_event.time >= nframes) {
+			in_event.time = nframes - 1;
+		}
+		if (in_event.time > pos) {
+			render(out + pos, in_event.time - pos);
+			pos = in_event.time;
 		}
-		ramp += note_frqs[note];
-		ramp = (ramp > 1.0) ? ramp - 2.0 : ramp;
-		out[i] = note_on*sin(2*M_PI*ramp);
+		handle_event(&in_event);
 	}
+	render(out + pos, nframes - pos);
 	return 0;
 }
 
@@ -116,8 +298,43 @@ static void jack_shutdown(void *arg)
 	exit(1);
 }
 
+static void usage(void)
+{
+	fprintf(stderr, "usage: jack_midisine [ -p voices ]\n");
+	fprintf(stderr, "        -p, --polyphony <n>    Number of voices, 1 to %d (default: 1)\n", MAX_VOICES);
+}
+
 int main(int narg, char **args)
 {
+	int opt;
+	int option_index;
+	struct option long_options[] = {
+		{ "polyphony", 1, 0, 'p' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((opt = getopt_long(narg, args, "p:h", long_options, &option_index)) != -1) {
+		switch (opt) {
+		case 'p':
+			polyphony = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return 0;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (polyphony < 1 || polyphony > MAX_VOICES) {
+		usage();
+		return 1;
+	}
+	/* keep the sum of all voices at a similar level to one voice */
+	voice_gain = 1.0f / sqrtf(polyphony);
+
 	if ((client = jack_client_open("midisine", JackNullOption, NULL)) == 0)
 	{
 		fprintf(stderr, "JACK server not running?\n");
@@ -28,6 +28,14 @@
 #include <getopt.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <inttypes.h>
+#ifdef HAVE_CLOCK_NANOSLEEP
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 #include <jack/net.h>
 
@@ -35,14 +43,360 @@ jack_net_master_t* net;
 
 #define BUFFER_SIZE 512
 #define SAMPLE_RATE 44100
+#define RT_PRIORITY 70
+#define STATS_FINE_USECS 1000
+#define STATS_COARSE_USECS 10
+#define STATS_BINS (STATS_FINE_USECS + 100000 / STATS_COARSE_USECS)
+
+static volatile int running = 1;
+static int deadline_mode = 0;
 
 static void signal_handler(int sig)
 {
+	if (deadline_mode) {
+		running = 0;
+		return;
+	}
 	jack_net_master_close(net);
 	fprintf(stderr, "signal received, exiting ...\n");
 	exit(0);
 }
 
+#ifdef HAVE_CLOCK_NANOSLEEP
+
+/* Histogram with microsecond bins up to STATS_FINE_USECS and coarser
+   bins above, cheap enough to be updated from the real-time loop and
+   read from another thread for reporting */
+typedef struct {
+	uint32_t bins[STATS_BINS];
+	uint64_t count;
+	int64_t max;
+} cycle_histogram_t;
+
+/* One slave driven by the deadline loop */
+typedef struct {
+	jack_net_master_t* net;
+	jack_slave_t result;
+	float** audio_input_buffer;
+	float** audio_output_buffer;
+	cycle_histogram_t send;
+	cycle_histogram_t recv;		/* end of all sends to the arrival of this slave's data */
+	uint64_t lost;
+	int failures;			/* consecutive failed cycles */
+	int failed;			/* the send failed in this cycle */
+	int active;
+	int reported;			/* dropping it has been printed */
+} net_peer_t;
+
+typedef struct {
+	int buffer_size;
+	int sample_rate;
+	int slice;
+	int npeers;
+	net_peer_t* peers;
+	cycle_histogram_t wakeup;	/* lateness of the wakeup relative to the deadline */
+	cycle_histogram_t cycle;	/* deadline to end of the exchange */
+	uint64_t cycles;
+	uint64_t missed;
+	int failed;
+} deadline_loop_t;
+
+static int64_t
+timespec_ns (const struct timespec* ts)
+{
+	return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return timespec_ns (&ts);
+}
+
+/* Time of a frame position, split to keep the product from overflowing */
+static int64_t
+frames_to_ns (uint64_t frames, int sample_rate)
+{
+	return (int64_t) ((frames / sample_rate) * 1000000000ULL + (frames % sample_rate) * 1000000000ULL / sample_rate);
+}
+
+static void
+histogram_add (cycle_histogram_t* h, int64_t ns)
+{
+	int64_t usecs = ns / 1000;
+	int64_t bin;
+
+	if (usecs < 0) {
+		usecs = 0;
+	}
+	if (usecs < STATS_FINE_USECS) {
+		bin = usecs;
+	} else {
+		bin = STATS_FINE_USECS + (usecs - STATS_FINE_USECS) / STATS_COARSE_USECS;
+		if (bin >= STATS_BINS) {
+			bin = STATS_BINS - 1;
+		}
+	}
+	h->bins[bin]++;
+	h->count++;
+	if (usecs > h->max) {
+		h->max = usecs;
+	}
+}
+
+static int64_t
+histogram_percentile (const cycle_histogram_t* h, double p)
+{
+	uint64_t target = (uint64_t) ceil (h->count * p);
+	uint64_t sum = 0;
+	int64_t i;
+
+	for (i = 0; i < STATS_BINS - 1; i++) {
+		sum += h->bins[i];
+		if (sum >= target && sum > 0) {
+			return i < STATS_FINE_USECS ? i : STATS_FINE_USECS + (i - STATS_FINE_USECS) * STATS_COARSE_USECS;
+		}
+	}
+	return h->max;
+}
+
+static void
+histogram_report (const char* name, const cycle_histogram_t* h)
+{
+	printf ("  %-8s p50 %6" PRId64 " p90 %6" PRId64 " p99 %6" PRId64 " p99.9 %6" PRId64 " max %6" PRId64 " usecs\n",
+		name,
+		histogram_percentile (h, 0.5),
+		histogram_percentile (h, 0.9),
+		histogram_percentile (h, 0.99),
+		histogram_percentile (h, 0.999),
+		h->max);
+}
+
+static void
+stats_report (const deadline_loop_t* loop)
+{
+	int n;
+
+	printf ("%" PRIu64 " cycles, %" PRIu64 " missed deadlines\n", loop->cycles, loop->missed);
+	histogram_report ("wakeup", &loop->wakeup);
+	histogram_report ("cycle", &loop->cycle);
+	for (n = 0; n < loop->npeers; n++) {
+		const net_peer_t* peer = &loop->peers[n];
+		printf (" slave %d%s: %" PRIu64 " lost cycles (%.3f%%)\n", n, peer->active ? "" : " (gone)",
+			peer->lost, loop->cycles ? 100.0 * peer->lost / loop->cycles : 0.0);
+		histogram_report ("send", &peer->send);
+		histogram_report ("recv", &peer->recv);
+	}
+	fflush (stdout);
+}
+
+/* Exchange one buffer per period with every slave, woken up at absolute
+   deadlines derived from the cycle count so that timing errors never
+   accumulate. All sends go out before the first receive, so the slaves
+   process the cycle concurrently. Missed periods are skipped rather than
+   caught up on, a slave failing for a whole second is dropped. */
+static void*
+deadline_loop (void* arg)
+{
+	deadline_loop_t* loop = (deadline_loop_t*) arg;
+	int64_t start = now_ns ();
+	uint64_t cycle = 0;
+	int max_failures = loop->sample_rate / loop->buffer_size;
+	int active = loop->npeers;
+	int n, i;
+
+	while (running && active > 0) {
+		int64_t deadline = start + frames_to_ns (cycle * loop->buffer_size, loop->sample_rate);
+		int64_t next = start + frames_to_ns ((cycle + 1) * loop->buffer_size, loop->sample_rate);
+		struct timespec ts;
+		int64_t t0, t1, t2;
+
+		ts.tv_sec = deadline / 1000000000;
+		ts.tv_nsec = deadline % 1000000000;
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && running) {
+		}
+
+		t0 = now_ns ();
+
+		for (n = 0; n < loop->npeers; n++) {
+			net_peer_t* peer = &loop->peers[n];
+			int64_t ts0;
+
+			if (!peer->active) {
+				continue;
+			}
+
+			// Copy input to output
+			for (i = 0; i < peer->result.audio_input && i < peer->result.audio_output; i++) {
+				memcpy (peer->audio_output_buffer[i], peer->audio_input_buffer[i], loop->buffer_size * sizeof(float));
+			}
+
+			ts0 = now_ns ();
+			peer->failed = jack_net_master_send_slice (peer->net, peer->result.audio_output, peer->audio_output_buffer, 0, NULL, loop->slice) < 0;
+			histogram_add (&peer->send, now_ns () - ts0);
+		}
+		t1 = now_ns ();
+
+		for (n = 0; n < loop->npeers; n++) {
+			net_peer_t* peer = &loop->peers[n];
+
+			if (!peer->active) {
+				continue;
+			}
+			if (jack_net_master_recv_slice (peer->net, peer->result.audio_input, peer->audio_input_buffer, 0, NULL, loop->slice) < 0) {
+				peer->failed = 1;
+			} else {
+				histogram_add (&peer->recv, now_ns () - t1);
+			}
+			/* a cycle counts once, and as good only if both directions were */
+			if (!peer->failed) {
+				peer->failures = 0;
+				continue;
+			}
+			peer->lost++;
+			if (++peer->failures > max_failures) {
+				/* printed by the reporting thread */
+				peer->active = 0;
+				active--;
+			}
+		}
+		t2 = now_ns ();
+
+		histogram_add (&loop->wakeup, t0 - deadline);
+		histogram_add (&loop->cycle, t2 - deadline);
+		loop->cycles++;
+
+		cycle++;
+		if (t2 > next) {
+			/* resynchronise on the next deadline still ahead of us */
+			uint64_t late = (uint64_t) ((t2 - start) / (next - deadline));
+			while (start + frames_to_ns (late * loop->buffer_size, loop->sample_rate) <= t2) {
+				late++;
+			}
+			loop->missed += late - cycle;
+			cycle = late;
+		}
+	}
+
+	if (active == 0) {
+		loop->failed = 1;
+	}
+	running = 0;
+	return NULL;
+}
+
+/* Prints the slaves the deadline loop has dropped since the last call,
+   so that loop never blocks on stderr */
+static void
+report_dropped (deadline_loop_t* loop)
+{
+	int n;
+
+	for (n = 0; n < loop->npeers; n++) {
+		net_peer_t* peer = &loop->peers[n];
+		if (!peer->active && !peer->reported) {
+			fprintf (stderr, "slave %d stopped responding, dropping it\n", n);
+			peer->reported = 1;
+		}
+	}
+}
+
+static int
+run_deadline_loop (deadline_loop_t* loop, int priority, int interval)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	struct sched_param param;
+	int rc;
+
+	if (mlockall (MCL_CURRENT | MCL_FUTURE)) {
+		fprintf (stderr, "Warning: Can not lock memory.\n");
+	}
+
+	pthread_attr_init (&attr);
+	if (priority > 0) {
+		memset (&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		pthread_attr_setinheritsched (&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy (&attr, SCHED_FIFO);
+		pthread_attr_setschedparam (&attr, &param);
+	}
+
+	if ((rc = pthread_create (&thread, &attr, deadline_loop, loop)) == EPERM && priority > 0) {
+		fprintf (stderr, "Warning: cannot use SCHED_FIFO priority %d, running without real-time scheduling\n", priority);
+		pthread_attr_setinheritsched (&attr, PTHREAD_INHERIT_SCHED);
+		rc = pthread_create (&thread, &attr, deadline_loop, loop);
+	}
+	pthread_attr_destroy (&attr);
+
+	if (rc) {
+		fprintf (stderr, "cannot create the master thread: %s\n", strerror (rc));
+		return 1;
+	}
+
+	while (running) {
+		int n;
+		for (n = 0; running && (interval <= 0 || n < interval * 10); n++) {
+			usleep (100000);
+			report_dropped (loop);
+		}
+		if (running) {
+			stats_report (loop);
+		}
+	}
+
+	pthread_join (thread, NULL);
+	report_dropped (loop);
+	if (loop->failed) {
+		fprintf (stderr, "no slave left, exiting\n");
+	}
+	stats_report (loop);
+	return loop->failed;
+}
+
+#endif /* HAVE_CLOCK_NANOSLEEP */
+
+static void
+install_signal_handlers ()
+{
+    /* install a signal handler to properly quits jack client */
+#ifdef WIN32
+	signal(SIGINT, signal_handler);
+    signal(SIGABRT, signal_handler);
+	signal(SIGTERM, signal_handler);
+#else
+	signal(SIGQUIT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	signal(SIGHUP, signal_handler);
+	signal(SIGINT, signal_handler);
+#endif
+}
+
+static float**
+alloc_buffers (int channels, int buffer_size)
+{
+    float** buffers = (float**)calloc(channels, sizeof(float*));
+    int i;
+
+    for (i = 0; i < channels; i++) {
+        buffers[i] = (float*)calloc(buffer_size, sizeof(float));
+    }
+    return buffers;
+}
+
+static void
+free_buffers (float** buffers, int channels)
+{
+    int i;
+
+    for (i = 0; i < channels; i++) {
+        free(buffers[i]);
+    }
+    free(buffers);
+}
+
 static void
 usage ()
 {
@@ -51,7 +405,13 @@ usage ()
     "              [ -b buffer size (default = %d) ]\n"
     "              [ -r sample rate (default = %d) ]\n"
     "              [ -a hostname (default = %s) ]\n"
-    "              [ -p port (default = %d) ]\n", BUFFER_SIZE, SAMPLE_RATE, DEFAULT_MULTICAST_IP, DEFAULT_PORT);
+    "              [ -p port (default = %d) ]\n"
+    "              [ -d run on absolute deadlines and report cycle statistics ]\n"
+    "              [ -P SCHED_FIFO priority of the deadline loop (default = %d, 0 to disable) ]\n"
+    "              [ -s slice size in frames (default = buffer size) ]\n"
+    "              [ -i statistics report interval in seconds (default = at exit) ]\n"
+    "              [ -k number of slaves to serve in deadline mode (default = 1) ]\n",
+    BUFFER_SIZE, SAMPLE_RATE, DEFAULT_MULTICAST_IP, DEFAULT_PORT, RT_PRIORITY);
 }
 
 int
@@ -61,7 +421,11 @@ main (int argc, char *argv[])
     int sample_rate = SAMPLE_RATE;
     int udp_port = DEFAULT_PORT;
     const char* multicast_ip = DEFAULT_MULTICAST_IP;
- 	const char *options = "b:r:a:p:h";
+    int priority = RT_PRIORITY;
+    int slice = 0;
+    int interval = 0;
+    int nslaves = 1;
+ 	const char *options = "b:r:a:p:dP:s:i:k:h";
     int option_index;
 	int opt;
 
@@ -71,6 +435,11 @@ main (int argc, char *argv[])
 		{"sample rate", 1, 0, 'r'},
 		{"hostname", 1, 0, 'a'},
 		{"port", 1, 0, 'p'},
+		{"deadline", 0, 0, 'd'},
+		{"priority", 1, 0, 'P'},
+		{"slice", 1, 0, 's'},
+		{"interval", 1, 0, 'i'},
+		{"slaves", 1, 0, 'k'},
 		{0, 0, 0, 0}
 	};
 
@@ -94,6 +463,29 @@ main (int argc, char *argv[])
 			udp_port = atoi(optarg);
 			break;
 
+		case 'd':
+			deadline_mode = 1;
+			break;
+
+		case 'P':
+			priority = atoi(optarg);
+			break;
+
+		case 's':
+			slice = atoi(optarg);
+			break;
+
+		case 'i':
+			interval = atoi(optarg);
+			break;
+
+		case 'k':
+			nslaves = atoi(optarg);
+			if (nslaves < 1) {
+				nslaves = 1;
+			}
+			break;
+
 		case 'h':
 			usage();
 			return -1;
@@ -108,6 +500,64 @@ main (int argc, char *argv[])
     float** audio_output_buffer;
     int wait_usec = (int) ((((float)buffer_size) * 1000000) / ((float)sample_rate));
 
+#ifndef HAVE_CLOCK_NANOSLEEP
+    if (deadline_mode) {
+        fprintf(stderr, "deadline mode is not supported on this platform\n");
+        return 1;
+    }
+    (void)priority;
+    (void)interval;
+#endif
+    if (slice <= 0 || slice > buffer_size) {
+        slice = buffer_size;
+    }
+    if (nslaves > 1 && !deadline_mode) {
+        fprintf(stderr, "serving several slaves requires the deadline mode (-d)\n");
+        return 1;
+    }
+
+#ifdef HAVE_CLOCK_NANOSLEEP
+    if (deadline_mode) {
+        static deadline_loop_t loop;
+        int rc;
+
+        loop.buffer_size = buffer_size;
+        loop.sample_rate = sample_rate;
+        loop.slice = slice;
+        loop.peers = (net_peer_t*)calloc(nslaves, sizeof(net_peer_t));
+
+        /* every open waits for the next slave announcing itself */
+        for (loop.npeers = 0; loop.npeers < nslaves; loop.npeers++) {
+            net_peer_t* peer = &loop.peers[loop.npeers];
+
+            printf("Waiting for slave %d of %d...\n", loop.npeers + 1, nslaves);
+            if ((peer->net = jack_net_master_open(multicast_ip, udp_port, &request, &peer->result)) == 0) {
+                fprintf(stderr, "NetJack master can not be opened\n");
+                break;
+            }
+            peer->audio_input_buffer = alloc_buffers(peer->result.audio_input, buffer_size);
+            peer->audio_output_buffer = alloc_buffers(peer->result.audio_output, buffer_size);
+            peer->active = 1;
+        }
+
+        if (loop.npeers == nslaves) {
+            printf("%d slave(s) running...\n", nslaves);
+            install_signal_handlers();
+            rc = run_deadline_loop(&loop, priority, interval);
+        } else {
+            rc = 1;
+        }
+
+        for (i = 0; i < loop.npeers; i++) {
+            jack_net_master_close(loop.peers[i].net);
+            free_buffers(loop.peers[i].audio_input_buffer, loop.peers[i].result.audio_input);
+            free_buffers(loop.peers[i].audio_output_buffer, loop.peers[i].result.audio_output);
+        }
+        free(loop.peers);
+        exit(rc);
+    }
+#endif
+
     printf("Waiting for a slave...\n");
 
     if ((net = jack_net_master_open(multicast_ip, udp_port, &request, &result))  == 0) {
@@ -117,29 +567,13 @@ main (int argc, char *argv[])
 
     printf("Slave is running...\n");
 
-    /* install a signal handler to properly quits jack client */
-#ifdef WIN32
-	signal(SIGINT, signal_handler);
-    signal(SIGABRT, signal_handler);
-	signal(SIGTERM, signal_handler);
-#else
-	signal(SIGQUIT, signal_handler);
-	signal(SIGTERM, signal_handler);
-	signal(SIGHUP, signal_handler);
-	signal(SIGINT, signal_handler);
-#endif
+    install_signal_handlers();
 
     // Allocate buffers
-    
-    audio_input_buffer = (float**)calloc(result.audio_input, sizeof(float*));
-    for (i = 0; i < result.audio_input; i++) {
-        audio_input_buffer[i] = (float*)calloc(buffer_size, sizeof(float));
-    }
 
-    audio_output_buffer = (float**)calloc(result.audio_output, sizeof(float*));
-    for (i = 0; i < result.audio_output; i++) {
-        audio_output_buffer[i] = (float*)calloc(buffer_size, sizeof(float));
-    }
+    audio_input_buffer = alloc_buffers(result.audio_input, buffer_size);
+    audio_output_buffer = alloc_buffers(result.audio_output, buffer_size);
+
 
     /*
     Run until interrupted.
@@ -204,15 +638,8 @@ main (int argc, char *argv[])
     // Wait for application end
     jack_net_master_close(net);
 
-    for (i = 0; i < result.audio_input; i++) {
-        free(audio_input_buffer[i]);
-    }
-    free(audio_input_buffer);
-
-    for (i = 0; i < result.audio_output; i++) {
-          free(audio_output_buffer[i]);
-    }
-    free(audio_output_buffer);
+    free_buffers(audio_input_buffer, result.audio_input);
+    free_buffers(audio_output_buffer, result.audio_output);
 
     exit (0);
 }
@@ -19,13 +19,84 @@
 #include <unistd.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <jack/jack.h>
 #include <jack/transport.h>
+#include <jack/ringbuffer.h>
+
+#define EVENT_QUEUE_SIZE 1024
+#define EVENT_IDLE_USECS 100000
+
+/* a BBT step further than this from what tempo and frames predict is
+   reported as a discontinuity, tick rounding alone stays below it */
+#define TICK_TOLERANCE 2.0
+
+enum {
+	EV_STATE,
+	EV_LOCATE,
+	EV_BBT,
+	EV_TEMPO,
+	EV_TIMEBASE,
+	EV_STATS
+};
+
+static const char* event_names[] = {
+	"state", "locate", "bbt", "tempo", "timebase", "stats"
+};
+
+/* Timing of the cycles since the last stats record, kept by the
+   process callback only. The period deviation is how far the usecs
+   stamped into the position moved from what the frame time advance
+   predicts; the tick error is the same for the BBT advance of a
+   timebase master while rolling. */
+typedef struct {
+	uint64_t cycles;
+	uint64_t jitter_count;
+	double jitter_sum;
+	double jitter_sumsq;
+	double jitter_max;
+	double drift_ppm;
+	uint64_t tick_count;
+	double tick_sumsq;
+	double tick_max;
+} timing_stats_t;
+
+/* Fixed-size record pushed by the process callback in monitor mode,
+   all formatting is left to the writer. */
+typedef struct {
+	uint32_t type;
+	jack_transport_state_t state;
+	jack_nframes_t frame_time;
+	jack_nframes_t expected;
+	double tick_error;
+	jack_position_t pos;
+	timing_stats_t stats;
+} transport_event_t;
 
 jack_client_t *client;
 
+static jack_ringbuffer_t *rb = NULL;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t keeprunning = 1;
+static volatile int stats_wanted = 0;
+static volatile uint32_t dropped = 0;
+
+/* state of the previous cycle, owned by the process callback */
+static int have_last = 0;
+static jack_transport_state_t last_state;
+static jack_position_t last_pos;
+static jack_nframes_t last_frame_time;
+static jack_nframes_t last_nframes;
+static uint64_t total_frames;
+static uint64_t total_usecs;
+static timing_stats_t window;
+
 static void
 showtime ()
 {
@@ -86,17 +157,327 @@ jack_shutdown (void *arg)
 	exit (1);
 }
 
+static const char *
+state_name (jack_transport_state_t state)
+{
+	switch (state) {
+	case JackTransportStopped:
+		return "stopped";
+	case JackTransportRolling:
+		return "rolling";
+	case JackTransportStarting:
+		return "starting";
+	default:
+		return "unknown";
+	}
+}
+
+static void
+queue_event (uint32_t type, jack_transport_state_t state, const jack_position_t *pos,
+	     jack_nframes_t frame_time, jack_nframes_t expected, double tick_error)
+{
+	transport_event_t ev;
+
+	if (jack_ringbuffer_write_space (rb) < sizeof (transport_event_t)) {
+		dropped++;
+		return;
+	}
+
+	ev.type = type;
+	ev.state = state;
+	ev.frame_time = frame_time;
+	ev.expected = expected;
+	ev.tick_error = tick_error;
+	ev.pos = *pos;
+	if (type == EV_STATS) {
+		ev.stats = window;
+	} else {
+		memset (&ev.stats, 0, sizeof (ev.stats));
+	}
+	jack_ringbuffer_write (rb, (const char *) &ev, sizeof (transport_event_t));
+
+	if (pthread_mutex_trylock (&writer_lock) == 0) {
+		pthread_cond_signal (&data_ready);
+		pthread_mutex_unlock (&writer_lock);
+	}
+}
+
+/* Ticks since 1|1|0, valid as long as the meter does not change. */
+static double
+bbt_ticks (const jack_position_t *pos)
+{
+	return ((pos->bar - 1) * (double) pos->beats_per_bar + (pos->beat - 1))
+	       * pos->ticks_per_beat + pos->tick;
+}
+
+static int
+same_meter (const jack_position_t *a, const jack_position_t *b)
+{
+	return a->beats_per_minute == b->beats_per_minute
+	       && a->beats_per_bar == b->beats_per_bar
+	       && a->beat_type == b->beat_type
+	       && a->ticks_per_beat == b->ticks_per_beat;
+}
+
+static void
+update_timing (const jack_position_t *pos, jack_nframes_t frame_time)
+{
+	jack_nframes_t frames = frame_time - last_frame_time;
+	double usecs = (double) (int64_t) (pos->usecs - last_pos.usecs);
+	double deviation;
+
+	if (pos->frame_rate == 0) {
+		return;
+	}
+
+	deviation = usecs - frames * 1e6 / pos->frame_rate;
+	window.jitter_count++;
+	window.jitter_sum += deviation;
+	window.jitter_sumsq += deviation * deviation;
+	if (fabs (deviation) > window.jitter_max) {
+		window.jitter_max = fabs (deviation);
+	}
+
+	total_frames += frames;
+	total_usecs += pos->usecs - last_pos.usecs;
+	window.drift_ppm = ((double) total_usecs * pos->frame_rate / (total_frames * 1e6) - 1.0) * 1e6;
+}
+
+/* Look at the position once per cycle and queue a record for every
+   change that is not the transport simply rolling on. */
+static int
+process (jack_nframes_t nframes, void *arg)
+{
+	jack_position_t pos;
+	jack_transport_state_t state;
+	jack_nframes_t frame_time;
+	jack_nframes_t expected;
+	int located;
+
+	state = jack_transport_query (client, &pos);
+	frame_time = jack_last_frame_time (client);
+	window.cycles++;
+
+	if (!have_last) {
+		queue_event (EV_STATE, state, &pos, frame_time, pos.frame, 0.0);
+		goto done;
+	}
+
+	update_timing (&pos, frame_time);
+
+	if (state != last_state) {
+		queue_event (EV_STATE, state, &pos, frame_time, pos.frame, 0.0);
+	}
+
+	/* the transport moves on by one period per rolling cycle, xruns
+	   included, anything else is a relocation */
+	expected = last_pos.frame;
+	if (last_state == JackTransportRolling) {
+		expected += last_nframes;
+	}
+	located = pos.frame != expected;
+	if (located) {
+		queue_event (EV_LOCATE, state, &pos, frame_time, expected, 0.0);
+	}
+
+	if ((pos.valid & JackPositionBBT) != (last_pos.valid & JackPositionBBT)) {
+		queue_event (EV_TIMEBASE, state, &pos, frame_time, pos.frame, 0.0);
+	} else if (pos.valid & JackPositionBBT) {
+		if (!same_meter (&pos, &last_pos)) {
+			queue_event (EV_TEMPO, state, &pos, frame_time, pos.frame, 0.0);
+		} else if (!located) {
+			double advance = (double) (pos.frame - last_pos.frame) / pos.frame_rate
+					 * pos.beats_per_minute / 60.0 * pos.ticks_per_beat;
+			double error = bbt_ticks (&pos) - bbt_ticks (&last_pos) - advance;
+
+			if (pos.frame != last_pos.frame) {
+				window.tick_count++;
+				window.tick_sumsq += error * error;
+				if (fabs (error) > window.tick_max) {
+					window.tick_max = fabs (error);
+				}
+			}
+			if (fabs (error) > TICK_TOLERANCE) {
+				queue_event (EV_BBT, state, &pos, frame_time, pos.frame, error);
+			}
+		}
+	}
+
+done:
+	if (stats_wanted) {
+		queue_event (EV_STATS, state, &pos, frame_time, pos.frame, 0.0);
+		memset (&window, 0, sizeof (window));
+		stats_wanted = 0;
+	}
+
+	have_last = 1;
+	last_state = state;
+	last_pos = pos;
+	last_frame_time = frame_time;
+	last_nframes = nframes;
+	return 0;
+}
+
+static void
+print_event (const transport_event_t *ev)
+{
+	const jack_position_t *pos = &ev->pos;
+	const timing_stats_t *st = &ev->stats;
+
+	printf ("{\"usecs\":%" PRIu64 ",\"type\":\"%s\",\"frame_time\":%" PRIu32,
+		(uint64_t) pos->usecs, event_names[ev->type], ev->frame_time);
+
+	if (ev->type == EV_STATS) {
+		printf (",\"cycles\":%" PRIu64 ",\"dropped\":%u", st->cycles, dropped);
+		printf (",\"period_jitter_usecs\":{\"mean\":%.3f,\"rms\":%.3f,\"max\":%.3f}",
+			st->jitter_count ? st->jitter_sum / st->jitter_count : 0.0,
+			st->jitter_count ? sqrt (st->jitter_sumsq / st->jitter_count) : 0.0,
+			st->jitter_max);
+		printf (",\"drift_ppm\":%.3f", st->drift_ppm);
+		printf (",\"tick_error\":{\"rms\":%.3f,\"max\":%.3f}}\n",
+			st->tick_count ? sqrt (st->tick_sumsq / st->tick_count) : 0.0,
+			st->tick_max);
+		return;
+	}
+
+	printf (",\"state\":\"%s\",\"frame\":%" PRIu32, state_name (ev->state), pos->frame);
+	if (ev->type == EV_LOCATE) {
+		printf (",\"expected\":%" PRIu32 ",\"jump\":%" PRId64,
+			ev->expected, (int64_t) pos->frame - (int64_t) ev->expected);
+	}
+	if (ev->type == EV_BBT) {
+		printf (",\"tick_error\":%.3f", ev->tick_error);
+	}
+	if (pos->valid & JackPositionBBT) {
+		printf (",\"bbt\":{\"bar\":%" PRIi32 ",\"beat\":%" PRIi32 ",\"tick\":%" PRIi32
+			",\"bpm\":%.3f,\"beats_per_bar\":%g,\"beat_type\":%g,\"ticks_per_beat\":%g}",
+			pos->bar, pos->beat, pos->tick, pos->beats_per_minute,
+			pos->beats_per_bar, pos->beat_type, pos->ticks_per_beat);
+	} else {
+		printf (",\"bbt\":null");
+	}
+	printf ("}\n");
+}
+
+static void
+add_usecs (struct timespec *ts, jack_time_t usecs)
+{
+	ts->tv_sec += usecs / 1000000;
+	ts->tv_nsec += (usecs % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Drain the event queue and emit NDJSON until a signal arrives. Stats
+   records are requested from the process callback, which owns the
+   counters and restarts them with every record. */
+static void
+run_writer (jack_time_t stats_usecs)
+{
+	transport_event_t ev;
+	jack_time_t last_stats = jack_get_time ();
+	struct timespec ts;
+
+	pthread_mutex_lock (&writer_lock);
+	while (keeprunning || jack_ringbuffer_read_space (rb) >= sizeof (transport_event_t)) {
+		while (jack_ringbuffer_read_space (rb) >= sizeof (transport_event_t)) {
+			jack_ringbuffer_read (rb, (char *) &ev, sizeof (transport_event_t));
+			print_event (&ev);
+		}
+		fflush (stdout);
+
+		if (stats_usecs && jack_get_time () - last_stats >= stats_usecs) {
+			last_stats = jack_get_time ();
+			stats_wanted = 1;
+		}
+
+		if (keeprunning) {
+			clock_gettime (CLOCK_REALTIME, &ts);
+			add_usecs (&ts, EVENT_IDLE_USECS);
+			pthread_cond_timedwait (&data_ready, &writer_lock, &ts);
+		}
+	}
+	pthread_mutex_unlock (&writer_lock);
+}
+
 void
 signal_handler (int sig)
 {
+	if (rb) {
+		/* the writer wakes up within EVENT_IDLE_USECS and sees this,
+		   the mutex and condition are not async-signal-safe */
+		keeprunning = 0;
+		return;
+	}
 	jack_client_close (client);
 	fprintf (stderr, "signal received, exiting ...\n");
 	exit (0);
 }
 
+static void
+show_usage (void)
+{
+	fprintf (stderr, "usage: jack_showtime [options]\n");
+	fprintf (stderr, "Prints the transport position.\n\n");
+	fprintf (stderr, "        -j, --json               Sample the position once per cycle and emit changes as NDJSON\n");
+	fprintf (stderr, "        -r, --rates <secs>       Emit period jitter and tick error statistics periodically\n");
+	fprintf (stderr, "        -q, --queue <events>     Size of the event queue (default: %d)\n", EVENT_QUEUE_SIZE);
+	fprintf (stderr, "        -h, --help               Display this help message\n");
+}
+
 int
 main (int argc, char *argv[])
 {
+	int json = 0;
+	int c;
+	int option_index;
+	size_t queue_size = EVENT_QUEUE_SIZE;
+	jack_time_t stats_usecs = 0;
+
+	struct option long_options[] = {
+		{ "json", 0, 0, 'j' },
+		{ "rates", 1, 0, 'r' },
+		{ "queue", 1, 0, 'q' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((c = getopt_long (argc, argv, "jr:q:h", long_options, &option_index)) >= 0) {
+		switch (c) {
+		case 'j':
+			json = 1;
+			break;
+		case 'r':
+			stats_usecs = (jack_time_t) (atof (optarg) * 1000000);
+			break;
+		case 'q':
+			queue_size = atoi (optarg);
+			break;
+		case 'h':
+			show_usage ();
+			return 0;
+		default:
+			show_usage ();
+			return 1;
+		}
+	}
+
+	if (!json && stats_usecs) {
+		fprintf (stderr, "--rates requires --json\n");
+		return 1;
+	}
+	if (json) {
+		if (queue_size < 16) {
+			queue_size = 16;
+		}
+		if ((rb = jack_ringbuffer_create (queue_size * sizeof (transport_event_t))) == NULL) {
+			fprintf (stderr, "cannot allocate event queue\n");
+			return 1;
+		}
+	}
+
 	/* try to become a client of the JACK server */
 
 	if ((client = jack_client_open ("showtime", JackNullOption, NULL)) == 0) {
@@ -119,6 +500,11 @@ main (int argc, char *argv[])
 
 	jack_on_shutdown (client, jack_shutdown, 0);
 
+	if (json && jack_set_process_callback (client, process, NULL)) {
+		fprintf (stderr, "cannot set process callback\n");
+		return 1;
+	}
+
 	/* tell the JACK server that we are ready to roll */
 
 	if (jack_activate (client)) {
@@ -126,6 +512,14 @@ main (int argc, char *argv[])
 		return 1;
 	}
 
+	if (json) {
+		run_writer (stats_usecs);
+		jack_deactivate (client);
+		jack_client_close (client);
+		jack_ringbuffer_free (rb);
+		return 0;
+	}
+
 	while (1) {
 		usleep (20);
 		showtime ();
@@ -0,0 +1,501 @@
+
+/*
+ * Property tests and benchmark for the netjack packet cache
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Without arguments, feed the cache synthetic fragment streams with
+ * reordering, duplication, loss, framecnt wraparound and oversized
+ * fragments, and check every packet that comes out against what was
+ * sent. With -b, time the cache over a range of cache sizes and
+ * fragments per packet instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <netjack_packet.h>
+
+#define MTU 1400
+#define FRAGMENT_PAYLOAD (MTU - (int) sizeof (jacknet_packet_header))
+#define MAX_FRAGMENTS 64
+#define MAX_DATAGRAMS (8 * MAX_FRAGMENTS * 4)
+
+typedef struct {
+    char buf[MTU + 64];
+    int len;
+} datagram_t;
+
+static datagram_t datagrams[MAX_DATAGRAMS];
+static struct sockaddr_in master;
+static uint32_t rng_state = 2463534242u;
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            fprintf (stderr, "FAIL %s:%d: ", __func__, __LINE__); \
+            fprintf (stderr, __VA_ARGS__); \
+            fprintf (stderr, "\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t
+rng (void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void
+shuffle (datagram_t *dg, int n)
+{
+    int i;
+
+    for (i = n - 1; i > 0; i--) {
+        int j = rng () % (i + 1);
+        datagram_t tmp = dg[i];
+        dg[i] = dg[j];
+        dg[j] = tmp;
+    }
+}
+
+static inline unsigned char
+payload_byte (jack_nframes_t framecnt, int offset)
+{
+    return (unsigned char) (framecnt * 31 + offset * 7 + (offset >> 8));
+}
+
+/*
+ * Cut a packet of pkt_size bytes for framecnt into datagrams the way
+ * netjack_sendto() does. Returns the number of datagrams.
+ */
+static int
+make_fragments (datagram_t *dg, jack_nframes_t framecnt, int pkt_size)
+{
+    int payload_size = pkt_size - sizeof (jacknet_packet_header);
+    int offset = 0, n = 0;
+
+    do {
+        jacknet_packet_header *pkthdr = (jacknet_packet_header *) dg[n].buf;
+        int len = payload_size - offset;
+        int i;
+
+        if (len > FRAGMENT_PAYLOAD)
+            len = FRAGMENT_PAYLOAD;
+        memset (pkthdr, 0, sizeof (*pkthdr));
+        pkthdr->framecnt = htonl (framecnt);
+        pkthdr->fragment_nr = htonl (n);
+        for (i = 0; i < len; i++)
+            dg[n].buf[sizeof (jacknet_packet_header) + i] = payload_byte (framecnt, offset + i);
+        dg[n].len = sizeof (jacknet_packet_header) + len;
+        offset += len;
+        n++;
+    } while (offset < payload_size);
+
+    return n;
+}
+
+static void
+add_all (packet_cache *pcache, datagram_t *dg, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        packet_cache_add_datagram (pcache, dg[i].buf, dg[i].len, &master);
+}
+
+/* Retrieve framecnt and check its size and every byte of its payload. */
+static int
+retrieve_and_check (packet_cache *pcache, jack_nframes_t framecnt, int pkt_size, int expected_size)
+{
+    char *packet_buf;
+    int size, i;
+
+    size = packet_cache_retreive_packet_pointer (pcache, framecnt, &packet_buf, pkt_size, NULL);
+    if (size < 0)
+        return -1;
+
+    CHECK (size == expected_size, "framecnt %u: size %d, expected %d", framecnt, size, expected_size);
+    CHECK (ntohl (((jacknet_packet_header *) packet_buf)->framecnt) == framecnt,
+           "framecnt %u: header says %u", framecnt, ntohl (((jacknet_packet_header *) packet_buf)->framecnt));
+    for (i = 0; i < expected_size - (int) sizeof (jacknet_packet_header); i++) {
+        if ((unsigned char) packet_buf[sizeof (jacknet_packet_header) + i] != payload_byte (framecnt, i)) {
+            CHECK (0, "framecnt %u: payload differs at byte %d", framecnt, i);
+            break;
+        }
+    }
+    packet_cache_release_packet (pcache, framecnt);
+    return 0;
+}
+
+static int
+packet_size (int fragments)
+{
+    return sizeof (jacknet_packet_header) + fragments * FRAGMENT_PAYLOAD;
+}
+
+static void
+test_in_order (void)
+{
+    int pkt_size = packet_size (5);
+    packet_cache *pcache = packet_cache_new (4, pkt_size, MTU);
+    jack_nframes_t f;
+
+    for (f = 0; f < 100; f++) {
+        int n = make_fragments (datagrams, f, pkt_size);
+        add_all (pcache, datagrams, n);
+        CHECK (retrieve_and_check (pcache, f, pkt_size, pkt_size) == 0, "framecnt %u not complete", f);
+    }
+    packet_cache_free (pcache);
+}
+
+/* The fragments of several packets in flight, in any order, some twice. */
+static void
+test_reorder_and_duplicates (void)
+{
+    int pkt_size = packet_size (7) - 100;       // short last fragment
+    int window = 4;
+    packet_cache *pcache = packet_cache_new (window + 2, pkt_size, MTU);
+    jack_nframes_t f;
+
+    for (f = 1; f < 400; f += window) {
+        jack_nframes_t g, next;
+        int n = 0, dups, i;
+
+        for (g = f; g < f + window; g++)
+            n += make_fragments (datagrams + n, g, pkt_size);
+        for (dups = n / 3, i = 0; i < dups; i++)
+            datagrams[n + i] = datagrams[rng () % n];
+        n += dups;
+        shuffle (datagrams, n);
+        add_all (pcache, datagrams, n);
+
+        CHECK (packet_cache_get_queue_depth (pcache, f) == window, "framecnt %u: queue depth %d",
+               f, packet_cache_get_queue_depth (pcache, f));
+        for (g = f; g < f + window; g++) {
+            CHECK (packet_cache_get_next_available_framecnt (pcache, g, &next) && next == g,
+                   "framecnt %u: next available %u", g, next);
+            CHECK (retrieve_and_check (pcache, g, pkt_size, pkt_size) == 0, "framecnt %u not complete", g);
+        }
+    }
+    packet_cache_free (pcache);
+}
+
+/* A packet missing a fragment never completes, and is skipped over. */
+static void
+test_loss (void)
+{
+    int pkt_size = packet_size (4);
+    packet_cache *pcache = packet_cache_new (8, pkt_size, MTU);
+    jack_nframes_t f, next;
+
+    for (f = 10; f < 300; f++) {
+        int n = make_fragments (datagrams, f, pkt_size);
+        int lost = (f % 3 == 0) ? (int) (rng () % n) : -1;
+
+        if (lost >= 0)
+            datagrams[lost] = datagrams[--n];
+        shuffle (datagrams, n);
+        add_all (pcache, datagrams, n);
+
+        if (lost >= 0) {
+            char *packet_buf;
+
+            CHECK (packet_cache_retreive_packet_pointer (pcache, f, &packet_buf, pkt_size, NULL) < 0,
+                   "framecnt %u complete without fragment %d", f, lost);
+            continue;
+        }
+        CHECK (packet_cache_get_next_available_framecnt (pcache, f - 1, &next) && next == f,
+               "framecnt %u: next available %u", f, next);
+        CHECK (retrieve_and_check (pcache, f, pkt_size, pkt_size) == 0, "framecnt %u not complete", f);
+    }
+    packet_cache_free (pcache);
+}
+
+/* The counter wraps every 2^32 periods; the cache must not notice. */
+static void
+test_wraparound (void)
+{
+    int pkt_size = packet_size (3);
+    packet_cache *pcache = packet_cache_new (5, pkt_size, MTU);
+    jack_nframes_t start = 0xffffffff - 20;
+    jack_nframes_t f, next, highest;
+    int step;
+
+    for (step = 0; step < 40; step += 2) {
+        int n = 0;
+
+        /* two packets at a time, the second first */
+        n += make_fragments (datagrams + n, start + step + 1, pkt_size);
+        n += make_fragments (datagrams + n, start + step, pkt_size);
+        add_all (pcache, datagrams, n);
+
+        f = start + step;
+        CHECK (packet_cache_get_queue_depth (pcache, f) == 2, "framecnt %u: queue depth %d",
+               f, packet_cache_get_queue_depth (pcache, f));
+        CHECK (packet_cache_get_next_available_framecnt (pcache, f, &next) && next == f,
+               "framecnt %u: next available %u", f, next);
+        CHECK (packet_cache_get_highest_available_framecnt (pcache, &highest) && highest == f + 1,
+               "framecnt %u: highest available %u", f, highest);
+        CHECK (retrieve_and_check (pcache, f, pkt_size, pkt_size) == 0, "framecnt %u not complete", f);
+        CHECK (retrieve_and_check (pcache, f + 1, pkt_size, pkt_size) == 0, "framecnt %u not complete", f + 1);
+    }
+
+    /* packets from before the last one retrieved are late, even across the wrap */
+    {
+        jack_nframes_t late = pcache->late_packets;
+        int n = make_fragments (datagrams, start + 30, pkt_size);
+
+        add_all (pcache, datagrams, n);
+        CHECK (pcache->late_packets == late + 1, "late packet across the wrap not counted");
+    }
+    packet_cache_free (pcache);
+}
+
+/*
+ * With more packets in flight than the cache holds, the oldest are
+ * evicted; the newest still come out whole, also across the wrap.
+ */
+static void
+test_eviction (void)
+{
+    int pkt_size = packet_size (2);
+    packet_cache *pcache = packet_cache_new (3, pkt_size, MTU);
+    jack_nframes_t start = 0xfffffffe;
+    jack_nframes_t g;
+    int n = 0;
+
+    for (g = start; g != start + 6; g++)
+        n += make_fragments (datagrams + n, g, pkt_size);
+    add_all (pcache, datagrams, n);
+
+    for (g = start; g != start + 3; g++) {
+        char *packet_buf;
+        CHECK (packet_cache_retreive_packet_pointer (pcache, g, &packet_buf, pkt_size, NULL) < 0,
+               "framecnt %u should have been evicted", g);
+    }
+    for (g = start + 3; g != start + 6; g++)
+        CHECK (retrieve_and_check (pcache, g, pkt_size, pkt_size) == 0, "framecnt %u not complete", g);
+    packet_cache_free (pcache);
+}
+
+/* Datagrams too long for the packet are dropped, without harm to it. */
+static void
+test_oversized (void)
+{
+    int pkt_size = sizeof (jacknet_packet_header) + 300;     // one short fragment
+    packet_cache *pcache = packet_cache_new (4, pkt_size, MTU);
+    jack_nframes_t f;
+
+    for (f = 0; f < 20; f++) {
+        datagram_t bad[2];
+        int n = make_fragments (datagrams, f, pkt_size);
+
+        /* a full mtu fragment 0, and a fragment number past the end */
+        make_fragments (bad, f, sizeof (jacknet_packet_header) + MTU);
+        bad[0].len = MTU;
+        memcpy (&bad[1], &datagrams[0], sizeof (datagram_t));
+        ((jacknet_packet_header *) bad[1].buf)->fragment_nr = htonl (7);
+
+        add_all (pcache, bad, 2);
+        add_all (pcache, datagrams, n);
+        CHECK (retrieve_and_check (pcache, f, pkt_size, pkt_size) == 0, "framecnt %u not complete", f);
+    }
+
+    /* and a second fragment that runs past the end of the packet */
+    pkt_size = packet_size (2) - 50;
+    packet_cache_free (pcache);
+    pcache = packet_cache_new (4, pkt_size, MTU);
+    for (f = 0; f < 20; f++) {
+        datagram_t bad;
+        int n = make_fragments (datagrams, f, pkt_size);
+
+        memcpy (&bad, &datagrams[0], sizeof (datagram_t));
+        ((jacknet_packet_header *) bad.buf)->fragment_nr = htonl (1);
+        add_all (pcache, &bad, 1);
+        shuffle (datagrams, n);
+        add_all (pcache, datagrams, n);
+        CHECK (retrieve_and_check (pcache, f, pkt_size, pkt_size) == 0, "framecnt %u not complete", f);
+    }
+    packet_cache_free (pcache);
+}
+
+/* Variable sized packets come out at the size they were sent with. */
+static void
+test_variable_size (void)
+{
+    int max_size = packet_size (6);
+    packet_cache *pcache = packet_cache_new (4, max_size, MTU);
+    jack_nframes_t f;
+
+    packet_cache_set_variable_size (pcache, 1);
+    for (f = 0; f < 200; f++) {
+        int size = sizeof (jacknet_packet_header) + 1 + rng () % (max_size - sizeof (jacknet_packet_header) - 1);
+        int n;
+
+        size = netjack_variable_packet_size (size, MTU);
+        if (size > max_size)
+            size -= 2;
+        n = make_fragments (datagrams, f, size);
+        shuffle (datagrams, n);
+        add_all (pcache, datagrams, n);
+        CHECK (retrieve_and_check (pcache, f, max_size, size) == 0, "framecnt %u (%d bytes) not complete", f, size);
+    }
+    packet_cache_free (pcache);
+}
+
+/* Datagrams from anyone but the first sender are ignored. */
+static void
+test_master_address (void)
+{
+    int pkt_size = packet_size (2);
+    packet_cache *pcache = packet_cache_new (4, pkt_size, MTU);
+    struct sockaddr_in other = master;
+    char *packet_buf;
+    int n, i;
+
+    other.sin_port = htons (4001);
+    n = make_fragments (datagrams, 1, pkt_size);
+    packet_cache_add_datagram (pcache, datagrams[0].buf, datagrams[0].len, &master);
+    for (i = 1; i < n; i++)
+        packet_cache_add_datagram (pcache, datagrams[i].buf, datagrams[i].len, &other);
+    CHECK (packet_cache_retreive_packet_pointer (pcache, 1, &packet_buf, pkt_size, NULL) < 0,
+           "fragments of another sender accepted");
+    packet_cache_free (pcache);
+}
+
+static int
+run_tests (void)
+{
+    test_in_order ();
+    test_reorder_and_duplicates ();
+    test_loss ();
+    test_wraparound ();
+    test_eviction ();
+    test_oversized ();
+    test_variable_size ();
+    test_master_address ();
+
+    if (failures) {
+        fprintf (stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf ("all packet cache checks passed\n");
+    return 0;
+}
+
+static inline uint64_t
+now_nsecs (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Steady state of a receiver with latency packets in flight: every
+ * period the fragments of a new packet arrive, slightly reordered,
+ * and the oldest packet is looked up, retrieved and released.
+ */
+static void
+bench_one (int cache_size, int fragments)
+{
+    int pkt_size = packet_size (fragments);
+    int latency = cache_size / 2;
+    int periods = 200000 / fragments;
+    packet_cache *pcache = packet_cache_new (cache_size, pkt_size, MTU);
+    uint64_t add_nsecs = 0, lookup_nsecs = 0, retrieve_nsecs = 0;
+    jack_nframes_t f, next;
+    int missed = 0;
+
+    for (f = 0; f < (jack_nframes_t) (periods + latency); f++) {
+        int n = make_fragments (datagrams, f, pkt_size);
+        uint64_t t0, t1, t2, t3;
+        char *packet_buf;
+
+        if (n > 1) {
+            datagram_t tmp = datagrams[0];
+            datagrams[0] = datagrams[n - 1];
+            datagrams[n - 1] = tmp;
+        }
+        t0 = now_nsecs ();
+        add_all (pcache, datagrams, n);
+        t1 = now_nsecs ();
+        add_nsecs += t1 - t0;
+
+        if (f < (jack_nframes_t) latency)
+            continue;
+
+        t1 = now_nsecs ();
+        packet_cache_get_next_available_framecnt (pcache, f - latency, &next);
+        t2 = now_nsecs ();
+        if (packet_cache_retreive_packet_pointer (pcache, f - latency, &packet_buf, pkt_size, NULL) < 0)
+            missed++;
+        else
+            packet_cache_release_packet (pcache, f - latency);
+        t3 = now_nsecs ();
+        lookup_nsecs += t2 - t1;
+        retrieve_nsecs += t3 - t2;
+    }
+
+    printf ("%6d %9d %14.1f %14.1f %14.1f%s\n", cache_size, fragments,
+            (double) add_nsecs / ((double) (periods + latency) * fragments),
+            (double) lookup_nsecs / periods, (double) retrieve_nsecs / periods,
+            missed ? "  (missed packets!)" : "");
+    packet_cache_free (pcache);
+}
+
+static int
+run_benchmark (void)
+{
+    int cache_sizes[] = { 4, 16, 64 };
+    int fragment_counts[] = { 1, 8, 32, 64 };
+    unsigned int c, f;
+
+    printf ("%6s %9s %14s %14s %14s\n", "cache", "fragments", "ns/fragment", "ns/next avail", "ns/retrieve");
+    for (c = 0; c < sizeof (cache_sizes) / sizeof (cache_sizes[0]); c++)
+        for (f = 0; f < sizeof (fragment_counts) / sizeof (fragment_counts[0]); f++)
+            bench_one (cache_sizes[c], fragment_counts[f]);
+    return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+    master.sin_family = AF_INET;
+    master.sin_port = htons (4000);
+    master.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    if (argc > 1 && strcmp (argv[1], "-b") == 0)
+        return run_benchmark ();
+    if (argc > 1) {
+        fprintf (stderr, "usage: packet_cache_test [-b]\n");
+        return 2;
+    }
+    return run_tests ();
+}
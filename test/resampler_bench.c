@@ -0,0 +1,170 @@
+
+/*
+ * Benchmark of the resampler backends
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ */
+
+/*
+ * Run every backend at every quality the way alsa_in does: ask for a
+ * period of output, offer a little more input than that needs and
+ * take back what was not used. The CPU time is given per channel, as
+ * a share of real time at 48 kHz. The quality is the ratio of a sine
+ * to everything else in the output, after fitting the sine at the
+ * output rate, so it counts noise, distortion and aliasing alike.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include <resampler.h>
+
+#define RATE 48000
+#define PERIOD 256
+#define SECONDS 4
+#define SETTLE_FRAMES 4096
+
+typedef struct {
+    double nsecs_per_frame;
+    double snr_db;
+} run_result_t;
+
+static inline uint64_t
+now_nsecs (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Least squares fit of a sine of frequency w, in radians per sample,
+ * plus an offset to out. Returns the ratio of the sine to the rest in
+ * dB.
+ */
+static double
+sine_snr (const float *out, int frames, double w)
+{
+    double m[3][4] = { { 0 } };
+    double coef[3], signal = 0.0, noise = 0.0;
+    int n, i, j, k;
+
+    for (n = 0; n < frames; n++) {
+        double v[3] = { sin (w * n), cos (w * n), 1.0 };
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 3; j++)
+                m[i][j] += v[i] * v[j];
+            m[i][3] += v[i] * out[n];
+        }
+    }
+    /* Gauss-Jordan, the system is well conditioned */
+    for (i = 0; i < 3; i++) {
+        for (k = 0; k < 3; k++) {
+            double f = m[k][i] / m[i][i];
+            if (k == i)
+                continue;
+            for (j = i; j < 4; j++)
+                m[k][j] -= f * m[i][j];
+        }
+    }
+    for (i = 0; i < 3; i++)
+        coef[i] = m[i][3] / m[i][i];
+
+    for (n = 0; n < frames; n++) {
+        double fit = coef[0] * sin (w * n) + coef[1] * cos (w * n) + coef[2];
+        signal += fit * fit;
+        noise += (out[n] - fit) * (out[n] - fit);
+    }
+    return 10.0 * log10 (signal / (noise + 1e-30));
+}
+
+/* Resample a sine of freq Hz from RATE to RATE * ratio. */
+static int
+run (resampler_type type, int quality, double ratio, double freq, run_result_t *result)
+{
+    int out_total = SECONDS * RATE;
+    int in_total = out_total / ratio + 4 * PERIOD;
+    float *in = malloc (in_total * sizeof (float));
+    float *out = malloc (out_total * sizeof (float));
+    resampler *rs = resampler_new (type, quality, ratio, ceil (PERIOD / ratio) + 2);
+    uint64_t nsecs = 0;
+    int in_pos = 0, out_pos = 0, n;
+
+    if (rs == NULL || in == NULL || out == NULL) {
+        free (in);
+        free (out);
+        return -1;
+    }
+    for (n = 0; n < in_total; n++)
+        in[n] = 0.5 * sin (2 * M_PI * freq * n / RATE);
+
+    while (out_pos + PERIOD <= out_total) {
+        int offer = ceil (PERIOD / ratio) + 2;
+        uint64_t start;
+        int used, gen;
+
+        if (in_pos + offer > in_total)
+            break;
+        start = now_nsecs ();
+        gen = resampler_process (rs, in + in_pos, offer, out + out_pos, PERIOD, ratio, &used);
+        nsecs += now_nsecs () - start;
+        in_pos += used;
+        out_pos += gen;
+        if (gen == 0 && used == 0)
+            break;
+    }
+
+    result->nsecs_per_frame = (double) nsecs / out_pos;
+    result->snr_db = sine_snr (out + SETTLE_FRAMES, out_pos - SETTLE_FRAMES, 2 * M_PI * freq / (RATE * ratio));
+
+    resampler_free (rs);
+    free (in);
+    free (out);
+    return 0;
+}
+
+int
+main (void)
+{
+    int t, q;
+
+    printf ("%-11s %7s %12s %10s %14s %14s %14s\n", "backend", "quality", "ns/frame", "cpu@48k",
+            "1k@1.0001", "15k@1.0001", "1k@44.1/48");
+    for (t = 0; t < RESAMPLER_NUM_TYPES; t++) {
+        if (!resampler_type_available ((resampler_type) t)) {
+            printf ("%-11s not built in\n", resampler_type_name ((resampler_type) t));
+            continue;
+        }
+        for (q = 0; q <= RESAMPLER_MAX_QUALITY; q++) {
+            run_result_t near, high, down;
+
+            if (run ((resampler_type) t, q, 1.0001, 997.0, &near)
+                    || run ((resampler_type) t, q, 1.0001, 15013.0, &high)
+                    || run ((resampler_type) t, q, 44100.0 / 48000.0, 997.0, &down)) {
+                printf ("%-11s %7d cannot be set up\n", resampler_type_name ((resampler_type) t), q);
+                continue;
+            }
+            printf ("%-11s %7d %12.1f %9.3f%% %11.1f dB %11.1f dB %11.1f dB\n",
+                    resampler_type_name ((resampler_type) t), q, near.nsecs_per_frame,
+                    near.nsecs_per_frame * RATE / 1e7, near.snr_db, high.snr_db, down.snr_db);
+        }
+    }
+    return 0;
+}
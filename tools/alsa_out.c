@@ -19,7 +19,7 @@
 
 #include "alsa/asoundlib.h"
 
-#include <samplerate.h>
+#include "resampler.h"
 
 // Here are the lists of the jack ports...
 
@@ -51,6 +51,8 @@ double offset_integral = 0;
 const char* alsa_device = "hw:0";
 int sample_rate = 0;				 /* stream rate */
 int num_channels = 2;				 /* count of channels */
+int *channel_map = NULL;			 /* alsa channel of every port */
+int num_ports = 0;
 int period_size = 1024;
 int num_periods = 2;
 
@@ -65,6 +67,7 @@ int good_window=0;
 int verbose = 0;
 int instrument = 0;
 int samplerate_quality = 2;
+resampler_type resampler_kind = RESAMPLER_SRC;
 
 // Debug stuff:
 
@@ -309,6 +312,66 @@ static snd_pcm_t *open_audiofd( const char *device_name, int capture, int rate,
 	return handle;
 }
 
+/**
+ * Parse a channel map like "17,18,33-36", counting alsa channels from 1.
+ * Fills channel_map with the 0 based channel of every port, and returns
+ * the highest channel mapped, or -1 if the map is invalid.
+ */
+int parse_channel_map( const char *spec ) {
+	char *copy = strdup( spec );
+	char *token, *savep = NULL;
+	int highest = -1;
+
+	for( token = strtok_r( copy, ",", &savep ); token; token = strtok_r( NULL, ",", &savep ) ) {
+		int first, last, chn, i;
+		char *end;
+
+		first = last = strtol( token, &end, 10 );
+		if( *end == '-' )
+			last = strtol( end + 1, &end, 10 );
+		if( *end != '\0' || first < 1 || last < first )
+			goto fail;
+
+		for( chn = first - 1; chn < last; chn++ ) {
+			for( i = 0; i < num_ports; i++ )
+				if( channel_map[i] == chn )
+					goto fail;
+			channel_map = realloc( channel_map, sizeof(int) * (num_ports + 1) );
+			channel_map[num_ports++] = chn;
+			if( chn > highest )
+				highest = chn;
+		}
+	}
+	free( copy );
+	return highest;
+
+fail:
+	free( copy );
+	return -1;
+}
+
+/**
+ * Check the channel map against the channels the device was opened
+ * with, or map every channel in order without -M.
+ */
+int setup_channel_map( void ) {
+	int i;
+
+	if( channel_map == NULL ) {
+		channel_map = malloc( sizeof(int) * num_channels );
+		for( num_ports = 0; num_ports < num_channels; num_ports++ )
+			channel_map[num_ports] = num_ports;
+		return 1;
+	}
+	for( i = 0; i < num_ports; i++ ) {
+		if( channel_map[i] >= num_channels ) {
+			fprintf( stderr, "channel %d is not available, the device has %d channels\n", channel_map[i] + 1, num_channels );
+			return 0;
+		}
+	}
+	return 1;
+}
+
 double hann( double x )
 {
 	return 0.5 * (1.0 - cos( 2*M_PI * x ) );
@@ -459,44 +522,41 @@ int process (jack_nframes_t nframes, void *arg) {
 	outbuf = alloca( rlen * formats[format].sample_size * num_channels );
 
 	resampbuf = alloca( rlen * sizeof( float ) );
+
+	// the channels without a port are silenced here, all at once
+	if( num_ports < num_channels )
+		memset( outbuf, 0, rlen * formats[format].sample_size * num_channels );
+
 	/*
 	 * render jack ports to the outbuf...
 	 */
 
-	int chn = 0;
+	int port_nr = 0;
 	JSList *node = playback_ports;
 	JSList *src_node = playback_srcs;
-	SRC_DATA src;
+	int frames_gen = 0;
+	int used;
 
 	while ( node != NULL)
 	{
 		jack_port_t *port = (jack_port_t *) node->data;
 		float *buf = jack_port_get_buffer (port, nframes);
 
-		SRC_STATE *src_state = src_node->data;
+		resampler *src_state = src_node->data;
 
-		src.data_in = buf;
-		src.input_frames = nframes;
+		frames_gen = resampler_process( src_state, buf, nframes, resampbuf, rlen, current_resample_factor, &used );
 
-		src.data_out = resampbuf;
-		src.output_frames = rlen;
-		src.end_of_input = 0;
-
-		src.src_ratio = current_resample_factor;
-
-		src_process( src_state, &src );
-
-		formats[format].jack_to_soundcard( outbuf + format[formats].sample_size * chn, resampbuf, src.output_frames_gen, num_channels*format[formats].sample_size, NULL);
+		int chn = channel_map[port_nr];
+		formats[format].jack_to_soundcard( outbuf + format[formats].sample_size * chn, resampbuf, frames_gen, num_channels*format[formats].sample_size, NULL);
 
 		src_node = jack_slist_next (src_node);
 		node = jack_slist_next (node);
-		chn++;
+		port_nr++;
 	}
 
 	// now write the output...
 again:
-	err = snd_pcm_writei(alsa_handle, outbuf, src.output_frames_gen);
-	//err = snd_pcm_writei(alsa_handle, outbuf, src.output_frames_gen);
+	err = snd_pcm_writei(alsa_handle, outbuf, frames_gen);
 	if( err < 0 ) {
 		printf( "err = %d\n", err );
 		if (xrun_recovery(alsa_handle, err) < 0) {
@@ -550,7 +610,7 @@ void alloc_ports( int n_capture, int n_playback ) {
 	capture_ports = NULL;
 	for (chn = 0; chn < n_capture; chn++)
 	{
-		snprintf (buf, sizeof(buf) - 1, "capture_%u", chn+1);
+		snprintf (buf, sizeof(buf) - 1, "capture_%u", channel_map[chn]+1);
 
 		port = jack_port_register (client, buf,
 			JACK_DEFAULT_AUDIO_TYPE,
@@ -562,7 +622,7 @@ void alloc_ports( int n_capture, int n_playback ) {
 			break;
 		}
 
-		capture_srcs = jack_slist_append( capture_srcs, src_new( 4-samplerate_quality, 1, NULL ) );
+		capture_srcs = jack_slist_append( capture_srcs, resampler_new( resampler_kind, samplerate_quality, static_resample_factor, jack_buffer_size ) );
 		capture_ports = jack_slist_append (capture_ports, port);
 	}
 
@@ -571,7 +631,7 @@ void alloc_ports( int n_capture, int n_playback ) {
 	playback_ports = NULL;
 	for (chn = 0; chn < n_playback; chn++)
 	{
-		snprintf (buf, sizeof(buf) - 1, "playback_%u", chn+1);
+		snprintf (buf, sizeof(buf) - 1, "playback_%u", channel_map[chn]+1);
 
 		port = jack_port_register (client, buf,
 			JACK_DEFAULT_AUDIO_TYPE,
@@ -583,7 +643,7 @@ void alloc_ports( int n_capture, int n_playback ) {
 			break;
 		}
 
-		playback_srcs = jack_slist_append( playback_srcs, src_new( 4-samplerate_quality, 1, NULL ) );
+		playback_srcs = jack_slist_append( playback_srcs, resampler_new( resampler_kind, samplerate_quality, static_resample_factor, jack_buffer_size ) );
 		playback_ports = jack_slist_append (playback_ports, port);
 	}
 }
@@ -612,10 +672,12 @@ fprintf(stderr, "usage: alsa_out [options]\n"
 		"  -S <server name> - server to connect\n"
 		"  -d <alsa_device> \n"
 		"  -c <channels> \n"
+		"  -M <channel map> - only these channels, e.g. 17,18,33-36\n"
 		"  -p <period_size> \n"
 		"  -n <num_period> \n"
 		"  -r <sample_rate> \n"
 		"  -q <sample_rate quality [0..4]\n"
+		"  -R <resampler> - src, vresampler or polyphase\n"
 		"  -m <max_diff> \n"
 		"  -t <target_delay> \n"
 		"  -i  turns on instrumentation\n"
@@ -644,8 +706,10 @@ int main (int argc, char *argv[]) {
 	extern int optind, optopt;
 	int errflg=0;
 	int c;
+	const char *channel_map_spec = NULL;
+	const char *resampler_spec = NULL;
 
-	while ((c = getopt(argc, argv, "ivj:r:c:p:n:d:q:m:t:f:F:C:Q:s:S:")) != -1) {
+	while ((c = getopt(argc, argv, "ivj:r:c:M:p:n:d:q:R:m:t:f:F:C:Q:s:S:")) != -1) {
 		switch(c) {
 		case 'j':
 			strcpy(jack_name,optarg);
@@ -656,6 +720,9 @@ int main (int argc, char *argv[]) {
 		case 'c':
 			num_channels = atoi(optarg);
 			break;
+		case 'M':
+			channel_map_spec = optarg;
+			break;
 		case 'p':
 			period_size = atoi(optarg);
 			break;
@@ -671,6 +738,9 @@ int main (int argc, char *argv[]) {
 		case 'q':
 			samplerate_quality = atoi(optarg);
 			break;
+		case 'R':
+			resampler_spec = optarg;
+			break;
 		case 'm':
 			max_diff = atoi(optarg);
 			break;
@@ -719,6 +789,25 @@ int main (int argc, char *argv[]) {
 		fprintf (stderr, "invalid samplerate quality\n");
 		return 1;
 	}
+	if( resampler_spec ) {
+		if( resampler_type_from_name( resampler_spec, &resampler_kind ) < 0 ) {
+			fprintf (stderr, "invalid resampler %s\n", resampler_spec);
+			return 1;
+		}
+		if( !resampler_type_available( resampler_kind ) ) {
+			fprintf (stderr, "not built with the %s resampler\n", resampler_spec);
+			return 1;
+		}
+	}
+	if( channel_map_spec ) {
+		int highest = parse_channel_map( channel_map_spec );
+		if( highest < 0 ) {
+			fprintf (stderr, "invalid channel map %s\n", channel_map_spec);
+			return 1;
+		}
+		if( highest >= num_channels )
+			num_channels = highest + 1;
+	}
 	if ((client = jack_client_open (jack_name, jack_opts, NULL, server_name)) == 0) {
 		fprintf (stderr, "jack server not running?\n");
 		return 1;
@@ -798,7 +887,10 @@ int main (int argc, char *argv[]) {
 	printf( "selected sample format: %s\n", formats[format].name );
 
 	// alloc input ports, which are blasted out to alsa...
-	alloc_ports( 0, num_channels );
+	if( !setup_channel_map() )
+		exit(20);
+
+	alloc_ports( 0, num_ports );
 
 	outbuf = malloc( num_periods * period_size * formats[format].sample_size * num_channels );
 	resampbuf = malloc( num_periods * period_size * sizeof( float ) );
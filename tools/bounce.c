@@ -0,0 +1,504 @@
+/*
+    bounce - render JACK ports to a file in freewheel mode
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sndfile.h>
+#include <pthread.h>
+#include <signal.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include <jack/jack.h>
+#include <jack/transport.h>
+#include <jack/ringbuffer.h>
+
+#define DEFAULT_RB_SIZE 262144		/* ringbuffer size in frames */
+#define WRITE_CHUNK 8192		/* frames per sf_writef_float() call */
+
+typedef struct {
+	jack_client_t *client;
+	SNDFILE *sf;
+	unsigned int channels;
+	jack_port_t **ports;
+	float *scratch;			/* interleaved samples of one period */
+	jack_nframes_t scratch_frames;
+	jack_ringbuffer_t *rb;
+	jack_nframes_t rb_frames;	/* as asked for with -B */
+	size_t bytes_per_frame;
+	jack_nframes_t start;
+	jack_nframes_t end;
+	jack_nframes_t next_frame;	/* next transport frame expected in range */
+	volatile jack_nframes_t captured;
+	volatile int freewheeling;
+	volatile int armed;
+	volatile int finished;		/* everything has been written */
+	volatile int stop;
+	volatile int status;
+	long overruns;
+} bounce_t;
+
+static bounce_t bounce;
+static pthread_t disk_thread_id;
+static pthread_mutex_t disk_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_ready = PTHREAD_COND_INITIALIZER;
+
+static void
+signal_handler (int sig)
+{
+	jack_set_freewheel (bounce.client, 0);
+	jack_transport_stop (bounce.client);
+	jack_client_close (bounce.client);
+	fprintf (stderr, "signal received, exiting ...\n");
+	exit (1);
+}
+
+static void
+jack_shutdown (void *arg)
+{
+	fprintf (stderr, "JACK shut down, exiting ...\n");
+	exit (1);
+}
+
+static void
+freewheel_callback (int starting, void *arg)
+{
+	bounce.freewheeling = starting;
+}
+
+static int
+buffer_size_callback (jack_nframes_t nframes, void *arg)
+{
+	/* not called from the process thread, allocating is fine */
+	float *scratch;
+
+	/* with less than two periods the process thread could wait for
+	   space that never comes while freewheeling */
+	if (bounce.rb_frames < 2 * nframes) {
+		fprintf (stderr, "buffer of %" PRIu32 " frames is less than two periods of %" PRIu32 "\n",
+			 bounce.rb_frames, nframes);
+		bounce.status = ENOSPC;
+		return -1;
+	}
+	scratch = realloc (bounce.scratch, nframes * bounce.bytes_per_frame);
+
+	if (scratch == NULL) {
+		return -1;
+	}
+	memset (scratch, 0, nframes * bounce.bytes_per_frame);
+	bounce.scratch = scratch;
+	bounce.scratch_frames = nframes;
+	return 0;
+}
+
+/* Writes large blocks of whole frames to disk, so the process thread
+   only ever copies into the ringbuffer. */
+static void *
+disk_thread (void *arg)
+{
+	size_t chunk_bytes = WRITE_CHUNK * bounce.bytes_per_frame;
+	char *buf = malloc (chunk_bytes);
+	jack_nframes_t written = 0;
+	jack_nframes_t total = bounce.end - bounce.start;
+
+	pthread_mutex_lock (&disk_thread_lock);
+
+	while (written < total && bounce.status == 0) {
+		size_t avail = jack_ringbuffer_read_space (bounce.rb);
+		size_t frames = avail / bounce.bytes_per_frame;
+
+		if (frames == 0) {
+			if (bounce.stop) {
+				break;
+			}
+			pthread_cond_wait (&data_ready, &disk_thread_lock);
+			continue;
+		}
+		if (frames > WRITE_CHUNK) {
+			frames = WRITE_CHUNK;
+		}
+
+		jack_ringbuffer_read (bounce.rb, buf, frames * bounce.bytes_per_frame);
+		pthread_cond_signal (&space_ready);
+
+		/* disk I/O happens without holding the lock */
+		pthread_mutex_unlock (&disk_thread_lock);
+		if (sf_writef_float (bounce.sf, (float *) buf, frames) != (sf_count_t) frames) {
+			char errstr[256];
+			sf_error_str (bounce.sf, errstr, sizeof (errstr) - 1);
+			fprintf (stderr, "cannot write sndfile (%s)\n", errstr);
+			bounce.status = EIO;
+		}
+		pthread_mutex_lock (&disk_thread_lock);
+
+		written += frames;
+	}
+
+	bounce.finished = 1;
+	pthread_cond_signal (&space_ready);
+	pthread_mutex_unlock (&disk_thread_lock);
+	free (buf);
+	return 0;
+}
+
+static int
+process (jack_nframes_t nframes, void *arg)
+{
+	jack_position_t pos;
+	jack_nframes_t offset;
+	jack_nframes_t count;
+	jack_nframes_t i;
+	size_t bytes;
+	unsigned int chn;
+
+	if (!bounce.armed || bounce.captured >= bounce.end - bounce.start) {
+		return 0;
+	}
+
+	if (jack_transport_query (bounce.client, &pos) != JackTransportRolling) {
+		return 0;
+	}
+
+	/* pick the part of this period that lies within [start, end) */
+	if (pos.frame + nframes <= bounce.next_frame || pos.frame >= bounce.end) {
+		return 0;
+	}
+	if (pos.frame > bounce.next_frame) {
+		/* somebody relocated the transport, the render would have a gap */
+		bounce.status = ESPIPE;
+		bounce.armed = 0;
+		return 0;
+	}
+	offset = bounce.next_frame - pos.frame;
+	count = nframes - offset;
+	if (count > bounce.end - bounce.next_frame) {
+		count = bounce.end - bounce.next_frame;
+	}
+
+	for (chn = 0; chn < bounce.channels; chn++) {
+		jack_default_audio_sample_t *in = jack_port_get_buffer (bounce.ports[chn], nframes);
+		float *out = bounce.scratch + chn;
+		for (i = 0; i < count; i++) {
+			*out = in[offset + i];
+			out += bounce.channels;
+		}
+	}
+
+	bytes = count * bounce.bytes_per_frame;
+
+	if (jack_ringbuffer_write_space (bounce.rb) < bytes) {
+		if (bytes >= bounce.rb->size) {
+			/* can never fit, even with the disk thread idle */
+			bounce.status = ENOSPC;
+			return 0;
+		}
+		if (bounce.freewheeling) {
+			/* Not realtime while freewheeling: wait for the disk to catch
+			 * up, which throttles the graph instead of losing samples. */
+			pthread_mutex_lock (&disk_thread_lock);
+			while (jack_ringbuffer_write_space (bounce.rb) < bytes && !bounce.finished && !bounce.stop) {
+				pthread_cond_wait (&space_ready, &disk_thread_lock);
+			}
+			pthread_mutex_unlock (&disk_thread_lock);
+		} else {
+			bounce.overruns++;
+			bounce.status = EPIPE;
+			return 0;
+		}
+	}
+
+	jack_ringbuffer_write (bounce.rb, (const char *) bounce.scratch, bytes);
+	bounce.next_frame += count;
+	bounce.captured += count;
+
+	if (pthread_mutex_trylock (&disk_thread_lock) == 0) {
+		pthread_cond_signal (&data_ready);
+		pthread_mutex_unlock (&disk_thread_lock);
+	}
+
+	return 0;
+}
+
+static int
+open_file (const char *path, const char *format)
+{
+	SF_INFO sf_info;
+	int subformat;
+
+	memset (&sf_info, 0, sizeof (sf_info));
+	sf_info.samplerate = jack_get_sample_rate (bounce.client);
+	sf_info.channels = bounce.channels;
+
+	if (strcmp (format, "16") == 0) {
+		subformat = SF_FORMAT_PCM_16;
+	} else if (strcmp (format, "24") == 0) {
+		subformat = SF_FORMAT_PCM_24;
+	} else if (strcmp (format, "32") == 0) {
+		subformat = SF_FORMAT_PCM_32;
+	} else if (strcmp (format, "float") == 0) {
+		subformat = SF_FORMAT_FLOAT;
+	} else {
+		fprintf (stderr, "unknown sample format \"%s\"\n", format);
+		return -1;
+	}
+	sf_info.format = SF_FORMAT_WAV | subformat;
+
+	if ((bounce.sf = sf_open (path, SFM_WRITE, &sf_info)) == NULL) {
+		char errstr[256];
+		sf_error_str (0, errstr, sizeof (errstr) - 1);
+		fprintf (stderr, "cannot open sndfile \"%s\" for output (%s)\n", path, errstr);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+setup_ports (int sources, char *source_names[])
+{
+	unsigned int i;
+
+	bounce.ports = (jack_port_t **) calloc (sources, sizeof (jack_port_t *));
+
+	for (i = 0; i < bounce.channels; i++) {
+		char name[64];
+
+		snprintf (name, sizeof (name), "input%d", i + 1);
+		if ((bounce.ports[i] = jack_port_register (bounce.client, name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0)) == 0) {
+			fprintf (stderr, "cannot register input port \"%s\"!\n", name);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < bounce.channels; i++) {
+		if (jack_connect (bounce.client, source_names[i], jack_port_name (bounce.ports[i]))) {
+			fprintf (stderr, "cannot connect input port %s to %s\n", jack_port_name (bounce.ports[i]), source_names[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Stop the transport and wait until it has settled at frame */
+static int
+locate (jack_nframes_t frame)
+{
+	jack_position_t pos;
+	int tries;
+
+	jack_transport_stop (bounce.client);
+	jack_transport_locate (bounce.client, frame);
+
+	for (tries = 0; tries < 1000; tries++) {
+		if (jack_transport_query (bounce.client, &pos) == JackTransportStopped && pos.frame == frame) {
+			return 0;
+		}
+		usleep (10000);
+	}
+	fprintf (stderr, "transport did not locate to frame %" PRIu32 "\n", frame);
+	return -1;
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: jack_bounce -f filename [ -s start ] { -n frames | -d seconds } [ -b format ] [ -B bufsize ] port1 [ port2 ... ]\n");
+	fprintf (stderr, "Renders JACK ports to a WAV file in freewheel mode.\n\n");
+	fprintf (stderr, "        -f, --file <name>      Output file\n");
+	fprintf (stderr, "        -s, --start <frame>    Transport frame to start at (default: 0)\n");
+	fprintf (stderr, "        -n, --frames <count>   Number of frames to render\n");
+	fprintf (stderr, "        -d, --duration <secs>  Number of seconds to render\n");
+	fprintf (stderr, "        -b, --bitdepth <fmt>   16, 24, 32 or float (default: float)\n");
+	fprintf (stderr, "        -B, --bufsize <frames> Ringbuffer size in frames (default: %d)\n", DEFAULT_RB_SIZE);
+	fprintf (stderr, "        -h, --help             Display this help message\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	int c;
+	int longopt_index = 0;
+	char *path = NULL;
+	char *format = "float";
+	jack_nframes_t start = 0;
+	jack_nframes_t frames = 0;
+	double seconds = 0;
+	jack_nframes_t rb_size = DEFAULT_RB_SIZE;
+	jack_nframes_t sample_rate;
+	jack_time_t t_start, t_end;
+	double elapsed;
+	int rc = 1;
+	struct option long_options[] = {
+		{ "help", 0, 0, 'h' },
+		{ "file", 1, 0, 'f' },
+		{ "start", 1, 0, 's' },
+		{ "frames", 1, 0, 'n' },
+		{ "duration", 1, 0, 'd' },
+		{ "bitdepth", 1, 0, 'b' },
+		{ "bufsize", 1, 0, 'B' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((c = getopt_long (argc, argv, "f:s:n:d:b:B:h", long_options, &longopt_index)) != -1) {
+		switch (c) {
+		case 'f':
+			path = optarg;
+			break;
+		case 's':
+			start = strtoul (optarg, NULL, 10);
+			break;
+		case 'n':
+			frames = strtoul (optarg, NULL, 10);
+			break;
+		case 'd':
+			seconds = atof (optarg);
+			break;
+		case 'b':
+			format = optarg;
+			break;
+		case 'B':
+			rb_size = strtoul (optarg, NULL, 10);
+			break;
+		case 'h':
+			usage ();
+			return 0;
+		default:
+			usage ();
+			return 1;
+		}
+	}
+
+	if (path == NULL || optind == argc || (frames == 0 && seconds <= 0)) {
+		usage ();
+		return 1;
+	}
+
+	if ((bounce.client = jack_client_open ("jack_bounce", JackNoStartServer, NULL)) == 0) {
+		fprintf (stderr, "JACK server not running?\n");
+		return 1;
+	}
+
+	sample_rate = jack_get_sample_rate (bounce.client);
+	if (frames == 0) {
+		frames = (jack_nframes_t) (seconds * sample_rate + 0.5);
+	}
+
+	bounce.channels = argc - optind;
+	bounce.bytes_per_frame = bounce.channels * sizeof (float);
+	bounce.start = bounce.next_frame = start;
+	bounce.end = start + frames;
+	bounce.rb_frames = rb_size;
+	if (rb_size < 2 * jack_get_buffer_size (bounce.client)) {
+		fprintf (stderr, "-B %" PRIu32 " is less than two periods of %" PRIu32 " frames\n",
+			 rb_size, jack_get_buffer_size (bounce.client));
+		jack_client_close (bounce.client);
+		return 1;
+	}
+	bounce.rb = jack_ringbuffer_create (rb_size * bounce.bytes_per_frame);
+	memset (bounce.rb->buf, 0, bounce.rb->size);
+	buffer_size_callback (jack_get_buffer_size (bounce.client), NULL);
+
+	if (open_file (path, format)) {
+		goto exit;
+	}
+
+	jack_set_process_callback (bounce.client, process, NULL);
+	jack_set_buffer_size_callback (bounce.client, buffer_size_callback, NULL);
+	jack_set_freewheel_callback (bounce.client, freewheel_callback, NULL);
+	jack_on_shutdown (bounce.client, jack_shutdown, NULL);
+
+	if (jack_activate (bounce.client)) {
+		fprintf (stderr, "cannot activate client\n");
+		goto exit;
+	}
+
+	if (setup_ports (bounce.channels, &argv[optind])) {
+		goto exit;
+	}
+
+#ifndef WIN32
+	signal (SIGQUIT, signal_handler);
+	signal (SIGHUP, signal_handler);
+#endif
+	signal (SIGTERM, signal_handler);
+	signal (SIGINT, signal_handler);
+
+	if (locate (start)) {
+		goto exit;
+	}
+
+	pthread_create (&disk_thread_id, NULL, disk_thread, NULL);
+
+	if (jack_set_freewheel (bounce.client, 1)) {
+		fprintf (stderr, "cannot enter freewheel mode, rendering in realtime\n");
+	}
+
+	t_start = jack_get_time ();
+	bounce.armed = 1;
+	jack_transport_start (bounce.client);
+
+	while (!bounce.finished && bounce.status == 0) {
+		usleep (10000);
+	}
+
+	bounce.armed = 0;
+	jack_transport_stop (bounce.client);
+	jack_set_freewheel (bounce.client, 0);
+	t_end = jack_get_time ();
+
+	/* wake the disk thread up in case it is still waiting for data */
+	pthread_mutex_lock (&disk_thread_lock);
+	bounce.stop = 1;
+	pthread_cond_signal (&data_ready);
+	pthread_mutex_unlock (&disk_thread_lock);
+	pthread_join (disk_thread_id, NULL);
+
+	switch (bounce.status) {
+	case 0:
+		elapsed = (t_end - t_start) / 1000000.0;
+		printf ("rendered %" PRIu32 " frames in %.2f seconds (%.1fx realtime)\n",
+			frames, elapsed, elapsed > 0 ? frames / (double) sample_rate / elapsed : 0.0);
+		rc = 0;
+		break;
+	case ESPIPE:
+		fprintf (stderr, "transport was relocated during the render, output is incomplete\n");
+		break;
+	case EPIPE:
+		fprintf (stderr, "render failed with %ld overruns, try a bigger buffer than -B %" PRIu32 "\n",
+			 bounce.overruns, rb_size);
+		break;
+	case ENOSPC:
+		fprintf (stderr, "the JACK period outgrew -B %" PRIu32 ", output is incomplete\n", rb_size);
+		break;
+	default:
+		break;
+	}
+
+exit:
+	if (bounce.sf) {
+		sf_close (bounce.sf);
+	}
+	jack_client_close (bounce.client);
+	jack_ringbuffer_free (bounce.rb);
+	free (bounce.scratch);
+	free (bounce.ports);
+	return rc;
+}
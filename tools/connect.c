@@ -31,11 +31,248 @@
 #define TRUE 1
 #define FALSE 0
 
+#define BATCH_LINE_SIZE 1024
+#define BATCH_WAIT_USEC 1000000
+
 volatile int done = 0;
 
 void port_connect_callback(jack_port_id_t a, jack_port_id_t b, int connect, void* arg)
 {
-	done = 1;
+	done++;
+}
+
+typedef struct {
+	int connect;
+	int line;
+	jack_port_t *src;
+	jack_port_t *dst;
+} batch_op_t;
+
+static void
+resolve_port_name (jack_client_t *client, const char *arg, char *buf, size_t size, int use_uuid)
+{
+	char *tmpname;
+	char *clientname;
+	char *portname;
+
+	if (use_uuid) {
+		tmpname = strdup (arg);
+		portname = strchr (tmpname, ':');
+		if (portname) {
+			portname[0] = '\0';
+			portname += 1;
+			clientname = jack_get_client_name_by_uuid (client, tmpname);
+			if (clientname) {
+				snprintf (buf, size, "%s:%s", clientname, portname);
+				jack_free (clientname);
+				free (tmpname);
+				return;
+			}
+		}
+		free (tmpname);
+	}
+	snprintf (buf, size, "%s", arg);
+}
+
+/* Order two ports as source and destination, returns 0 on success */
+static int
+sort_ports (jack_port_t *port1, jack_port_t *port2, jack_port_t **src_port, jack_port_t **dst_port)
+{
+	int port1_flags = jack_port_flags (port1);
+	int port2_flags = jack_port_flags (port2);
+
+	*src_port = *dst_port = 0;
+	if (port1_flags & JackPortIsInput) {
+		if (port2_flags & JackPortIsOutput) {
+			*src_port = port2;
+			*dst_port = port1;
+		}
+	} else {
+		if (port2_flags & JackPortIsInput) {
+			*src_port = port1;
+			*dst_port = port2;
+		}
+	}
+	return (*src_port && *dst_port) ? 0 : -1;
+}
+
+/* Split the next whitespace separated, optionally double quoted, token
+   off *line. Returns NULL when the line is exhausted. */
+static char *
+next_token (char **line)
+{
+	char *p = *line;
+	char *token;
+
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+		p++;
+	}
+	if (*p == '\0' || *p == '#') {
+		*line = p;
+		return NULL;
+	}
+	if (*p == '"') {
+		token = ++p;
+		while (*p && *p != '"') {
+			p++;
+		}
+	} else {
+		token = p;
+		while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+			p++;
+		}
+	}
+	if (*p) {
+		*p++ = '\0';
+	}
+	*line = p;
+	return token;
+}
+
+/* Read connect/disconnect operations from file (or stdin if file is "-"),
+   resolve every port once, skip operations already reflected in the
+   current graph and apply the remaining ones within this client session.
+   Returns the number of failed operations. */
+static int
+apply_batch (jack_client_t *client, const char *file, int default_connect, int use_uuid, int verbose)
+{
+	FILE *fp;
+	char line[BATCH_LINE_SIZE];
+	char portA[300];
+	char portB[300];
+	batch_op_t *ops = NULL;
+	size_t nops = 0;
+	size_t maxops = 0;
+	int lineno = 0;
+	int failed = 0;
+	int skipped = 0;
+	int applied = 0;
+	int waited;
+	size_t i;
+
+	if (strcmp (file, "-") == 0) {
+		fp = stdin;
+	} else if ((fp = fopen (file, "r")) == NULL) {
+		fprintf (stderr, "cannot open %s: %s\n", file, strerror (errno));
+		return -1;
+	}
+
+	/* parse and resolve everything before touching the graph */
+
+	while (fgets (line, sizeof (line), fp)) {
+		char *p = line;
+		char *tok[3];
+		int ntok = 0;
+		int connect = default_connect;
+		jack_port_t *port1;
+		jack_port_t *port2;
+		char *t;
+
+		lineno++;
+		while (ntok < 3 && (t = next_token (&p)) != NULL) {
+			tok[ntok++] = t;
+		}
+		if (ntok == 0) {
+			continue;
+		}
+		if (ntok == 3) {
+			if (strcmp (tok[0], "connect") == 0) {
+				connect = TRUE;
+			} else if (strcmp (tok[0], "disconnect") == 0) {
+				connect = FALSE;
+			} else {
+				fprintf (stderr, "line %d: unknown operation '%s'\n", lineno, tok[0]);
+				failed++;
+				continue;
+			}
+			tok[0] = tok[1];
+			tok[1] = tok[2];
+		} else if (ntok != 2) {
+			fprintf (stderr, "line %d: expected two port names\n", lineno);
+			failed++;
+			continue;
+		}
+
+		resolve_port_name (client, tok[0], portA, sizeof (portA), use_uuid);
+		resolve_port_name (client, tok[1], portB, sizeof (portB), use_uuid);
+		if ((port1 = jack_port_by_name (client, portA)) == 0) {
+			fprintf (stderr, "line %d: %s not a valid port\n", lineno, portA);
+			failed++;
+			continue;
+		}
+		if ((port2 = jack_port_by_name (client, portB)) == 0) {
+			fprintf (stderr, "line %d: %s not a valid port\n", lineno, portB);
+			failed++;
+			continue;
+		}
+
+		if (nops == maxops) {
+			batch_op_t *tmp;
+			maxops = maxops ? maxops * 2 : 64;
+			if ((tmp = realloc (ops, maxops * sizeof (batch_op_t))) == NULL) {
+				fprintf (stderr, "out of memory\n");
+				failed++;
+				break;
+			}
+			ops = tmp;
+		}
+		if (sort_ports (port1, port2, &ops[nops].src, &ops[nops].dst)) {
+			fprintf (stderr, "line %d: arguments must include 1 input port and 1 output port\n", lineno);
+			failed++;
+			continue;
+		}
+		ops[nops].connect = connect;
+		ops[nops].line = lineno;
+		nops++;
+	}
+
+	if (fp != stdin) {
+		fclose (fp);
+	}
+
+	/* diff against the current graph and apply only the changes */
+
+	done = 0;
+	for (i = 0; i < nops; i++) {
+		const char *src_name = jack_port_name (ops[i].src);
+		const char *dst_name = jack_port_name (ops[i].dst);
+		int connected = jack_port_connected_to (ops[i].src, dst_name);
+
+		if (ops[i].connect == connected) {
+			skipped++;
+			continue;
+		}
+		if (ops[i].connect) {
+			if (jack_connect (client, src_name, dst_name)) {
+				fprintf (stderr, "line %d: cannot connect %s to %s\n", ops[i].line, src_name, dst_name);
+				failed++;
+				continue;
+			}
+		} else {
+			if (jack_disconnect (client, src_name, dst_name)) {
+				fprintf (stderr, "line %d: cannot disconnect %s from %s\n", ops[i].line, src_name, dst_name);
+				failed++;
+				continue;
+			}
+		}
+		applied++;
+	}
+
+	// Wait for the connections/disconnections to be effective
+	for (waited = 0; done < applied && waited < BATCH_WAIT_USEC; waited += 1000) {
+#ifdef WIN32
+		Sleep(1);
+#else
+		usleep(1000);
+#endif
+	}
+
+	if (verbose || failed) {
+		fprintf (stderr, "%d applied, %d unchanged, %d failed\n", applied, skipped, failed);
+	}
+
+	free (ops);
+	return failed;
 }
 
 void
@@ -49,8 +286,13 @@ show_usage (char *my_name)
 {
 	show_version (my_name);
 	fprintf (stderr, "\nusage: %s [options] port1 port2\n", my_name);
+	fprintf (stderr, "       %s [options] -f <file>\n", my_name);
 	fprintf (stderr, "Connects two JACK ports together.\n\n");
 	fprintf (stderr, "        -s, --server <name>   Connect to the jack server named <name>\n");
+	fprintf (stderr, "        -f, --file <file>     Apply all operations listed in <file> (- for stdin)\n");
+	fprintf (stderr, "                              Each line holds [connect|disconnect] port1 port2\n");
+	fprintf (stderr, "        -V, --verbose         Report a summary of the applied operations\n");
+	fprintf (stderr, "        -u, --uuid            Port names are given as <client uuid>:<port>\n");
 	fprintf (stderr, "        -v, --version         Output version information and exit\n");
 	fprintf (stderr, "        -h, --help            Display this help message\n\n");
 	fprintf (stderr, "For more information see http://jackaudio.org/\n");
@@ -72,9 +314,10 @@ main (int argc, char *argv[])
 	jack_port_t *port2 = 0;
 	char portA[300];
 	char portB[300];
+	char *batch_file = NULL;
 	int use_uuid=0;
+	int verbose = 0;
 	int connecting, disconnecting;
-	int port1_flags, port2_flags;
 	int rc = 1;
 
 	struct option long_options[] = {
@@ -82,10 +325,12 @@ main (int argc, char *argv[])
 		{ "help", 0, 0, 'h' },
 		{ "version", 0, 0, 'v' },
 		{ "uuid", 0, 0, 'u' },
+		{ "file", 1, 0, 'f' },
+		{ "verbose", 0, 0, 'V' },
 		{ 0, 0, 0, 0 }
 	};
 
-	while ((c = getopt_long (argc, argv, "s:hvu", long_options, &option_index)) >= 0) {
+	while ((c = getopt_long (argc, argv, "s:hvuf:V", long_options, &option_index)) >= 0) {
 		switch (c) {
 		case 's':
 			server_name = (char *) malloc (sizeof (char) * (strlen(optarg) + 1));
@@ -95,6 +340,12 @@ main (int argc, char *argv[])
 		case 'u':
 			use_uuid = 1;
 			break;
+		case 'f':
+			batch_file = optarg;
+			break;
+		case 'V':
+			verbose = 1;
+			break;
 		case 'h':
 			show_usage (my_name);
 			return 1;
@@ -126,7 +377,7 @@ main (int argc, char *argv[])
 		return 1;
 	}
 
-	if (argc < 3) {
+	if (argc < 3 && !batch_file) {
 		show_usage(my_name);
 		return 1;
 	}
@@ -140,44 +391,21 @@ main (int argc, char *argv[])
 
 	jack_set_port_connect_callback(client, port_connect_callback, NULL);
 
-	/* find the two ports */
-
-	if( use_uuid ) {
-		char *tmpname;
-		char *clientname;
-		char *portname;
-		tmpname = strdup( argv[argc-1] );
-		portname = strchr( tmpname, ':' );
-		portname[0] = '\0';
-		portname+=1;
-		clientname = jack_get_client_name_by_uuid( client, tmpname );
-		if( clientname ) {
-
-			snprintf( portA, sizeof(portA), "%s:%s", clientname, portname );
-			jack_free( clientname );
-		} else {
-			snprintf( portA, sizeof(portA), "%s", argv[argc-1] );
-		}
-		free( tmpname );
-
-		tmpname = strdup( argv[argc-2] );
-		portname = strchr( tmpname, ':' );
-		portname[0] = '\0';
-		portname+=1;
-		clientname = jack_get_client_name_by_uuid( client, tmpname );
-		if( clientname ) {
-			snprintf( portB, sizeof(portB), "%s:%s", clientname, portname );
-			jack_free( clientname );
-		} else {
-			snprintf( portB, sizeof(portB), "%s", argv[argc-2] );
+	if (batch_file) {
+		if (jack_activate (client)) {
+			fprintf (stderr, "cannot activate client");
+			goto exit;
+		}
+		if (apply_batch (client, batch_file, connecting, use_uuid, verbose) == 0) {
+			rc = 0;
 		}
+		goto exit;
+	}
 
-		free( tmpname );
+	/* find the two ports */
 
-	} else {
-		snprintf( portA, sizeof(portA), "%s", argv[argc-1] );
-		snprintf( portB, sizeof(portB), "%s", argv[argc-2] );
-	}
+	resolve_port_name (client, argv[argc-1], portA, sizeof (portA), use_uuid);
+	resolve_port_name (client, argv[argc-2], portB, sizeof (portB), use_uuid);
 	if ((port1 = jack_port_by_name(client, portA)) == 0) {
 		fprintf (stderr, "ERROR %s not a valid port\n", portA);
 		goto exit;
@@ -187,20 +415,7 @@ main (int argc, char *argv[])
 		goto exit;
 	}
 
-	port1_flags = jack_port_flags (port1);
-	port2_flags = jack_port_flags (port2);
-
-	if (port1_flags & JackPortIsInput) {
-		if (port2_flags & JackPortIsOutput) {
-			src_port = port2;
-			dst_port = port1;
-		}
-	} else {
-		if (port2_flags & JackPortIsInput) {
-			src_port = port1;
-			dst_port = port2;
-		}
-	}
+	sort_ports (port1, port2, &src_port, &dst_port);
 
 	if (!src_port || !dst_port) {
 		fprintf (stderr, "arguments must include 1 input port and 1 output port\n");
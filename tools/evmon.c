@@ -24,47 +24,165 @@
 #include <string.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include <jack/jack.h>
 #include <jack/metadata.h>
 #include <jack/uuid.h>
+#include <jack/ringbuffer.h>
+
+#define EVENT_STR_SIZE 256
+#define EVENT_QUEUE_SIZE 8192
+#define EVENT_BATCH_SIZE 256
+#define EVENT_IDLE_USECS 100000
+
+enum {
+	EV_PORT_REGISTER,
+	EV_PORT_RENAME,
+	EV_PORT_CONNECT,
+	EV_CLIENT_REGISTER,
+	EV_GRAPH_ORDER,
+	EV_PROPERTY,
+	EV_TYPE_COUNT
+};
+
+static const char* event_names[EV_TYPE_COUNT] = {
+	"port", "rename", "connect", "client", "graph", "property"
+};
+
+/* Fixed-size record pushed by the notification callbacks in stream mode,
+   all formatting is left to the writer. */
+typedef struct {
+	jack_time_t usecs;
+	uint32_t type;
+	uint32_t count;
+	jack_port_id_t a;
+	jack_port_id_t b;
+	int yn;
+	jack_uuid_t subject;
+	char str[2][EVENT_STR_SIZE];
+} event_t;
 
 jack_client_t *client;
 
+static jack_ringbuffer_t *rb = NULL;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t data_ready = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t keeprunning = 1;
+static volatile uint32_t dropped = 0;
+
 static void signal_handler(int sig)
 {
+	if (rb) {
+		/* the writer wakes up within EVENT_IDLE_USECS and sees this,
+		   the mutex and condition are not async-signal-safe */
+		keeprunning = 0;
+		return;
+	}
 	jack_client_close(client);
 	fprintf(stderr, "signal received, exiting ...\n");
 	exit(0);
 }
 
+static void
+copy_str (char *dst, const char *src)
+{
+	if (src) {
+		strncpy (dst, src, EVENT_STR_SIZE - 1);
+		dst[EVENT_STR_SIZE - 1] = '\0';
+	} else {
+		dst[0] = '\0';
+	}
+}
+
+static void
+queue_event (uint32_t type, jack_port_id_t a, jack_port_id_t b, int yn,
+	     jack_uuid_t subject, const char *str0, const char *str1)
+{
+	jack_ringbuffer_data_t vec[2];
+	event_t ev;
+	event_t *evp;
+
+	if (jack_ringbuffer_write_space (rb) < sizeof (event_t)) {
+		dropped++;
+		return;
+	}
+
+	/* build the record in place when it does not wrap around */
+	jack_ringbuffer_get_write_vector (rb, vec);
+	evp = (vec[0].len >= sizeof (event_t)) ? (event_t *) vec[0].buf : &ev;
+
+	evp->usecs = jack_get_time ();
+	evp->type = type;
+	evp->count = 1;
+	evp->a = a;
+	evp->b = b;
+	evp->yn = yn;
+	evp->subject = subject;
+	copy_str (evp->str[0], str0);
+	copy_str (evp->str[1], str1);
+
+	if (evp == &ev) {
+		jack_ringbuffer_write (rb, (const char *) &ev, sizeof (event_t));
+	} else {
+		jack_ringbuffer_write_advance (rb, sizeof (event_t));
+	}
+
+	if (pthread_mutex_trylock (&writer_lock) == 0) {
+		pthread_cond_signal (&data_ready);
+		pthread_mutex_unlock (&writer_lock);
+	}
+}
+
 static void
 port_rename_callback (jack_port_id_t port, const char* old_name, const char* new_name, void* arg)
 {
+	if (rb) {
+		queue_event (EV_PORT_RENAME, port, 0, 1, 0, old_name, new_name);
+		return;
+	}
 	printf ("Port %d renamed from %s to %s\n", port, old_name, new_name);
 }
 
 static void
 port_callback (jack_port_id_t port, int yn, void* arg)
 {
+	if (rb) {
+		queue_event (EV_PORT_REGISTER, port, 0, yn, 0, NULL, NULL);
+		return;
+	}
 	printf ("Port %d %s\n", port, (yn ? "registered" : "unregistered"));
 }
 
 static void
 connect_callback (jack_port_id_t a, jack_port_id_t b, int yn, void* arg)
 {
+	if (rb) {
+		queue_event (EV_PORT_CONNECT, a, b, yn, 0, NULL, NULL);
+		return;
+	}
 	printf ("Ports %d and %d %s\n", a, b, (yn ? "connected" : "disconnected"));
 }
 
 static void
 client_callback (const char* client, int yn, void* arg)
 {
+	if (rb) {
+		queue_event (EV_CLIENT_REGISTER, 0, 0, yn, 0, client, NULL);
+		return;
+	}
 	printf ("Client %s %s\n", client, (yn ? "registered" : "unregistered"));
 }
 
 static int
 graph_callback (void* arg)
 {
+	if (rb) {
+		queue_event (EV_GRAPH_ORDER, 0, 0, 1, 0, NULL, NULL);
+		return 0;
+	}
 	printf ("Graph reordered\n");
 	return 0;
 }
@@ -75,6 +193,12 @@ propchange (jack_uuid_t subject, const char* key, jack_property_change_t change,
 	char buf[JACK_UUID_STRING_SIZE];
 	const char* action = "";
 
+	if (rb) {
+		/* yn < 0 marks a change of all keys of the subject */
+		queue_event (EV_PROPERTY, 0, 0, key ? (int) change : -1 - (int) change, subject, key, NULL);
+		return;
+	}
+
 	switch (change) {
 	case PropertyCreated:
 		action = "created";
@@ -102,11 +226,259 @@ propchange (jack_uuid_t subject, const char* key, jack_property_change_t change,
 	}
 }
 
+static void
+print_json_str (const char *str)
+{
+	putchar ('"');
+	for (; *str; str++) {
+		unsigned char c = (unsigned char) *str;
+		if (c == '"' || c == '\\') {
+			printf ("\\%c", c);
+		} else if (c < 0x20) {
+			printf ("\\u%04x", c);
+		} else {
+			putchar (c);
+		}
+	}
+	putchar ('"');
+}
+
+static void
+print_event (const event_t *ev)
+{
+	static const char* changes[] = { "created", "changed", "deleted" };
+	char buf[JACK_UUID_STRING_SIZE];
+	int change;
+
+	printf ("{\"usecs\":%" PRIu64 ",\"type\":\"%s\"", (uint64_t) ev->usecs, event_names[ev->type]);
+
+	switch (ev->type) {
+	case EV_PORT_REGISTER:
+		printf (",\"port\":%u,\"registered\":%s", ev->a, ev->yn ? "true" : "false");
+		break;
+	case EV_PORT_RENAME:
+		printf (",\"port\":%u,\"old_name\":", ev->a);
+		print_json_str (ev->str[0]);
+		printf (",\"new_name\":");
+		print_json_str (ev->str[1]);
+		break;
+	case EV_PORT_CONNECT:
+		printf (",\"port_a\":%u,\"port_b\":%u,\"connected\":%s", ev->a, ev->b, ev->yn ? "true" : "false");
+		break;
+	case EV_CLIENT_REGISTER:
+		printf (",\"client\":");
+		print_json_str (ev->str[0]);
+		printf (",\"registered\":%s", ev->yn ? "true" : "false");
+		break;
+	case EV_PROPERTY:
+		change = ev->yn < 0 ? -1 - ev->yn : ev->yn;
+		if (jack_uuid_empty (ev->subject)) {
+			printf (",\"subject\":null");
+		} else {
+			jack_uuid_unparse (ev->subject, buf);
+			printf (",\"subject\":\"%s\"", buf);
+		}
+		if (ev->yn < 0) {
+			printf (",\"key\":null");
+		} else {
+			printf (",\"key\":");
+			print_json_str (ev->str[0]);
+		}
+		printf (",\"change\":\"%s\"", (change >= 0 && change <= 2) ? changes[change] : "unknown");
+		break;
+	default:
+		break;
+	}
+
+	if (ev->count > 1) {
+		printf (",\"count\":%u", ev->count);
+	}
+	printf ("}\n");
+}
+
+/* Merge ev into an equal pending record of the current batch, graph
+   order events and repeated changes of the same property collapse into
+   one line carrying the number of occurrences. */
+static int
+coalesce_event (event_t *batch, int n, const event_t *ev)
+{
+	int i;
+
+	if (ev->type != EV_GRAPH_ORDER && ev->type != EV_PROPERTY) {
+		return 0;
+	}
+	for (i = n - 1; i >= 0; i--) {
+		if (batch[i].type != ev->type) {
+			continue;
+		}
+		if (ev->type == EV_PROPERTY
+		    && (jack_uuid_compare (batch[i].subject, ev->subject) != 0
+			|| batch[i].yn != ev->yn
+			|| strcmp (batch[i].str[0], ev->str[0]) != 0)) {
+			continue;
+		}
+		batch[i].count += ev->count;
+		return 1;
+	}
+	return 0;
+}
+
+static void
+print_stats (const uint64_t *counts, uint64_t *last_counts, jack_time_t elapsed)
+{
+	int i;
+
+	printf ("{\"usecs\":%" PRIu64 ",\"type\":\"stats\",\"dropped\":%u", (uint64_t) jack_get_time (), dropped);
+	for (i = 0; i < EV_TYPE_COUNT; i++) {
+		printf (",\"%s\":{\"total\":%" PRIu64 ",\"rate\":%.1f}", event_names[i], counts[i],
+			elapsed ? (counts[i] - last_counts[i]) * 1e6 / elapsed : 0.0);
+		last_counts[i] = counts[i];
+	}
+	printf ("}\n");
+}
+
+static void
+add_usecs (struct timespec *ts, jack_time_t usecs)
+{
+	ts->tv_sec += usecs / 1000000;
+	ts->tv_nsec += (usecs % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Drain the event queue in batches and emit NDJSON until a signal
+   arrives. With a coalescing window, each batch collects all records
+   that arrive during that window. */
+static void
+run_writer (jack_time_t coalesce_usecs, jack_time_t stats_usecs)
+{
+	event_t *batch;
+	uint64_t counts[EV_TYPE_COUNT] = { 0 };
+	uint64_t last_counts[EV_TYPE_COUNT] = { 0 };
+	jack_time_t last_stats = jack_get_time ();
+	struct timespec ts;
+
+	batch = malloc (EVENT_BATCH_SIZE * sizeof (event_t));
+
+	pthread_mutex_lock (&writer_lock);
+	while (keeprunning || jack_ringbuffer_read_space (rb) >= sizeof (event_t)) {
+		jack_time_t window_end = jack_get_time () + coalesce_usecs;
+		int n = 0;
+		int i;
+
+		for (;;) {
+			while (n < EVENT_BATCH_SIZE && jack_ringbuffer_read_space (rb) >= sizeof (event_t)) {
+				jack_ringbuffer_read (rb, (char *) &batch[n], sizeof (event_t));
+				counts[batch[n].type]++;
+				if (!coalesce_usecs || !coalesce_event (batch, n, &batch[n])) {
+					n++;
+				}
+			}
+			if (n == EVENT_BATCH_SIZE || !coalesce_usecs || !keeprunning || jack_get_time () >= window_end) {
+				break;
+			}
+			clock_gettime (CLOCK_REALTIME, &ts);
+			add_usecs (&ts, window_end - jack_get_time ());
+			pthread_cond_timedwait (&data_ready, &writer_lock, &ts);
+		}
+
+		for (i = 0; i < n; i++) {
+			print_event (&batch[i]);
+		}
+
+		if (stats_usecs && jack_get_time () - last_stats >= stats_usecs) {
+			jack_time_t now = jack_get_time ();
+			print_stats (counts, last_counts, now - last_stats);
+			last_stats = now;
+		}
+		fflush (stdout);
+
+		if (keeprunning && jack_ringbuffer_read_space (rb) < sizeof (event_t)) {
+			clock_gettime (CLOCK_REALTIME, &ts);
+			add_usecs (&ts, EVENT_IDLE_USECS);
+			pthread_cond_timedwait (&data_ready, &writer_lock, &ts);
+		}
+	}
+	pthread_mutex_unlock (&writer_lock);
+
+	if (stats_usecs) {
+		print_stats (counts, last_counts, jack_get_time () - last_stats);
+		fflush (stdout);
+	}
+	free (batch);
+}
+
+static void
+show_usage (void)
+{
+	fprintf (stderr, "usage: jack_evmon [options]\n");
+	fprintf (stderr, "Prints JACK graph and property events.\n\n");
+	fprintf (stderr, "        -j, --json               Emit timestamped NDJSON records from a queue\n");
+	fprintf (stderr, "        -c, --coalesce <msecs>   Coalesce repeated graph/property events within a window\n");
+	fprintf (stderr, "        -r, --rates <secs>       Emit per-type event counters and rates periodically\n");
+	fprintf (stderr, "        -q, --queue <events>     Size of the event queue (default: %d)\n", EVENT_QUEUE_SIZE);
+	fprintf (stderr, "        -h, --help               Display this help message\n");
+}
+
 int
 main (int argc, char *argv[])
 {
 	jack_options_t options = JackNullOption;
 	jack_status_t status;
+	int json = 0;
+	int c;
+	int option_index;
+	size_t queue_size = EVENT_QUEUE_SIZE;
+	jack_time_t coalesce_usecs = 0;
+	jack_time_t stats_usecs = 0;
+
+	struct option long_options[] = {
+		{ "json", 0, 0, 'j' },
+		{ "coalesce", 1, 0, 'c' },
+		{ "rates", 1, 0, 'r' },
+		{ "queue", 1, 0, 'q' },
+		{ "help", 0, 0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	while ((c = getopt_long (argc, argv, "jc:r:q:h", long_options, &option_index)) >= 0) {
+		switch (c) {
+		case 'j':
+			json = 1;
+			break;
+		case 'c':
+			coalesce_usecs = (jack_time_t) (atof (optarg) * 1000);
+			break;
+		case 'r':
+			stats_usecs = (jack_time_t) (atof (optarg) * 1000000);
+			break;
+		case 'q':
+			queue_size = atoi (optarg);
+			break;
+		case 'h':
+			show_usage ();
+			return 0;
+		default:
+			show_usage ();
+			return 1;
+		}
+	}
+
+	if (!json && (coalesce_usecs || stats_usecs)) {
+		fprintf (stderr, "--coalesce and --rates require --json\n");
+		return 1;
+	}
+	if (json) {
+		if (queue_size < 16) {
+			queue_size = 16;
+		}
+		if ((rb = jack_ringbuffer_create (queue_size * sizeof (event_t))) == NULL) {
+			fprintf (stderr, "cannot allocate event queue\n");
+			return 1;
+		}
+	}
 
 	if ((client = jack_client_open ("event-monitor", options, &status, NULL)) == 0) {
 		fprintf (stderr, "jack_client_open() failed, "
@@ -154,6 +526,14 @@ main (int argc, char *argv[])
 	signal(SIGABRT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
+	if (rb) {
+		run_writer (coalesce_usecs, stats_usecs);
+		jack_deactivate (client);
+		jack_client_close (client);
+		jack_ringbuffer_free (rb);
+		exit (0);
+	}
+
 #ifdef WIN32
 	Sleep(INFINITE);
 #else
@@ -42,14 +42,25 @@ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <fcntl.h>
 #endif
 
 /* These two required by FreeBSD. */
 #include <sys/types.h>
 
 #include <jack/jack.h>
+#ifndef WIN32
+#include <pthread.h>
+#include <time.h>
+#include <jack/thread.h>
+#include <jack/ringbuffer.h>
+#endif
 
 #include <netjack_packet.h>
+#include <cycle_thread.h>
+#if HAVE_XDP
+#include <netjack_xdp.h>
+#endif
 #include <samplerate.h>
 
 #ifndef CUSTOM_MODES
@@ -83,6 +94,7 @@ int reply_port = 0;
 int bind_port = 0;
 int redundancy = 1;
 jack_client_t *client;
+cycle_thread process_thread;
 packet_cache * packcache = 0;
 
 int state_connected = 0;
@@ -113,6 +125,183 @@ int cont_miss = 0;
 
 int freewheeling = 0;
 
+/*
+ * Drift mode (-D): the slave runs off its own clock, so packets arrive
+ * at its rate rather than one per local cycle. Received packets are
+ * taken in framecnt order into per channel FIFOs and resampled to the
+ * local clock; outgoing audio is resampled to the remote clock and sent
+ * whenever a full net period has collected. The remote rate comes from
+ * a DLL on the packet arrival times, like the one zalsa runs on its
+ * ALSA periods, and a slow loop on the FIFO fill removes what is left.
+ */
+#define DRIFT_DLL_BANDWIDTH 0.005   // Hz, packet times are quantized to our cycles
+#define DRIFT_FILL_FILTER 0.1       // Hz
+#define DRIFT_FILL_GAIN 2e-4        // ratio correction per net period of fill error
+#define DRIFT_FILL_INTEGRAL 1e-8
+#define DRIFT_MAX_CORRECTION 2e-3
+#define DRIFT_MAX_RATIO 1.01
+
+int drift_mode = 0;
+jack_default_audio_sample_t **rx_fifo = NULL;
+jack_default_audio_sample_t **tx_fifo = NULL;
+int fifo_size = 0;
+int rx_fill = 0;
+int tx_fill = 0;
+int rx_started = 0;
+double rx_phase = 0.0;              // fractional frames, without capture channels
+double tx_phase = 0.0;              // fractional frames, without playback channels
+jack_nframes_t rx_framecnt = 0;
+int rx_framecnt_valid = 0;
+
+int dll_running = 0;
+jack_nframes_t dll_base;            // local frame the DLL times are relative to
+jack_nframes_t dll_framecnt;        // framecnt of the last packet seen by the DLL
+double dll_t1;                      // predicted arrival of the next packet
+double dll_dt;                      // filtered packet interval, in local frames
+double dll_b, dll_c;
+double fill_z1 = 0.0;
+double fill_z2 = 0.0;
+volatile double drift_ratio = 1.0;  // remote frames per local frame
+
+/*
+ * Adaptive Opus (-a): every packet carries a jacknet_net_report in
+ * front of its payload, and the channels are packed back to back
+ * instead of sitting in fixed slots, so the packet shrinks with the
+ * bitrate. The report from the other side steers the bitrate we send
+ * at between the -a minimum and the -P maximum: back off quickly on
+ * loss, creep back up after a few clean windows with packets queued.
+ */
+#define RATE_WINDOW 64              // packets per rate decision
+#define RATE_CLEAN_WINDOWS 4        // clean windows before going up
+#define RATE_LOSS_PERCENT 2
+
+jack_nframes_t adaptive_kbps = 0;   // minimum, 0 when not adaptive
+volatile jack_nframes_t tx_kbps = 0;
+int rate_framecnt = 0;
+jack_nframes_t rate_lost = 0;
+jack_nframes_t rate_late = 0;
+int rate_clean = 0;
+int rate_valid = 0;
+
+#ifndef WIN32
+/*
+ * Sharding (-S): the audio channels are split into groups, each sent
+ * as a netjack stream of its own on consecutive UDP ports. Every
+ * stream has its sockets, packet cache and worker threads, so the
+ * fragmenting, reassembly and system calls of a wide link spread over
+ * several cores, and over several NIC queues by RSS. The receive
+ * worker hands complete packets to the process thread, which puts them
+ * back in line by framecnt before rendering.
+ */
+#define NET_MAX_STREAMS 16
+#define STREAM_EXTRA_SLOTS 4        // packets received ahead of the latency
+#define STREAM_QUEUE_PACKETS 16
+#define STREAM_RX_THREAD 1
+#define STREAM_TX_THREAD 2
+
+typedef struct {
+    int valid;
+    jack_nframes_t framecnt;
+    jack_time_t recv_timestamp;
+    char *packet_buf;
+} stream_slot_t;
+
+typedef struct {
+    int index;
+    int outsockfd;
+    int insockfd;
+    struct sockaddr destaddr;
+    JSList *capture_ports;
+    JSList *capture_srcs;
+    JSList *playback_ports;
+    JSList *playback_srcs;
+    int capture_channels;
+    int playback_channels;
+    int rx_bufsize;
+    int tx_bufsize;
+
+    packet_cache *packcache;        // receive worker only
+    stream_slot_t *slots;           // process thread only, by framecnt
+    int nslots;
+
+    jack_ringbuffer_t *rx_ready;    // complete packets, prefixed by the receive time
+    jack_ringbuffer_t *tx_queue;    // packets to send, prefixed by their size
+    jack_native_thread_t rx_thread;
+    jack_native_thread_t tx_thread;
+    int threads;                    // STREAM_RX_THREAD | STREAM_TX_THREAD
+    pthread_mutex_t tx_lock;
+    pthread_cond_t tx_ready;
+    volatile jack_nframes_t want_framecnt;  // oldest packet still of use
+    volatile int reset_master;
+    volatile int rx_dropped;
+    volatile int tx_dropped;
+    int missed;
+    netjack_pacer pacer;
+} net_stream_t;
+
+net_stream_t *streams = NULL;
+volatile int streams_running = 0;
+#endif
+int num_streams = 1;
+
+/*
+ * Pacing (-T): spread the fragments of every packet over a part of the
+ * period instead of sending them in one burst. The kernel times them
+ * with -t, otherwise the sending thread sleeps between fragments.
+ */
+#define PACE_MAX_PERCENT 90
+
+int pace_percent = 0;
+int pace_txtime = 0;
+netjack_pacer pacer;
+
+#if HAVE_XDP
+/*
+ * AF_XDP (-X): exchange the fragments through UMEM rings on one queue
+ * of the interface instead of the UDP stack. The sockets stay open, as
+ * the traffic falls back to them whenever AF_XDP is not usable.
+ */
+char *xdp_ifname = NULL;
+int xdp_queue = 0;
+netjack_xdp *xdp = NULL;
+#endif
+
+/* set from the command line or load_init */
+char *client_name = NULL;
+char *server_name = NULL;
+char *peer_ip = NULL;
+int peer_port = 3000;
+jack_options_t options = JackNullOption;
+
+#ifdef NETSOURCE_INTERNAL
+/*
+ * Loaded into the server, the process thread must not block on the
+ * network. The sockets are served by two helper threads instead:
+ * the receive thread queues every datagram it reads, prefixed by a
+ * net_datagram_t, and the send thread sends the packets the process
+ * thread queues, prefixed by their size. Where the process thread waits
+ * for a packet, it polls rx_wake, which the receive thread writes a
+ * byte to after queuing datagrams.
+ */
+#define NET_QUEUE_PACKETS 64
+
+typedef struct {
+    int size;
+    struct sockaddr_in sender;
+} net_datagram_t;
+
+jack_ringbuffer_t *rx_queue;
+jack_ringbuffer_t *tx_queue;
+jack_native_thread_t rx_thread;
+jack_native_thread_t tx_thread;
+pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tx_ready = PTHREAD_COND_INITIALIZER;
+int rx_wake[2] = { -1, -1 };
+volatile int io_running = 0;
+volatile int rx_dropped = 0;
+volatile int tx_dropped = 0;
+#endif
+
 /**
  * This Function allocates all the I/O Ports which are added the lists.
  */
@@ -239,15 +428,940 @@ freewheel_cb (int starting, void *arg)
 }
 
 int deadline_goodness = 0;
+
+#ifdef NETSOURCE_INTERNAL
+
+static void
+net_send (char *packet_buf, int pkt_size)
+{
+    if (jack_ringbuffer_write_space (tx_queue) < sizeof (int) + pkt_size) {
+        tx_dropped++;
+        return;
+    }
+    jack_ringbuffer_write (tx_queue, (char *) &pkt_size, sizeof (int));
+    jack_ringbuffer_write (tx_queue, packet_buf, pkt_size);
+
+    /* same as jack_rec: if the send thread is busy, it will see the
+     * packet before waiting again */
+    if (pthread_mutex_trylock (&tx_lock) == 0) {
+        pthread_cond_signal (&tx_ready);
+        pthread_mutex_unlock (&tx_lock);
+    }
+}
+
 /**
- * The process callback for this JACK application.
- * It is called by JACK at the appropriate times.
+ * Move the datagrams queued by the receive thread into the cache.
+ */
+static void
+net_drain (int input_fd)
+{
+    char *rx_packet = alloca (mtu);
+    net_datagram_t dgram;
+
+    /* a datagram only counts once it has been queued completely */
+    while (jack_ringbuffer_peek (rx_queue, (char *) &dgram, sizeof (dgram)) == sizeof (dgram)
+            && jack_ringbuffer_read_space (rx_queue) >= sizeof (dgram) + dgram.size) {
+        jack_ringbuffer_read_advance (rx_queue, sizeof (dgram));
+        jack_ringbuffer_read (rx_queue, rx_packet, dgram.size);
+        packet_cache_add_datagram (packcache, rx_packet, dgram.size, &dgram.sender);
+    }
+}
+
+static int
+net_wait (int input_fd, jack_time_t deadline)
+{
+    char wake[16];
+
+    /* the byte is written after the datagrams, so a wakeup that was
+     * already consumed at most costs another look at the queue */
+    while (jack_ringbuffer_read_space (rx_queue) < sizeof (net_datagram_t)) {
+        if (! netjack_poll_deadline (rx_wake[0], deadline))
+            return 0;
+        while (read (rx_wake[0], wake, sizeof (wake)) > 0)
+            ;
+    }
+    return 1;
+}
+
+static void *
+rx_thread_func (void *arg)
+{
+    int input_fd = reply_port ? insockfd : outsockfd;
+    char *rx_packet = malloc (mtu);
+    net_datagram_t dgram;
+    socklen_t senderlen;
+    int queued;
+
+    while (io_running) {
+        if (! netjack_poll_deadline (input_fd, jack_get_time () + 100000))
+            continue;
+
+        queued = 0;
+        while (1) {
+            senderlen = sizeof (dgram.sender);
+            dgram.size = recvfrom (input_fd, rx_packet, mtu, MSG_DONTWAIT,
+                                   (struct sockaddr *) &dgram.sender, &senderlen);
+            if (dgram.size < 0)
+                break;
+            if (jack_ringbuffer_write_space (rx_queue) < sizeof (dgram) + dgram.size) {
+                rx_dropped++;
+                continue;
+            }
+            jack_ringbuffer_write (rx_queue, (char *) &dgram, sizeof (dgram));
+            jack_ringbuffer_write (rx_queue, rx_packet, dgram.size);
+            queued = 1;
+        }
+        /* a full pipe already has a wakeup pending */
+        if (queued && write (rx_wake[1], "", 1) < 0 && errno != EAGAIN)
+            fprintf (stderr, "netsource: cannot wake the process thread: %s\n", strerror (errno));
+    }
+
+    free (rx_packet);
+    return NULL;
+}
+
+static int
+tx_queue_ready (void)
+{
+    int pkt_size;
+
+    return jack_ringbuffer_peek (tx_queue, (char *) &pkt_size, sizeof (int)) == sizeof (int)
+           && jack_ringbuffer_read_space (tx_queue) >= sizeof (int) + pkt_size;
+}
+
+static void *
+tx_thread_func (void *arg)
+{
+    char *packet_buf = NULL;
+    int buf_size = 0;
+    int pkt_size;
+    struct timespec timeout;
+
+    while (io_running) {
+        /* the lock is not held while sending, so the process thread
+         * can signal every packet it queues */
+        while (tx_queue_ready ()) {
+            jack_ringbuffer_read (tx_queue, (char *) &pkt_size, sizeof (int));
+            if (pkt_size > buf_size) {
+                free (packet_buf);
+                packet_buf = malloc (pkt_size);
+                buf_size = pkt_size;
+            }
+            jack_ringbuffer_read (tx_queue, packet_buf, pkt_size);
+            netjack_sendto_paced (pace_percent ? &pacer : NULL, outsockfd, packet_buf, pkt_size, 0,
+                                  (struct sockaddr *) &destaddr, sizeof (destaddr), mtu);
+        }
+
+        /* the timeout covers a signal sent between the check and
+         * the wait */
+        clock_gettime (CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 1000000;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock (&tx_lock);
+        if (io_running && !tx_queue_ready ())
+            pthread_cond_timedwait (&tx_ready, &tx_lock, &timeout);
+        pthread_mutex_unlock (&tx_lock);
+    }
+
+    free (packet_buf);
+    return NULL;
+}
+
+static void
+close_rx_wake (void)
+{
+    close (rx_wake[0]);
+    close (rx_wake[1]);
+    rx_wake[0] = rx_wake[1] = -1;
+}
+
+static int
+start_io_threads (int tx_bufsize, int rx_bufsize)
+{
+    int priority = jack_client_real_time_priority (client);
+    int realtime = jack_is_realtime (client);
+
+    tx_queue = jack_ringbuffer_create (NET_QUEUE_PACKETS * (sizeof (int) + tx_bufsize) * redundancy);
+    rx_queue = jack_ringbuffer_create (NET_QUEUE_PACKETS * (sizeof (net_datagram_t) + mtu) * (rx_bufsize / mtu + 1));
+    if (tx_queue == NULL || rx_queue == NULL)
+        return 1;
+    jack_ringbuffer_mlock (tx_queue);
+    jack_ringbuffer_mlock (rx_queue);
+
+    if (pipe (rx_wake))
+        return 1;
+    fcntl (rx_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl (rx_wake[1], F_SETFL, O_NONBLOCK);
+
+    io_running = 1;
+    if (jack_client_create_thread (client, &rx_thread, priority, realtime, rx_thread_func, NULL)) {
+        io_running = 0;
+        close_rx_wake ();
+        return 1;
+    }
+    if (jack_client_create_thread (client, &tx_thread, priority, realtime, tx_thread_func, NULL)) {
+        io_running = 0;
+        pthread_join (rx_thread, NULL);
+        close_rx_wake ();
+        return 1;
+    }
+    return 0;
+}
+
+static void
+stop_io_threads (void)
+{
+    if (!io_running)
+        return;
+
+    io_running = 0;
+    pthread_mutex_lock (&tx_lock);
+    pthread_cond_signal (&tx_ready);
+    pthread_mutex_unlock (&tx_lock);
+    pthread_join (tx_thread, NULL);
+    pthread_join (rx_thread, NULL);
+    close_rx_wake ();
+
+    if (rx_dropped || tx_dropped)
+        fprintf (stderr, "netsource: %d received and %d outgoing datagrams dropped on full queues\n",
+                 rx_dropped, tx_dropped);
+}
+
+#else
+
+static void
+net_send (char *packet_buf, int pkt_size)
+{
+#if HAVE_XDP
+    if (xdp) {
+        netjack_xdp_sendto (xdp, packet_buf, pkt_size, mtu);
+        return;
+    }
+#endif
+    netjack_sendto_paced (pace_percent ? &pacer : NULL, outsockfd, packet_buf, pkt_size, 0,
+                          &destaddr, sizeof (destaddr), mtu);
+}
+
+static void
+net_drain (int input_fd)
+{
+#if HAVE_XDP
+    /* datagrams arriving on other queues still take the socket */
+    if (xdp)
+        netjack_xdp_drain (xdp, packcache);
+#endif
+    packet_cache_drain_socket (packcache, input_fd);
+}
+
+static int
+net_wait (int input_fd, jack_time_t deadline)
+{
+#if HAVE_XDP
+    if (xdp)
+        return netjack_xdp_poll_deadline (xdp, input_fd, deadline);
+#endif
+    return netjack_poll_deadline (input_fd, deadline);
+}
+
+#endif
+
+static jack_nframes_t
+opus_bytes (jack_nframes_t kbits)
+{
+    return (kbits * jack_get_buffer_size(client) * 1024 / jack_get_sample_rate(client) / 8) & (~1) ;
+}
+
+static jack_nframes_t
+get_net_period (jack_nframes_t nframes)
+{
+    if( bitdepth == 999)
+        return opus_bytes (kbps);
+    else
+        return (float) nframes;
+}
+
+static void
+fill_packet_header (jacknet_packet_header *pkthdr_tx, jack_nframes_t nframes,
+                    int n_playback_audio, int n_capture_audio)
+{
+    jack_position_t local_trans_pos;
+
+    pkthdr_tx->transport_state = jack_transport_query (client, &local_trans_pos);
+    pkthdr_tx->transport_frame = local_trans_pos.frame;
+    pkthdr_tx->framecnt = framecnt;
+    pkthdr_tx->latency = latency;
+    pkthdr_tx->reply_port = reply_port;
+    pkthdr_tx->sample_rate = jack_get_sample_rate (client);
+    pkthdr_tx->period_size = nframes;
+
+    /* playback for us is capture on the other side */
+    pkthdr_tx->capture_channels_audio = n_playback_audio;
+    pkthdr_tx->playback_channels_audio = n_capture_audio;
+    pkthdr_tx->capture_channels_midi = playback_channels_midi;
+    pkthdr_tx->playback_channels_midi = capture_channels_midi;
+    pkthdr_tx->mtu = mtu;
+    if( freewheeling != 0 )
+        pkthdr_tx->sync_state = (jack_nframes_t)MASTER_FREEWHEELS;
+    else
+        pkthdr_tx->sync_state = (jack_nframes_t)deadline_goodness;
+    //printf("goodness=%d\n", deadline_goodness );
+
+    packet_header_hton (pkthdr_tx);
+}
+
+/**
+ * Send a finished packet, unless the slave has stopped answering.
+ */
+static void
+queue_packet (char *packet_buf, int pkt_size)
+{
+    if (cont_miss < 3 * latency + 5) {
+        int r;
+        for( r = 0; r < redundancy; r++ )
+            net_send (packet_buf, pkt_size);
+    } else if (cont_miss > 50 + 5 * latency) {
+        state_connected = 0;
+        packet_cache_reset_master_address( packcache );
+        //printf ("Frame %d  \tRealy too many packets missed (%d). Let's reset the counter\n", framecnt, cont_miss);
+        cont_miss = 0;
+    }
+}
+
+#if HAVE_OPUS
+/**
+ * Adaptive mode: our report, then the channels encoded at tx_kbps. The
+ * encoder fills the bytes it is given, so the slot size sets the rate.
+ */
+static void
+send_adaptive_packet (jack_nframes_t nframes)
+{
+    int max_size = sizeof (jacknet_packet_header) + sizeof (jacknet_net_report)
+                   + playback_channels * opus_bytes (kbps) + 1;
+    char *packet_buf_tx = alloca (max_size);
+    jacknet_packet_header *pkthdr_tx = (jacknet_packet_header *) packet_buf_tx;
+    jacknet_net_report *report = (jacknet_net_report *) (pkthdr_tx + 1);
+    int size;
+
+    size = render_jack_ports_to_payload_opus_packed (playback_ports, playback_srcs, nframes,
+                                                     report + 1, opus_bytes (tx_kbps));
+    size = netjack_variable_packet_size (size + sizeof (jacknet_packet_header) + sizeof (jacknet_net_report), mtu);
+
+    report->lost = state_netxruns;
+    report->late = packcache->late_packets;
+    report->queue_depth = packet_cache_get_queue_depth (packcache, framecnt - latency);
+    report->kbps = tx_kbps;
+    net_report_hton (report);
+
+    fill_packet_header (pkthdr_tx, nframes, playback_channels_audio, capture_channels_audio);
+    queue_packet (packet_buf_tx, size);
+}
+
+/**
+ * Adjust tx_kbps from the report of the other side, once per window of
+ * packets sent: a quarter down when more than RATE_LOSS_PERCENT of the
+ * window was lost, a sixteenth up after RATE_CLEAN_WINDOWS windows
+ * without loss or late packets and with packets waiting in its cache.
+ */
+static void
+rate_control (jacknet_net_report *report)
+{
+    jack_nframes_t lost, late;
+
+    if (!rate_valid) {
+        rate_framecnt = framecnt;
+        rate_lost = report->lost;
+        rate_late = report->late;
+        rate_clean = 0;
+        rate_valid = 1;
+        return;
+    }
+    if (framecnt - rate_framecnt < RATE_WINDOW)
+        return;
+
+    lost = report->lost - rate_lost;
+    late = report->late - rate_late;
+    rate_framecnt = framecnt;
+    rate_lost = report->lost;
+    rate_late = report->late;
+
+    if (lost * 100 > RATE_LOSS_PERCENT * RATE_WINDOW) {
+        jack_nframes_t down = tx_kbps * 3 / 4;
+        tx_kbps = down < adaptive_kbps ? adaptive_kbps : down;
+        rate_clean = 0;
+    } else if (lost == 0 && late == 0 && report->queue_depth > 0) {
+        if (++rate_clean >= RATE_CLEAN_WINDOWS) {
+            jack_nframes_t up = tx_kbps + tx_kbps / 16 + 1;
+            tx_kbps = up > kbps ? kbps : up;
+            rate_clean = 0;
+        }
+    } else {
+        rate_clean = 0;
+    }
+}
+#endif
+
+/**
+ * Render the playback ports into a packet and send it to the slave.
+ */
+static void
+send_packet (jack_nframes_t nframes)
+{
+    jack_nframes_t net_period = get_net_period (nframes);
+    int tx_bufsize = get_sample_size (bitdepth) * playback_channels * net_period + sizeof (jacknet_packet_header);
+    uint32_t *packet_buf_tx, *packet_bufX;
+
+#if HAVE_OPUS
+    if (adaptive_kbps) {
+        send_adaptive_packet (nframes);
+        return;
+    }
+#endif
+    packet_buf_tx = alloca (tx_bufsize);
+
+    jacknet_packet_header *pkthdr_tx = (jacknet_packet_header *) packet_buf_tx;
+
+    /* reset packet_bufX... */
+    packet_bufX = packet_buf_tx + sizeof (jacknet_packet_header) / sizeof (jack_default_audio_sample_t);
+
+    /* ---------- Send ---------- */
+    render_jack_ports_to_payload (bitdepth, playback_ports, playback_srcs, nframes,
+                                  packet_bufX, net_period, dont_htonl_floats);
+
+    fill_packet_header (pkthdr_tx, nframes, playback_channels_audio, capture_channels_audio);
+    queue_packet ((char *) packet_buf_tx, tx_bufsize);
+}
+
+#ifndef WIN32
+/**
+ * Queue a packet for the send worker of a stream, like net_send does
+ * for the helper threads of the internal client.
+ */
+static void
+stream_send (net_stream_t *stream, char *packet_buf, int pkt_size)
+{
+    if (jack_ringbuffer_write_space (stream->tx_queue) < sizeof (int) + pkt_size) {
+        stream->tx_dropped++;
+        return;
+    }
+    jack_ringbuffer_write (stream->tx_queue, (char *) &pkt_size, sizeof (int));
+    jack_ringbuffer_write (stream->tx_queue, packet_buf, pkt_size);
+
+    if (pthread_mutex_trylock (&stream->tx_lock) == 0) {
+        pthread_cond_signal (&stream->tx_ready);
+        pthread_mutex_unlock (&stream->tx_lock);
+    }
+}
+
+static int
+stream_tx_queue_ready (net_stream_t *stream)
+{
+    int pkt_size;
+
+    return jack_ringbuffer_peek (stream->tx_queue, (char *) &pkt_size, sizeof (int)) == sizeof (int)
+           && jack_ringbuffer_read_space (stream->tx_queue) >= sizeof (int) + pkt_size;
+}
+
+static void *
+stream_tx_func (void *arg)
+{
+    net_stream_t *stream = (net_stream_t *) arg;
+    char *packet_buf = malloc (stream->tx_bufsize);
+    int pkt_size;
+    struct timespec timeout;
+
+    while (streams_running) {
+        while (stream_tx_queue_ready (stream)) {
+            jack_ringbuffer_read (stream->tx_queue, (char *) &pkt_size, sizeof (int));
+            jack_ringbuffer_read (stream->tx_queue, packet_buf, pkt_size);
+            netjack_sendto_paced (pace_percent ? &stream->pacer : NULL, stream->outsockfd, packet_buf, pkt_size, 0,
+                                  &stream->destaddr, sizeof (stream->destaddr), mtu);
+        }
+
+        clock_gettime (CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 1000000;
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock (&stream->tx_lock);
+        if (streams_running && !stream_tx_queue_ready (stream))
+            pthread_cond_timedwait (&stream->tx_ready, &stream->tx_lock, &timeout);
+        pthread_mutex_unlock (&stream->tx_lock);
+    }
+
+    free (packet_buf);
+    return NULL;
+}
+
+/**
+ * The receive worker of a stream reassembles the packets in its own
+ * cache and queues each one as soon as it is complete, in whatever
+ * order that happens. Packets older than the process thread still
+ * wants are dropped from the cache.
+ */
+static void *
+stream_rx_func (void *arg)
+{
+    net_stream_t *stream = (net_stream_t *) arg;
+    int input_fd = reply_port ? stream->insockfd : stream->outsockfd;
+    jack_nframes_t framecnt_ready;
+    jack_time_t timestamp;
+    char *packet_buf;
+
+    while (streams_running) {
+        if (stream->reset_master) {
+            packet_cache_reset_master_address (stream->packcache);
+            stream->reset_master = 0;
+        }
+        if (! netjack_poll_deadline (input_fd, jack_get_time () + 100000))
+            continue;
+
+        packet_cache_drain_socket (stream->packcache, input_fd);
+        packet_cache_clear_old_packets (stream->packcache, stream->want_framecnt);
+
+        while (packet_cache_get_next_available_framecnt (stream->packcache, stream->want_framecnt, &framecnt_ready)) {
+            packet_cache_retreive_packet_pointer (stream->packcache, framecnt_ready, &packet_buf,
+                                                  stream->rx_bufsize, &timestamp);
+            if (jack_ringbuffer_write_space (stream->rx_ready) < sizeof (timestamp) + stream->rx_bufsize) {
+                stream->rx_dropped++;
+            } else {
+                jack_ringbuffer_write (stream->rx_ready, (char *) &timestamp, sizeof (timestamp));
+                jack_ringbuffer_write (stream->rx_ready, packet_buf, stream->rx_bufsize);
+            }
+            packet_cache_drop_packet (stream->packcache, framecnt_ready);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sort the packets the receive worker queued into the slots, where
+ * the one for framecnt want is looked up. Packets too old or too far
+ * ahead to fit are dropped.
+ */
+static void
+stream_collect (net_stream_t *stream, jack_nframes_t want)
+{
+    int record_size = sizeof (jack_time_t) + stream->rx_bufsize;
+    char peek[sizeof (jack_time_t) + sizeof (jacknet_packet_header)];
+    jacknet_packet_header *pkthdr = (jacknet_packet_header *) (peek + sizeof (jack_time_t));
+
+    while (jack_ringbuffer_read_space (stream->rx_ready) >= record_size) {
+        jack_nframes_t pkt_framecnt;
+        stream_slot_t *slot;
+
+        jack_ringbuffer_peek (stream->rx_ready, peek, sizeof (peek));
+        pkt_framecnt = ntohl (pkthdr->framecnt);
+        if (pkt_framecnt - want >= (jack_nframes_t) stream->nslots) {
+            jack_ringbuffer_read_advance (stream->rx_ready, record_size);
+            continue;
+        }
+
+        slot = &stream->slots[pkt_framecnt % stream->nslots];
+        jack_ringbuffer_read (stream->rx_ready, (char *) &slot->recv_timestamp, sizeof (jack_time_t));
+        jack_ringbuffer_read (stream->rx_ready, slot->packet_buf, stream->rx_bufsize);
+        slot->framecnt = pkt_framecnt;
+        slot->valid = 1;
+    }
+}
+
+/**
+ * The critical part of the cycle with sharding: render the packet for
+ * framecnt - latency of every stream, and silence the channels of the
+ * streams it has not arrived for. Transport sync and the deadline
+ * follow the first stream. Freewheeling, wait up to a period for the
+ * packets like the single stream does.
+ */
+static void
+receive_streams (jack_nframes_t nframes)
+{
+    jack_nframes_t want = framecnt - latency;
+    jack_nframes_t net_period = get_net_period (nframes);
+    jack_time_t deadline = jack_get_time () + 1000000 * nframes / jack_get_sample_rate (client);
+    struct timespec pause = { 0, 50000 };
+    int missing = 0;
+    int s;
+
+    for (s = 0; s < num_streams; s++) {
+        net_stream_t *stream = &streams[s];
+        stream_slot_t *slot = &stream->slots[want % stream->nslots];
+        jacknet_packet_header *pkthdr_rx;
+        JSList *node;
+
+        stream_collect (stream, want);
+        while (freewheeling && (!slot->valid || slot->framecnt != want) && jack_get_time () < deadline) {
+            nanosleep (&pause, NULL);
+            stream_collect (stream, want);
+        }
+
+        if (!slot->valid || slot->framecnt != want) {
+            for (node = stream->capture_ports; node != NULL; node = jack_slist_next (node))
+                memset (jack_port_get_buffer ((jack_port_t *) node->data, nframes), 0,
+                        nframes * sizeof (jack_default_audio_sample_t));
+            stream->missed++;
+            missing++;
+            continue;
+        }
+
+        pkthdr_rx = (jacknet_packet_header *) slot->packet_buf;
+        packet_header_ntoh (pkthdr_rx);
+        render_payload_to_jack_ports (bitdepth, pkthdr_rx + 1, net_period,
+                                      stream->capture_ports, stream->capture_srcs, nframes, dont_htonl_floats);
+        if (s == 0) {
+            int recv_time_offset = (int) (jack_get_time () - slot->recv_timestamp);
+            deadline_goodness = recv_time_offset - (int) pkthdr_rx->latency;
+            state_recv_packet_queue_time = recv_time_offset;
+            sync_state = pkthdr_rx->sync_state;
+        }
+        slot->valid = 0;
+    }
+
+    /* until framecnt reaches the latency, want is still negative */
+    if (framecnt >= latency)
+        for (s = 0; s < num_streams; s++)
+            streams[s].want_framecnt = want + 1;
+
+    state_currentframe = framecnt;
+    if (missing) {
+        state_netxruns += 1;
+        cont_miss += 1;
+    } else {
+        cont_miss = 0;
+        state_connected = 1;
+    }
+}
+
+/**
+ * The deferred part of the cycle with sharding: one packet per
+ * stream, carrying its group of the playback channels.
+ */
+static void
+send_stream_packets (jack_nframes_t nframes)
+{
+    jack_nframes_t net_period = get_net_period (nframes);
+    int s;
+
+    if (cont_miss > 50 + 5 * latency) {
+        state_connected = 0;
+        for (s = 0; s < num_streams; s++)
+            streams[s].reset_master = 1;
+        cont_miss = 0;
+        return;
+    }
+    if (cont_miss >= 3 * latency + 5)
+        return;
+
+    for (s = 0; s < num_streams; s++) {
+        net_stream_t *stream = &streams[s];
+        char *packet_buf_tx = alloca (stream->tx_bufsize);
+        jacknet_packet_header *pkthdr_tx = (jacknet_packet_header *) packet_buf_tx;
+        int r;
+
+        render_jack_ports_to_payload (bitdepth, stream->playback_ports, stream->playback_srcs, nframes,
+                                      pkthdr_tx + 1, net_period, dont_htonl_floats);
+        fill_packet_header (pkthdr_tx, nframes, stream->playback_channels, stream->capture_channels);
+        for (r = 0; r < redundancy; r++)
+            stream_send (stream, packet_buf_tx, stream->tx_bufsize);
+    }
+}
+#endif
+
+/**
+ * Feed the arrival of packet pkt_framecnt to the DLL, which tracks the
+ * interval between packets in local frames. Missing packets just
+ * stretch the prediction.
+ */
+static void
+dll_update (jack_nframes_t pkt_framecnt, jack_time_t timestamp, jack_nframes_t net_period)
+{
+    jack_nframes_t arrival = jack_time_to_frames (client, timestamp);
+    int missed = (int) (pkt_framecnt - dll_framecnt) - 1;
+    double omega, err;
+
+    if (!dll_running || missed < 0 || missed > latency + 50) {
+        omega = 2.0 * M_PI * DRIFT_DLL_BANDWIDTH * net_period / jack_get_sample_rate (client);
+        dll_b = sqrt (2.0) * omega;
+        dll_c = omega * omega;
+        dll_base = arrival;
+        dll_dt = net_period / drift_ratio;
+        dll_t1 = dll_dt;
+        dll_framecnt = pkt_framecnt;
+        dll_running = 1;
+        return;
+    }
+
+    dll_t1 += missed * dll_dt;
+    err = (double) (int32_t) (arrival - dll_base) - dll_t1;
+    dll_t1 += dll_b * err + dll_dt;
+    dll_dt += dll_c * err;
+    dll_framecnt = pkt_framecnt;
+
+    /* keep the times small */
+    dll_base += (jack_nframes_t) floor (dll_t1);
+    dll_t1 -= floor (dll_t1);
+
+    if (dll_dt > net_period * DRIFT_MAX_RATIO)
+        dll_dt = net_period * DRIFT_MAX_RATIO;
+    else if (dll_dt < net_period / DRIFT_MAX_RATIO)
+        dll_dt = net_period / DRIFT_MAX_RATIO;
+    drift_ratio = net_period / dll_dt;
+}
+
+static int
+drift_alloc (jack_nframes_t nframes)
+{
+    jack_nframes_t net_period = get_net_period (nframes);
+    int chn;
+
+    fifo_size = (latency + 8) * net_period + 4 * nframes;
+    rx_fifo = calloc (capture_channels_audio, sizeof (jack_default_audio_sample_t *));
+    tx_fifo = calloc (playback_channels_audio, sizeof (jack_default_audio_sample_t *));
+    if (rx_fifo == NULL || tx_fifo == NULL)
+        return 1;
+    for (chn = 0; chn < capture_channels_audio; chn++)
+        if ((rx_fifo[chn] = calloc (fifo_size, sizeof (jack_default_audio_sample_t))) == NULL)
+            return 1;
+    for (chn = 0; chn < playback_channels_audio; chn++)
+        if ((tx_fifo[chn] = calloc (fifo_size, sizeof (jack_default_audio_sample_t))) == NULL)
+            return 1;
+    return 0;
+}
+
+/**
+ * Append one net period per channel from a received payload, or
+ * silence for a lost packet.
+ */
+static void
+drift_fifo_append (uint32_t *payload, jack_nframes_t net_period)
+{
+    int_float_t val;
+    int chn, i;
+
+    for (chn = 0; chn < capture_channels_audio; chn++) {
+        jack_default_audio_sample_t *dst = rx_fifo[chn] + rx_fill;
+
+        if (payload == NULL) {
+            memset (dst, 0, net_period * sizeof (jack_default_audio_sample_t));
+        } else if (dont_htonl_floats) {
+            memcpy (dst, payload + chn * net_period, net_period * sizeof (jack_default_audio_sample_t));
+        } else {
+            for (i = 0; i < net_period; i++) {
+                val.i = ntohl (payload[chn * net_period + i]);
+                dst[i] = val.f;
+            }
+        }
+    }
+    rx_fill += net_period;
+}
+
+/**
+ * Resample the playback ports to the remote clock and send every full
+ * net period that has collected.
+ */
+static void
+send_drift_packets (jack_nframes_t nframes)
+{
+    jack_nframes_t net_period = get_net_period (nframes);
+    int tx_bufsize = get_sample_size (bitdepth) * playback_channels * net_period + sizeof (jacknet_packet_header);
+    uint32_t *packet_buf_tx = alloca (tx_bufsize);
+    jacknet_packet_header *pkthdr_tx = (jacknet_packet_header *) packet_buf_tx;
+    uint32_t *payload = packet_buf_tx + sizeof (jacknet_packet_header) / sizeof (uint32_t);
+    double ratio = drift_ratio;
+    long generated = 0;
+    JSList *node, *src_node;
+    int_float_t val;
+    int chn, i, r;
+
+    for (chn = 0, node = playback_ports, src_node = playback_srcs; chn < playback_channels_audio;
+            chn++, node = jack_slist_next (node), src_node = jack_slist_next (src_node)) {
+        SRC_DATA src;
+
+        src.data_in = jack_port_get_buffer ((jack_port_t *) node->data, nframes);
+        src.input_frames = nframes;
+        src.data_out = tx_fifo[chn] + tx_fill;
+        src.output_frames = fifo_size - tx_fill;
+        src.src_ratio = ratio;
+        src.end_of_input = 0;
+        src_process ((SRC_STATE *) src_node->data, &src);
+        generated = src.output_frames_gen;
+    }
+    if (playback_channels_audio == 0) {
+        tx_phase += nframes * ratio;
+        generated = (long) tx_phase;
+        tx_phase -= generated;
+    }
+    tx_fill += generated;
+
+    while (tx_fill >= net_period) {
+        for (chn = 0; chn < playback_channels_audio; chn++) {
+            if (dont_htonl_floats) {
+                memcpy (payload + chn * net_period, tx_fifo[chn], net_period * sizeof (jack_default_audio_sample_t));
+            } else {
+                for (i = 0; i < net_period; i++) {
+                    val.f = tx_fifo[chn][i];
+                    payload[chn * net_period + i] = htonl (val.i);
+                }
+            }
+            memmove (tx_fifo[chn], tx_fifo[chn] + net_period,
+                     (tx_fill - net_period) * sizeof (jack_default_audio_sample_t));
+        }
+        tx_fill -= net_period;
+
+        fill_packet_header (pkthdr_tx, nframes, playback_channels_audio, capture_channels_audio);
+        for (r = 0; r < redundancy; r++)
+            net_send ((char *) packet_buf_tx, tx_bufsize);
+        framecnt++;
+    }
+}
+
+static void
+drift_silence (jack_nframes_t nframes)
+{
+    JSList *node;
+    int chn;
+
+    for (chn = 0, node = capture_ports; chn < capture_channels_audio; chn++, node = jack_slist_next (node))
+        memset (jack_port_get_buffer ((jack_port_t *) node->data, nframes), 0,
+                nframes * sizeof (jack_default_audio_sample_t));
+}
+
+/**
+ * The critical part of the cycle in drift mode: take all the packets
+ * that arrived into the FIFOs, then resample one period out of them.
+ */
+static void
+receive_drift (jack_nframes_t nframes, int input_fd)
+{
+    jack_nframes_t net_period = get_net_period (nframes);
+    int rx_bufsize = get_sample_size (bitdepth) * capture_channels * net_period + sizeof (jacknet_packet_header);
+    int target = latency * net_period;
+    double ratio, correction, err;
+    long consumed = 0, generated = nframes;
+    int needed, got_packet = 0;
+    jack_nframes_t got_frame;
+    JSList *node, *src_node;
+    int chn;
+
+    net_drain (input_fd);
+
+    if (!rx_framecnt_valid) {
+        /* join the stream at the newest packet */
+        if (!packet_cache_get_highest_available_framecnt (packcache, &rx_framecnt)) {
+            drift_silence (nframes);
+            return;
+        }
+        rx_framecnt_valid = 1;
+    }
+
+    correction = 1.0 + DRIFT_FILL_GAIN * fill_z1 + fill_z2;
+    if (correction > 1.0 + DRIFT_MAX_CORRECTION)
+        correction = 1.0 + DRIFT_MAX_CORRECTION;
+    else if (correction < 1.0 - DRIFT_MAX_CORRECTION)
+        correction = 1.0 - DRIFT_MAX_CORRECTION;
+    ratio = drift_ratio * correction;     // input frames per output frame
+    needed = (int) ceil (nframes * ratio) + 2;
+
+    while (rx_fill + net_period <= fifo_size) {
+        uint32_t *packet_buf_rx;
+        jack_time_t timestamp;
+
+        if (packet_cache_retreive_packet_pointer (packcache, rx_framecnt, (char **) &packet_buf_rx,
+                rx_bufsize, &timestamp) == rx_bufsize) {
+            jacknet_packet_header *pkthdr_rx = (jacknet_packet_header *) packet_buf_rx;
+
+            packet_header_ntoh (pkthdr_rx);
+            sync_state = pkthdr_rx->sync_state;
+            dll_update (rx_framecnt, timestamp, net_period);
+            drift_fifo_append (packet_buf_rx + sizeof (jacknet_packet_header) / sizeof (uint32_t), net_period);
+            packet_cache_release_packet (packcache, rx_framecnt);
+            got_packet = 1;
+        } else if (rx_fill < needed
+                   && packet_cache_get_next_available_framecnt (packcache, rx_framecnt + 1, &got_frame)) {
+            /* lost, and the period cannot wait for it */
+            drift_fifo_append (NULL, net_period);
+            state_netxruns++;
+        } else {
+            break;
+        }
+        rx_framecnt++;
+    }
+
+    if (got_packet) {
+        state_connected = 1;
+        cont_miss = 0;
+    } else if (++cont_miss > 50 + 5 * latency) {
+        state_connected = 0;
+        rx_framecnt_valid = 0;
+        rx_started = 0;
+        rx_fill = 0;
+        dll_running = 0;
+        packet_cache_reset_master_address (packcache);
+        cont_miss = 0;
+    }
+    state_currentframe = framecnt;
+
+    if (!rx_started) {
+        if (rx_fill < target + needed) {
+            drift_silence (nframes);
+            return;
+        }
+        rx_started = 1;
+        fill_z1 = fill_z2 = 0.0;
+    }
+
+    for (chn = 0, node = capture_ports, src_node = capture_srcs; chn < capture_channels_audio;
+            chn++, node = jack_slist_next (node), src_node = jack_slist_next (src_node)) {
+        SRC_DATA src;
+
+        src.data_in = rx_fifo[chn];
+        src.input_frames = rx_fill;
+        src.data_out = jack_port_get_buffer ((jack_port_t *) node->data, nframes);
+        src.output_frames = nframes;
+        src.src_ratio = 1.0 / ratio;
+        src.end_of_input = 0;
+        src_process ((SRC_STATE *) src_node->data, &src);
+        consumed = src.input_frames_used;
+        generated = src.output_frames_gen;
+        if (generated < nframes)
+            memset (src.data_out + generated, 0, (nframes - generated) * sizeof (jack_default_audio_sample_t));
+        memmove (rx_fifo[chn], rx_fifo[chn] + consumed, (rx_fill - consumed) * sizeof (jack_default_audio_sample_t));
+    }
+    if (capture_channels_audio == 0) {
+        rx_phase += nframes * ratio;
+        consumed = (long) rx_phase;
+        if (consumed > rx_fill)
+            consumed = rx_fill;
+        rx_phase -= consumed;
+    }
+    rx_fill -= consumed;
+
+    if (generated < nframes) {
+        /* ran dry: collect the latency again */
+        state_netxruns++;
+        rx_started = 0;
+        return;
+    }
+
+    /* a fill above the target means the remote clock is faster than
+     * the DLL says, so consume a little more */
+    err = (double) (rx_fill - target) / net_period;
+    fill_z1 += (1.0 - exp (-2.0 * M_PI * DRIFT_FILL_FILTER * nframes / jack_get_sample_rate (client))) * (err - fill_z1);
+    fill_z2 += DRIFT_FILL_INTEGRAL * fill_z1;
+}
+
+/**
+ * The critical part of the cycle: fill the capture ports, which the
+ * rest of the graph is waiting for.
  */
 int
 process (jack_nframes_t nframes, void *arg)
 {
     jack_nframes_t net_period;
-    int rx_bufsize, tx_bufsize;
+    int rx_bufsize;
 
     jack_default_audio_sample_t *buf;
     jack_port_t *port;
@@ -257,24 +1371,30 @@ process (jack_nframes_t nframes, void *arg)
     const char *porttype;
     int input_fd;
 
-    jack_position_t local_trans_pos;
-
-    uint32_t *packet_buf_tx, *packet_bufX;
+    uint32_t *packet_bufX;
     uint32_t *rx_packet_ptr;
     jack_time_t packet_recv_timestamp;
 
-    if( bitdepth == 999)
-        net_period = (kbps * jack_get_buffer_size(client) * 1024 / jack_get_sample_rate(client) / 8) & (~1) ;
-    else
-        net_period = (float) nframes;
-
-    rx_bufsize =  get_sample_size (bitdepth) * capture_channels * net_period + sizeof (jacknet_packet_header);
-    tx_bufsize =  get_sample_size (bitdepth) * playback_channels * net_period + sizeof (jacknet_packet_header);
+    if( reply_port )
+        input_fd = insockfd;
+    else
+        input_fd = outsockfd;
 
-    /* Allocate a buffer where both In and Out Buffer will fit */
-    packet_buf_tx = alloca (tx_bufsize);
+    if (drift_mode) {
+        receive_drift (nframes, input_fd);
+        return 0;
+    }
+#ifndef WIN32
+    if (streams) {
+        receive_streams (nframes);
+        return 0;
+    }
+#endif
 
-    jacknet_packet_header *pkthdr_tx = (jacknet_packet_header *) packet_buf_tx;
+    net_period = get_net_period (nframes);
+    rx_bufsize =  get_sample_size (bitdepth) * capture_channels * net_period + sizeof (jacknet_packet_header);
+    if (adaptive_kbps)
+        rx_bufsize += sizeof (jacknet_net_report) + 1;
 
     /*
      * for latency==0 we need to send out the packet before we wait on the reply.
@@ -283,69 +1403,24 @@ process (jack_nframes_t nframes, void *arg)
      *
      */
 
-    if( latency == 0 ) {
-        /* reset packet_bufX... */
-        packet_bufX = packet_buf_tx + sizeof (jacknet_packet_header) / sizeof (jack_default_audio_sample_t);
-
-        /* ---------- Send ---------- */
-        render_jack_ports_to_payload (bitdepth, playback_ports, playback_srcs, nframes,
-                                      packet_bufX, net_period, dont_htonl_floats);
-
-        /* fill in packet hdr */
-        pkthdr_tx->transport_state = jack_transport_query (client, &local_trans_pos);
-        pkthdr_tx->transport_frame = local_trans_pos.frame;
-        pkthdr_tx->framecnt = framecnt;
-        pkthdr_tx->latency = latency;
-        pkthdr_tx->reply_port = reply_port;
-        pkthdr_tx->sample_rate = jack_get_sample_rate (client);
-        pkthdr_tx->period_size = nframes;
-
-        /* playback for us is capture on the other side */
-        pkthdr_tx->capture_channels_audio = playback_channels_audio;
-        pkthdr_tx->playback_channels_audio = capture_channels_audio;
-        pkthdr_tx->capture_channels_midi = playback_channels_midi;
-        pkthdr_tx->playback_channels_midi = capture_channels_midi;
-        pkthdr_tx->mtu = mtu;
-        if( freewheeling != 0 )
-            pkthdr_tx->sync_state = (jack_nframes_t)MASTER_FREEWHEELS;
-        else
-            pkthdr_tx->sync_state = (jack_nframes_t)deadline_goodness;
-        //printf("goodness=%d\n", deadline_goodness );
-
-        packet_header_hton (pkthdr_tx);
-        if (cont_miss < 3 * latency + 5) {
-            int r;
-            for( r = 0; r < redundancy; r++ )
-                netjack_sendto (outsockfd, (char *) packet_buf_tx, tx_bufsize, 0, &destaddr, sizeof (destaddr), mtu);
-        } else if (cont_miss > 50 + 5 * latency) {
-            state_connected = 0;
-            packet_cache_reset_master_address( packcache );
-            //printf ("Frame %d  \tRealy too many packets missed (%d). Let's reset the counter\n", framecnt, cont_miss);
-            cont_miss = 0;
-        }
-    }
+    if( latency == 0 )
+        send_packet (nframes);
 
     /*
      * ok... now the RECEIVE code.
      *
      */
 
-
-    if( reply_port )
-        input_fd = insockfd;
-    else
-        input_fd = outsockfd;
-
     // for latency == 0 we can poll.
     if( (latency == 0) || (freewheeling != 0)  ) {
         jack_time_t deadline = jack_get_time() + 1000000 * jack_get_buffer_size(client) / jack_get_sample_rate(client);
         // Now loop until we get the right packet.
         while(1) {
             jack_nframes_t got_frame;
-            if ( ! netjack_poll_deadline( input_fd, deadline ) )
+            if ( ! net_wait( input_fd, deadline ) )
                 break;
 
-            packet_cache_drain_socket(packcache, input_fd);
+            net_drain(input_fd);
 
             if (packet_cache_get_next_available_framecnt( packcache, framecnt - latency, &got_frame ))
                 if( got_frame == (framecnt - latency) )
@@ -354,13 +1429,15 @@ process (jack_nframes_t nframes, void *arg)
     } else {
         // normally:
         // only drain socket.
-        packet_cache_drain_socket(packcache, input_fd);
+        net_drain(input_fd);
     }
 
     size = packet_cache_retreive_packet_pointer( packcache, framecnt - latency, (char**)&rx_packet_ptr, rx_bufsize, &packet_recv_timestamp );
     /* First alternative : we received what we expected. Render the data
-     * to the JACK ports so it can be played. */
-    if (size == rx_bufsize) {
+     * to the JACK ports so it can be played. An adaptive packet only
+     * needs its report, the decoder conceals what is missing. */
+    if (size == rx_bufsize
+            || (adaptive_kbps && size >= (int) (sizeof (jacknet_packet_header) + sizeof (jacknet_net_report)))) {
         uint32_t *packet_buf_rx = rx_packet_ptr;
         jacknet_packet_header *pkthdr_rx = (jacknet_packet_header *) packet_buf_rx;
         packet_bufX = packet_buf_rx + sizeof (jacknet_packet_header) / sizeof (jack_default_audio_sample_t);
@@ -375,8 +1452,19 @@ process (jack_nframes_t nframes, void *arg)
             //printf("Frame %d  \tRecovered from dropouts\n", framecnt);
             cont_miss = 0;
         }
-        render_payload_to_jack_ports (bitdepth, packet_bufX, net_period,
-                                      capture_ports, capture_srcs, nframes, dont_htonl_floats);
+#if HAVE_OPUS
+        if (adaptive_kbps) {
+            jacknet_net_report *report = (jacknet_net_report *) (pkthdr_rx + 1);
+            int header_size = sizeof (jacknet_packet_header) + sizeof (jacknet_net_report);
+
+            net_report_ntoh (report);
+            rate_control (report);
+            render_payload_to_jack_ports_opus_packed (report + 1, size - header_size,
+                                                      capture_ports, capture_srcs, nframes);
+        } else
+#endif
+            render_payload_to_jack_ports (bitdepth, packet_bufX, net_period,
+                                          capture_ports, capture_srcs, nframes, dont_htonl_floats);
 
         state_currentframe = framecnt;
         state_recv_packet_queue_time = recv_time_offset;
@@ -416,50 +1504,30 @@ process (jack_nframes_t nframes, void *arg)
             chn++;
         }
     }
-    if (latency != 0) {
-        /* reset packet_bufX... */
-        packet_bufX = packet_buf_tx + sizeof (jacknet_packet_header) / sizeof (jack_default_audio_sample_t);
-
-        /* ---------- Send ---------- */
-        render_jack_ports_to_payload (bitdepth, playback_ports, playback_srcs, nframes,
-                                      packet_bufX, net_period, dont_htonl_floats);
-
-        /* fill in packet hdr */
-        pkthdr_tx->transport_state = jack_transport_query (client, &local_trans_pos);
-        pkthdr_tx->transport_frame = local_trans_pos.frame;
-        pkthdr_tx->framecnt = framecnt;
-        pkthdr_tx->latency = latency;
-        pkthdr_tx->reply_port = reply_port;
-        pkthdr_tx->sample_rate = jack_get_sample_rate (client);
-        pkthdr_tx->period_size = nframes;
-
-        /* playback for us is capture on the other side */
-        pkthdr_tx->capture_channels_audio = playback_channels_audio;
-        pkthdr_tx->playback_channels_audio = capture_channels_audio;
-        pkthdr_tx->capture_channels_midi = playback_channels_midi;
-        pkthdr_tx->playback_channels_midi = capture_channels_midi;
-        pkthdr_tx->mtu = mtu;
-        if( freewheeling != 0 )
-            pkthdr_tx->sync_state = (jack_nframes_t)MASTER_FREEWHEELS;
-        else
-            pkthdr_tx->sync_state = (jack_nframes_t)deadline_goodness;
-        //printf("goodness=%d\n", deadline_goodness );
-
-        packet_header_hton (pkthdr_tx);
-        if (cont_miss < 3 * latency + 5) {
-            int r;
-            for( r = 0; r < redundancy; r++ )
-                netjack_sendto (outsockfd, (char *) packet_buf_tx, tx_bufsize, 0, &destaddr, sizeof (destaddr), mtu);
-        } else if (cont_miss > 50 + 5 * latency) {
-            state_connected = 0;
-            packet_cache_reset_master_address( packcache );
-            //printf ("Frame %d  \tRealy too many packets missed (%d). Let's reset the counter\n", framecnt, cont_miss);
-            cont_miss = 0;
-        }
+    return 0;
+}
+
+/**
+ * The deferred part of the cycle, run after the graph has been
+ * signalled: nobody waits for the packet going out.
+ */
+void
+process_deferred (jack_nframes_t nframes, void *arg)
+{
+    if (drift_mode) {
+        send_drift_packets (nframes);
+        return;
     }
 
+#ifndef WIN32
+    if (streams)
+        send_stream_packets (nframes);
+    else
+#endif
+    if (latency != 0)
+        send_packet (nframes);
+
     framecnt++;
-    return 0;
 }
 
 /**
@@ -513,57 +1581,43 @@ printUsage ()
              "  -B <bind port> - reply port, for use in NAT environments\n"
              "  -b <bitdepth> - Set transport to use 16bit or 8bit\n"
              "  -P <kbits> - Use Opus encoding with <kbits> kbits per channel\n"
+             "  -a <kbits> - Adapt the Opus bitrate to the link, down to <kbits>\n"
              "  -m <mtu> - Assume this mtu for the link\n"
              "  -R <N> - Redundancy: send out packets N times.\n"
+             "  -D - Drift mode: the slave runs off its own clock, resample both ways\n"
+             "  -S <streams> - Shard the audio channels over <streams> streams on consecutive ports\n"
+             "  -T <percent> - Pace the fragments of a packet over <percent> of the period\n"
+             "  -t - Leave the pacing to the kernel (SO_TXTIME, needs the fq qdisc)\n"
+             "  -X <interface>[:<queue>] - Bypass the UDP stack with AF_XDP on this interface\n"
              "  -e - skip host-to-network endianness conversion\n"
              "  -N <jack name> - Reports a different name to jack\n"
              "  -s <server name> - The name of the local jack server\n"
              "\n");
 }
 
-void
-sigterm_handler( int signal )
-{
-    quit = 1;
-}
-
-int
-main (int argc, char *argv[])
+/**
+ * Parse the command line, or the load_init string split into words
+ * when loaded as an internal client. Returns 0 on success, -1 if only
+ * the help was requested, or an exit code.
+ */
+static int
+parse_options (int argc, char *argv[])
 {
-    /* Some startup related basics */
-    char *client_name, *server_name = NULL, *peer_ip;
-    int peer_port = 3000;
-    jack_options_t options = JackNullOption;
-    jack_status_t status;
-#ifdef WIN32
-    WSADATA wsa;
-    int rc = WSAStartup(MAKEWORD(2, 0), &wsa);
-#endif
-    /* Torben's famous state variables, aka "the reporting API" ! */
-    /* heh ? these are only the copies of them ;)                 */
-    int statecopy_connected, statecopy_latency, statecopy_netxruns;
-    jack_nframes_t net_period;
-    /* Argument parsing stuff */
     extern char *optarg;
     extern int optind, optopt;
     int errflg = 0, c;
 
-    if (argc < 3) {
-        printUsage ();
-        return 1;
-    }
-
     client_name = (char *) malloc (sizeof (char) * 10);
     peer_ip = (char *) malloc (sizeof (char) * 10);
     sprintf(client_name, "netjack");
     sprintf(peer_ip, "localhost");
 
-    while ((c = getopt (argc, argv, ":h:H:o:i:O:I:n:p:r:B:b:c:m:R:e:N:s:P:")) != -1) {
+    optind = 1;
+    while ((c = getopt (argc, argv, ":h:H:o:i:O:I:n:p:r:B:b:c:m:R:e:N:s:P:Da:S:T:tX:")) != -1) {
         switch (c) {
             case 'h':
                 printUsage();
-                exit (0);
-                break;
+                return -1;
             case 'H':
                 free(peer_ip);
                 peer_ip = (char *) malloc (sizeof (char) * strlen (optarg) + 1);
@@ -602,7 +1656,7 @@ main (int argc, char *argv[])
                 kbps = atoi (optarg);
 #else
                 printf( "not built with opus support\n" );
-                exit(10);
+                return 10;
 #endif
                 break;
             case 'm':
@@ -614,6 +1668,38 @@ main (int argc, char *argv[])
             case 'e':
                 dont_htonl_floats = 1;
                 break;
+            case 'D':
+                drift_mode = 1;
+                break;
+            case 'S':
+                num_streams = atoi (optarg);
+                break;
+            case 'T':
+                pace_percent = atoi (optarg);
+                break;
+            case 't':
+                pace_txtime = 1;
+                break;
+            case 'X':
+#if HAVE_XDP
+                xdp_ifname = strdup (optarg);
+                if (strchr (xdp_ifname, ':')) {
+                    xdp_queue = atoi (strchr (xdp_ifname, ':') + 1);
+                    *strchr (xdp_ifname, ':') = '\0';
+                }
+#else
+                printf( "not built with AF_XDP support\n" );
+                return 10;
+#endif
+                break;
+            case 'a':
+#if HAVE_OPUS
+                adaptive_kbps = atoi (optarg);
+#else
+                printf( "not built with opus support\n" );
+                return 10;
+#endif
+                break;
             case 'N':
                 free(client_name);
                 client_name = (char *) malloc (sizeof (char) * strlen (optarg) + 1);
@@ -635,57 +1721,499 @@ main (int argc, char *argv[])
     }
     if (errflg) {
         printUsage ();
-        exit (2);
+        return 2;
     }
 
     capture_channels = capture_channels_audio + capture_channels_midi;
     playback_channels = playback_channels_audio + playback_channels_midi;
 
-    outsockfd = socket (AF_INET, SOCK_DGRAM, 0);
-    insockfd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (drift_mode && (bitdepth != 0 || capture_channels_midi || playback_channels_midi || latency < 1)) {
+        fprintf (stderr, "Drift mode needs float samples, no midi channels and -n 1 or more\n");
+        return 2;
+    }
+    if (adaptive_kbps && (bitdepth != 999 || adaptive_kbps > kbps || drift_mode
+                          || capture_channels_midi || playback_channels_midi)) {
+        fprintf (stderr, "Adaptive bitrate needs -P at or above the -a minimum, no midi channels and no drift mode\n");
+        return 2;
+    }
+    if (pace_percent < 0 || pace_percent > PACE_MAX_PERCENT || (pace_txtime && !pace_percent)) {
+        fprintf (stderr, "Pacing takes up to %d percent of the period, -t needs -T\n", PACE_MAX_PERCENT);
+        return 2;
+    }
+#ifndef NETSOURCE_INTERNAL
+    /* with -n 0 and in drift mode the packets are sent from the process
+     * thread before it waits for the slave, so it must not sleep there */
+    if (pace_percent && !pace_txtime && (latency < 1 || drift_mode)) {
+        fprintf (stderr, "Pacing with -n 0 or in drift mode needs -t\n");
+        return 2;
+    }
+#endif
+    if (num_streams != 1) {
+#ifdef WIN32
+        fprintf (stderr, "Sharding is not supported on this platform\n");
+        return 2;
+#else
+        if (num_streams < 1 || num_streams > NET_MAX_STREAMS || latency < 1 || drift_mode || adaptive_kbps
+                || capture_channels_midi || playback_channels_midi) {
+            fprintf (stderr, "Sharding needs 1 to %d streams, -n 1 or more, no midi channels and no drift or adaptive mode\n",
+                     NET_MAX_STREAMS);
+            return 2;
+        }
+#endif
+    }
+#if HAVE_XDP
+    if (xdp_ifname && (num_streams != 1 || pace_percent)) {
+        fprintf (stderr, "AF_XDP needs a single stream and no pacing\n");
+        return 2;
+    }
+#endif
+    return 0;
+}
+
+/**
+ * Open the sockets of stream n, which uses the ports given on the
+ * command line plus n.
+ */
+static int
+open_stream_sockets (int *out_fd, int *in_fd, struct sockaddr *dest, int n)
+{
+    *out_fd = socket (AF_INET, SOCK_DGRAM, 0);
+    *in_fd = socket (AF_INET, SOCK_DGRAM, 0);
 
-    if ((outsockfd == -1) || (insockfd == -1)) {
+    if ((*out_fd == -1) || (*in_fd == -1)) {
         fprintf (stderr, "can not open sockets\n" );
         return 1;
     }
 
-    init_sockaddr_in ((struct sockaddr_in *) &destaddr, peer_ip, peer_port);
+    init_sockaddr_in ((struct sockaddr_in *) dest, peer_ip, peer_port + n);
     if (bind_port) {
-        init_sockaddr_in ((struct sockaddr_in *) &bindaddr, NULL, bind_port);
-        if( bind (outsockfd, &bindaddr, sizeof (bindaddr)) ) {
+        init_sockaddr_in ((struct sockaddr_in *) &bindaddr, NULL, bind_port + n);
+        if( bind (*out_fd, &bindaddr, sizeof (bindaddr)) ) {
             fprintf (stderr, "bind failure\n" );
         }
     }
     if (reply_port) {
-        init_sockaddr_in ((struct sockaddr_in *) &bindaddr, NULL, reply_port);
-        if( bind (insockfd, &bindaddr, sizeof (bindaddr)) ) {
+        init_sockaddr_in ((struct sockaddr_in *) &bindaddr, NULL, reply_port + n);
+        if( bind (*in_fd, &bindaddr, sizeof (bindaddr)) ) {
             fprintf (stderr, "bind failure\n" );
         }
     }
+    return 0;
+}
 
-    /* try to become a client of the JACK server */
-    client = jack_client_open (client_name, options, &status, server_name);
-    if (client == NULL) {
-        fprintf (stderr, "jack_client_open() failed, status = 0x%2.0x\n"
-                 "Is the JACK server running ?\n", status);
+static int
+open_sockets (void)
+{
+    if (open_stream_sockets (&outsockfd, &insockfd, (struct sockaddr *) &destaddr, 0))
         return 1;
+
+#ifndef WIN32
+    if (num_streams > 1) {
+        int s;
+
+        streams = calloc (num_streams, sizeof (net_stream_t));
+        if (streams == NULL)
+            return 1;
+
+        /* the first stream is the plain netjack connection */
+        streams[0].outsockfd = outsockfd;
+        streams[0].insockfd = insockfd;
+        memcpy (&streams[0].destaddr, &destaddr, sizeof (destaddr));
+        for (s = 1; s < num_streams; s++)
+            if (open_stream_sockets (&streams[s].outsockfd, &streams[s].insockfd, &streams[s].destaddr, s))
+                return 1;
     }
+#endif
+    return 0;
+}
 
-    /* Set up jack callbacks */
-    jack_set_process_callback (client, process, 0);
+#ifndef WIN32
+/**
+ * Split the audio ports over the streams, in contiguous groups, and
+ * give every stream its packet cache, slots and queues.
+ */
+static int
+setup_streams (jack_nframes_t net_period)
+{
+    int s, chn;
+
+    for (s = 0; s < num_streams; s++) {
+        net_stream_t *stream = &streams[s];
+        int first_capture = s * capture_channels_audio / num_streams;
+        int last_capture = (s + 1) * capture_channels_audio / num_streams;
+        int first_playback = s * playback_channels_audio / num_streams;
+        int last_playback = (s + 1) * playback_channels_audio / num_streams;
+        JSList *node, *src_node;
+
+        stream->index = s;
+        for (chn = 0, node = capture_ports, src_node = capture_srcs; node && src_node;
+                chn++, node = jack_slist_next (node), src_node = jack_slist_next (src_node)) {
+            if (chn < first_capture || chn >= last_capture)
+                continue;
+            stream->capture_ports = jack_slist_append (stream->capture_ports, node->data);
+            stream->capture_srcs = jack_slist_append (stream->capture_srcs, src_node->data);
+            stream->capture_channels++;
+        }
+        for (chn = 0, node = playback_ports, src_node = playback_srcs; node && src_node;
+                chn++, node = jack_slist_next (node), src_node = jack_slist_next (src_node)) {
+            if (chn < first_playback || chn >= last_playback)
+                continue;
+            stream->playback_ports = jack_slist_append (stream->playback_ports, node->data);
+            stream->playback_srcs = jack_slist_append (stream->playback_srcs, src_node->data);
+            stream->playback_channels++;
+        }
+
+        stream->rx_bufsize = get_sample_size (bitdepth) * stream->capture_channels * net_period
+                             + sizeof (jacknet_packet_header);
+        stream->tx_bufsize = get_sample_size (bitdepth) * stream->playback_channels * net_period
+                             + sizeof (jacknet_packet_header);
+
+        stream->packcache = packet_cache_new (latency + 50, stream->rx_bufsize, mtu);
+        stream->nslots = latency + STREAM_EXTRA_SLOTS;
+        stream->slots = calloc (stream->nslots, sizeof (stream_slot_t));
+        if (stream->packcache == NULL || stream->slots == NULL)
+            return 1;
+        for (chn = 0; chn < stream->nslots; chn++)
+            if ((stream->slots[chn].packet_buf = malloc (stream->rx_bufsize)) == NULL)
+                return 1;
+
+        stream->rx_ready = jack_ringbuffer_create (2 * stream->nslots * (sizeof (jack_time_t) + stream->rx_bufsize));
+        stream->tx_queue = jack_ringbuffer_create (STREAM_QUEUE_PACKETS * (sizeof (int) + stream->tx_bufsize) * redundancy);
+        if (stream->rx_ready == NULL || stream->tx_queue == NULL)
+            return 1;
+        jack_ringbuffer_mlock (stream->rx_ready);
+        jack_ringbuffer_mlock (stream->tx_queue);
+
+        pthread_mutex_init (&stream->tx_lock, NULL);
+        pthread_cond_init (&stream->tx_ready, NULL);
+    }
+    return 0;
+}
+
+static void
+stop_streams (void)
+{
+    int s;
+
+    if (!streams_running)
+        return;
+
+    streams_running = 0;
+    for (s = 0; s < num_streams; s++) {
+        net_stream_t *stream = &streams[s];
+
+        if (stream->threads & STREAM_TX_THREAD) {
+            pthread_mutex_lock (&stream->tx_lock);
+            pthread_cond_signal (&stream->tx_ready);
+            pthread_mutex_unlock (&stream->tx_lock);
+            pthread_join (stream->tx_thread, NULL);
+        }
+        if (stream->threads & STREAM_RX_THREAD)
+            pthread_join (stream->rx_thread, NULL);
+        stream->threads = 0;
+
+        fprintf (stderr, "stream %d: %d packets missed, %d received and %d outgoing packets dropped on full queues\n",
+                 s, stream->missed, stream->rx_dropped, stream->tx_dropped);
+        if (pace_percent) {
+            char name[32];
+
+            snprintf (name, sizeof (name), "stream %d", s);
+            netjack_pacer_report (&stream->pacer, name, stderr);
+        }
+    }
+}
+
+static int
+start_streams (void)
+{
+    int priority = jack_client_real_time_priority (client);
+    int realtime = jack_is_realtime (client);
+    int s;
+
+    streams_running = 1;
+    for (s = 0; s < num_streams; s++) {
+        net_stream_t *stream = &streams[s];
+
+        if (jack_client_create_thread (client, &stream->rx_thread, priority, realtime, stream_rx_func, stream))
+            break;
+        stream->threads |= STREAM_RX_THREAD;
+        if (jack_client_create_thread (client, &stream->tx_thread, priority, realtime, stream_tx_func, stream))
+            break;
+        stream->threads |= STREAM_TX_THREAD;
+    }
+    if (s < num_streams) {
+        fprintf (stderr, "Cannot start the threads of stream %d\n", s);
+        stop_streams ();
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+#if HAVE_XDP
+/**
+ * Move the connection to AF_XDP on xdp_ifname. The frames carry the
+ * port of the output socket, so the slave sees the same peer either
+ * way; if AF_XDP cannot be used the sockets carry on alone.
+ */
+static void
+setup_xdp (void)
+{
+    struct sockaddr_in local;
+    socklen_t len = sizeof (local);
+    uint16_t rx_port;
+
+    if (!bind_port) {
+        init_sockaddr_in (&local, NULL, 0);
+        bind (outsockfd, (struct sockaddr *) &local, sizeof (local));
+    }
+    if (getsockname (outsockfd, (struct sockaddr *) &local, &len)) {
+        fprintf (stderr, "AF_XDP: cannot get the local port, staying on UDP\n");
+        return;
+    }
+    rx_port = reply_port ? reply_port : ntohs (local.sin_port);
+    xdp = netjack_xdp_open (xdp_ifname, xdp_queue, (struct sockaddr_in *) &destaddr,
+                            ntohs (local.sin_port), rx_port, mtu);
+    if (xdp)
+        printf ("Using AF_XDP on %s queue %d\n", xdp_ifname, xdp_queue);
+    else
+        fprintf (stderr, "AF_XDP not available, staying on UDP\n");
+}
+#endif
+
+/**
+ * Spread every packet over pace_percent of the period. The redundant
+ * copies share that time. Returns -1 if the kernel cannot do the
+ * timing, which leaves it to the sending threads.
+ */
+static int
+setup_pacing (void)
+{
+    jack_time_t spread = (jack_time_t) jack_get_buffer_size (client) * 10000 * pace_percent
+                         / jack_get_sample_rate (client) / redundancy;
+    int err = netjack_pacer_init (&pacer, outsockfd, spread, pace_txtime);
+#ifndef WIN32
+    int s;
+
+    for (s = 0; streams && s < num_streams; s++)
+        err |= netjack_pacer_init (&streams[s].pacer, streams[s].outsockfd, spread, pace_txtime);
+#endif
+    return err;
+}
+
+/**
+ * Install the callbacks, register the ports and create the packet
+ * cache. Returns the size of a received packet, or 0 on failure.
+ */
+static int
+setup_client (void)
+{
+    jack_nframes_t net_period;
+
+    if (cycle_thread_init (&process_thread, client, process, process_deferred, 0)) {
+        fprintf (stderr, "Cannot set process thread\n");
+        return 0;
+    }
     jack_set_sync_callback (client, sync_cb, 0);
     jack_set_freewheel_callback (client, freewheel_cb, 0);
-    jack_on_shutdown (client, jack_shutdown, 0);
 
     alloc_ports (capture_channels_audio, playback_channels_audio, capture_channels_midi, playback_channels_midi);
 
+    if (pace_percent && setup_pacing ()) {
+#ifndef NETSOURCE_INTERNAL
+        if (latency < 1 || drift_mode) {
+            fprintf (stderr, "SO_TXTIME is not available, sending without pacing\n");
+            pace_percent = 0;
+        } else
+#endif
+            fprintf (stderr, "SO_TXTIME is not available, pacing in user space\n");
+    }
+
     if( bitdepth == 999)
         net_period = (kbps * jack_get_buffer_size(client) * 1024 / jack_get_sample_rate(client) / 8) & (~1) ;
     else
         net_period = ceilf((float) jack_get_buffer_size (client));
 
     int rx_bufsize =  get_sample_size (bitdepth) * capture_channels * net_period + sizeof (jacknet_packet_header);
+    if (adaptive_kbps)
+        rx_bufsize += sizeof (jacknet_net_report) + 1;
+#ifndef WIN32
+    if (streams) {
+        if (setup_streams (net_period)) {
+            fprintf (stderr, "Cannot set up the streams\n");
+            return 0;
+        }
+        return rx_bufsize;
+    }
+#endif
     packcache = packet_cache_new (latency + 50, rx_bufsize, mtu);
+    if (packcache == NULL)
+        return 0;
+    if (adaptive_kbps)
+        packet_cache_set_variable_size (packcache, 1);
+    tx_kbps = kbps;
+    if (drift_mode && drift_alloc (jack_get_buffer_size (client))) {
+        fprintf (stderr, "Cannot allocate the drift FIFOs\n");
+        return 0;
+    }
+    return rx_bufsize;
+}
+
+#ifdef NETSOURCE_INTERNAL
+
+/**
+ * Entry point when loaded into the server with jack_load, e.g.
+ * jack_load netsource netsource -i "-H slave -n 2". load_init takes
+ * the same options as the jack_netsource command line.
+ */
+JACK_LIB_EXPORT
+int
+jack_initialize (jack_client_t *jack_client, const char *load_init)
+{
+    static int loaded = 0;
+    char *args, *token, *savep;
+    char **argv;
+    int argc = 0;
+    int rx_bufsize, tx_bufsize;
+    int err;
+
+    /* the client state is global, so only one instance can run */
+    if (loaded) {
+        fprintf (stderr, "netsource: only one instance can be loaded\n");
+        return 1;
+    }
+
+    args = strdup (load_init ? load_init : "");
+    argv = (char **) malloc (sizeof (char *) * (strlen (args) / 2 + 2));
+    argv[argc++] = "netsource";
+    for (token = strtok_r (args, " \t", &savep); token; token = strtok_r (NULL, " \t", &savep))
+        argv[argc++] = token;
+    argv[argc] = NULL;
+
+    err = parse_options (argc, argv);
+    free (argv);
+    free (args);
+    if (err != 0)
+        return 1;
+
+    client = jack_client;
+    if (open_sockets ())
+        return 1;
+
+    rx_bufsize = setup_client ();
+    if (rx_bufsize == 0)
+        return 1;
+
+    tx_bufsize = get_sample_size (bitdepth) * playback_channels * get_net_period (jack_get_buffer_size (client))
+                 + sizeof (jacknet_packet_header);
+    if (adaptive_kbps)
+        tx_bufsize += sizeof (jacknet_net_report) + 1;
+    if (streams ? start_streams () : start_io_threads (tx_bufsize, rx_bufsize)) {
+        fprintf (stderr, "netsource: cannot start the network threads\n");
+        return 1;
+    }
+
+    if (jack_activate (client)) {
+        fprintf (stderr, "netsource: cannot activate client\n");
+        stop_io_threads ();
+        stop_streams ();
+        return 1;
+    }
+
+    loaded = 1;
+    return 0;
+}
+
+JACK_LIB_EXPORT
+void
+jack_finish (void *arg)
+{
+    int s;
+
+    stop_io_threads ();
+    stop_streams ();
+    if (pace_percent && num_streams == 1)
+        netjack_pacer_report (&pacer, "netsource", stderr);
+    cycle_thread_report (&process_thread, "netsource", stderr);
+    close (outsockfd);
+    close (insockfd);
+    packet_cache_free (packcache);
+    if (rx_queue)
+        jack_ringbuffer_free (rx_queue);
+    if (tx_queue)
+        jack_ringbuffer_free (tx_queue);
+    for (s = 1; streams && s < num_streams; s++) {
+        close (streams[s].outsockfd);
+        close (streams[s].insockfd);
+    }
+    for (s = 0; streams && s < num_streams; s++) {
+        packet_cache_free (streams[s].packcache);
+        jack_ringbuffer_free (streams[s].rx_ready);
+        jack_ringbuffer_free (streams[s].tx_queue);
+    }
+}
+
+#else
+
+void
+sigterm_handler( int signal )
+{
+    quit = 1;
+}
+
+int
+main (int argc, char *argv[])
+{
+    /* Some startup related basics */
+    jack_status_t status;
+#ifdef WIN32
+    WSADATA wsa;
+    int rc = WSAStartup(MAKEWORD(2, 0), &wsa);
+#endif
+    /* Torben's famous state variables, aka "the reporting API" ! */
+    /* heh ? these are only the copies of them ;)                 */
+    int statecopy_connected, statecopy_latency, statecopy_netxruns;
+    uint64_t statecopy_overruns = 0;
+    int drift_report = 0;
+    int pace_report = 0;
+    jack_nframes_t statecopy_kbps = kbps;
+    cycle_stats stats;
+    int err;
+
+    if (argc < 3) {
+        printUsage ();
+        return 1;
+    }
+
+    err = parse_options (argc, argv);
+    if (err < 0)
+        exit (0);
+    if (err > 0)
+        exit (err);
+
+    if (open_sockets ())
+        return 1;
+#if HAVE_XDP
+    if (xdp_ifname)
+        setup_xdp ();
+#endif
+
+    /* try to become a client of the JACK server */
+    client = jack_client_open (client_name, options, &status, server_name);
+    if (client == NULL) {
+        fprintf (stderr, "jack_client_open() failed, status = 0x%2.0x\n"
+                 "Is the JACK server running ?\n", status);
+        return 1;
+    }
+
+    /* Set up jack callbacks */
+    jack_on_shutdown (client, jack_shutdown, 0);
+    if (setup_client () == 0)
+        return 1;
+#ifndef WIN32
+    if (streams && start_streams ())
+        return 1;
+#endif
 
     /* tell the JACK server that we are ready to roll */
     if (jack_activate (client)) {
@@ -708,6 +2236,13 @@ main (int argc, char *argv[])
 #else
         sleep(1);
 #endif
+        cycle_thread_get_stats (&process_thread, &stats);
+        if (stats.overruns != statecopy_overruns) {
+            statecopy_overruns = stats.overruns;
+            cycle_thread_report (&process_thread, client_name, stdout);
+            fflush(stdout);
+        }
+
         if (statecopy_connected != state_connected) {
             statecopy_connected = state_connected;
             if (statecopy_connected) {
@@ -731,6 +2266,21 @@ main (int argc, char *argv[])
 
                 fflush(stdout);
             }
+            if (adaptive_kbps && statecopy_kbps != tx_kbps) {
+                statecopy_kbps = tx_kbps;
+                printf ("%s: sending at %d kbits per channel\n", client_name, statecopy_kbps);
+                fflush(stdout);
+            }
+            if (pace_percent && num_streams == 1 && ++pace_report == 10) {
+                netjack_pacer_report (&pacer, client_name, stdout);
+                fflush(stdout);
+                pace_report = 0;
+            }
+            if (drift_mode && ++drift_report == 10) {
+                printf ("%s: remote clock %+.1f ppm\n", client_name, (drift_ratio - 1.0) * 1e6);
+                fflush(stdout);
+                drift_report = 0;
+            }
         } else {
             if (statecopy_latency != state_latency) {
                 statecopy_latency = state_latency;
@@ -742,6 +2292,20 @@ main (int argc, char *argv[])
     }
 
     jack_client_close (client);
+#ifndef WIN32
+    stop_streams ();
+#endif
+    if (pace_percent && num_streams == 1)
+        netjack_pacer_report (&pacer, client_name, stdout);
+#if HAVE_XDP
+    if (xdp) {
+        netjack_xdp_report (xdp, client_name, stdout);
+        netjack_xdp_close (xdp);
+    }
+#endif
+    cycle_thread_report (&process_thread, client_name, stdout);
     packet_cache_free (packcache);
     exit (0);
 }
+
+#endif
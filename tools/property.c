@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
 
 #include <jack/jack.h>
@@ -30,6 +31,11 @@ show_usage (void)
 	fprintf (stderr, "        -l                  Show all properties\n");
 	fprintf (stderr, "        -l, --list UUID     Show value for all properties of UUID\n");
 	fprintf (stderr, "        -l, --list UUID key Show value for key of UUID\n");
+	fprintf (stderr, "\nBulk options:\n");
+	fprintf (stderr, "        -i, --import FILE   Set all properties listed in FILE (- for stdin)\n");
+	fprintf (stderr, "        -x, --export        Write all properties to stdout\n");
+	fprintf (stderr, "        -j, --json          Export as JSON instead of tab separated values\n");
+	fprintf (stderr, "        -n, --names         Export port and client names instead of UUIDs\n");
 	fprintf (stderr, "\nFor more information see https://jackaudio.org/\n");
 }
 
@@ -79,6 +85,545 @@ get_subject (jack_client_t* client, char* argv[], int* optind)
 	return 0;
 }
 
+/* Bulk import/export
+ *
+ * Properties are exchanged either as tab separated lines
+ *
+ *     subject <TAB> key <TAB> value [ <TAB> type ]
+ *
+ * with tab, newline and backslash escaped as \t, \n and \\, or as a JSON
+ * array of objects with "subject", "key", "value" and optional "type"
+ * members. A subject is a UUID, a port name (if it contains a colon) or a
+ * client name.
+ */
+
+typedef struct {
+	int set;
+	int unchanged;
+	int failed;
+	char* last_subject;
+	jack_uuid_t last_uuid;
+} import_state_t;
+
+static int
+resolve_subject (jack_client_t* client, import_state_t* state, const char* str, jack_uuid_t* out)
+{
+	if (state->last_subject && strcmp (state->last_subject, str) == 0) {
+		*out = state->last_uuid;
+		return 0;
+	}
+
+	if (jack_uuid_parse (str, out) == 0) {
+		/* plain UUID */
+	} else if (strchr (str, ':')) {
+		jack_port_t* port;
+
+		if ((port = jack_port_by_name (client, str)) == NULL) {
+			fprintf (stderr, "cannot find port name %s\n", str);
+			return -1;
+		}
+		*out = jack_port_uuid (port);
+	} else {
+		char* ustr;
+
+		if ((ustr = jack_get_uuid_for_client_name (client, str)) == NULL) {
+			fprintf (stderr, "cannot get UUID for client named %s\n", str);
+			return -1;
+		}
+		if (jack_uuid_parse (ustr, out)) {
+			fprintf (stderr, "cannot parse client UUID as UUID '%s' '%s'\n", str, ustr);
+			jack_free (ustr);
+			return -1;
+		}
+		jack_free (ustr);
+	}
+
+	free (state->last_subject);
+	state->last_subject = strdup (str);
+	state->last_uuid = *out;
+	return 0;
+}
+
+static void
+import_property (jack_client_t* client, import_state_t* state,
+		 const char* subject_str, const char* key, const char* value, const char* type)
+{
+	jack_uuid_t subject_uuid;
+	char* old_value = NULL;
+	char* old_type = NULL;
+	int same = 0;
+
+	if (!type) {
+		type = "";
+	}
+
+	if (resolve_subject (client, state, subject_str, &subject_uuid)) {
+		state->failed++;
+		return;
+	}
+
+	/* only touch properties whose value or type differ */
+
+	if (jack_get_property (subject_uuid, key, &old_value, &old_type) == 0) {
+		same = (strcmp (old_value, value) == 0
+			&& strcmp (old_type ? old_type : "", type) == 0);
+		free (old_value);
+		if (old_type) {
+			free (old_type);
+		}
+	}
+
+	if (same) {
+		state->unchanged++;
+		return;
+	}
+
+	if (jack_set_property (client, subject_uuid, key, value, type)) {
+		fprintf (stderr, "cannot set value for key %s of %s\n", key, subject_str);
+		state->failed++;
+		return;
+	}
+	state->set++;
+}
+
+static char*
+read_file (const char* path)
+{
+	FILE* fp;
+	char* buf = NULL;
+	size_t len = 0;
+	size_t size = 0;
+	size_t n;
+
+	if (strcmp (path, "-") == 0) {
+		fp = stdin;
+	} else if ((fp = fopen (path, "r")) == NULL) {
+		fprintf (stderr, "cannot open %s\n", path);
+		return NULL;
+	}
+
+	do {
+		if (size - len < 4096) {
+			char* tmp;
+			size = size ? size * 2 : 65536;
+			if ((tmp = realloc (buf, size)) == NULL) {
+				free (buf);
+				buf = NULL;
+				break;
+			}
+			buf = tmp;
+		}
+		n = fread (buf + len, 1, size - len - 1, fp);
+		len += n;
+	} while (n > 0);
+
+	if (buf) {
+		buf[len] = '\0';
+	}
+	if (fp != stdin) {
+		fclose (fp);
+	}
+	return buf;
+}
+
+/* unescape a TSV field in place */
+static void
+tsv_unescape (char* str)
+{
+	char* out = str;
+
+	for (; *str; str++) {
+		if (*str == '\\' && str[1]) {
+			str++;
+			switch (*str) {
+			case 't':
+				*out++ = '\t';
+				break;
+			case 'n':
+				*out++ = '\n';
+				break;
+			case 'r':
+				*out++ = '\r';
+				break;
+			default:
+				*out++ = *str;
+				break;
+			}
+		} else {
+			*out++ = *str;
+		}
+	}
+	*out = '\0';
+}
+
+static void
+import_tsv (jack_client_t* client, import_state_t* state, char* buf)
+{
+	char* line = buf;
+	int lineno = 0;
+
+	while (line && *line) {
+		char* next = strchr (line, '\n');
+		char* field[4] = { NULL, NULL, NULL, NULL };
+		int nfields = 0;
+		char* p = line;
+		size_t len;
+
+		if (next) {
+			*next++ = '\0';
+		}
+		lineno++;
+
+		len = strlen (line);
+		if (len && line[len - 1] == '\r') {
+			line[len - 1] = '\0';
+		}
+
+		if (*line == '\0' || *line == '#') {
+			line = next;
+			continue;
+		}
+
+		while (p && nfields < 4) {
+			field[nfields++] = p;
+			if ((p = strchr (p, '\t')) != NULL) {
+				*p++ = '\0';
+			}
+		}
+
+		if (nfields < 3) {
+			fprintf (stderr, "line %d: expected subject, key and value\n", lineno);
+			state->failed++;
+		} else {
+			int i;
+			for (i = 0; i < nfields; i++) {
+				tsv_unescape (field[i]);
+			}
+			import_property (client, state, field[0], field[1], field[2], field[3]);
+		}
+
+		line = next;
+	}
+}
+
+static const char*
+json_skip_ws (const char* p)
+{
+	while (isspace ((unsigned char) *p)) {
+		p++;
+	}
+	return p;
+}
+
+static void
+utf8_append (char** out, unsigned int cp)
+{
+	char* o = *out;
+
+	if (cp < 0x80) {
+		*o++ = cp;
+	} else if (cp < 0x800) {
+		*o++ = 0xc0 | (cp >> 6);
+		*o++ = 0x80 | (cp & 0x3f);
+	} else if (cp < 0x10000) {
+		*o++ = 0xe0 | (cp >> 12);
+		*o++ = 0x80 | ((cp >> 6) & 0x3f);
+		*o++ = 0x80 | (cp & 0x3f);
+	} else {
+		*o++ = 0xf0 | (cp >> 18);
+		*o++ = 0x80 | ((cp >> 12) & 0x3f);
+		*o++ = 0x80 | ((cp >> 6) & 0x3f);
+		*o++ = 0x80 | (cp & 0x3f);
+	}
+	*out = o;
+}
+
+/* Parse a JSON string starting at the opening quote, unescaping it in
+   place. Returns a pointer past the closing quote or NULL on error. */
+static char*
+json_parse_string (char* p, char** result)
+{
+	char* out;
+
+	if (*p != '"') {
+		return NULL;
+	}
+	*result = out = ++p;
+
+	while (*p && *p != '"') {
+		if (*p != '\\') {
+			*out++ = *p++;
+			continue;
+		}
+		p++;
+		switch (*p) {
+		case 'b': *out++ = '\b'; p++; break;
+		case 'f': *out++ = '\f'; p++; break;
+		case 'n': *out++ = '\n'; p++; break;
+		case 'r': *out++ = '\r'; p++; break;
+		case 't': *out++ = '\t'; p++; break;
+		case 'u': {
+			unsigned int cp;
+			if (sscanf (p + 1, "%4x", &cp) != 1) {
+				return NULL;
+			}
+			p += 5;
+			if (cp >= 0xd800 && cp < 0xdc00 && p[0] == '\\' && p[1] == 'u') {
+				unsigned int lo;
+				if (sscanf (p + 2, "%4x", &lo) == 1 && lo >= 0xdc00 && lo < 0xe000) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+					p += 6;
+				}
+			}
+			/* escapes never expand, so unescaping in place is safe */
+			utf8_append (&out, cp);
+			break;
+		}
+		case '\0':
+			return NULL;
+		default:
+			*out++ = *p++;
+			break;
+		}
+	}
+
+	if (*p != '"') {
+		return NULL;
+	}
+	*out = '\0';
+	return p + 1;
+}
+
+static int
+import_json (jack_client_t* client, import_state_t* state, char* buf)
+{
+	char* p = (char*) json_skip_ws (buf);
+
+	if (*p++ != '[') {
+		return -1;
+	}
+
+	for (;;) {
+		char* subject_str = NULL;
+		char* key = NULL;
+		char* value = NULL;
+		char* type = NULL;
+
+		p = (char*) json_skip_ws (p);
+		if (*p == ']') {
+			return 0;
+		}
+		if (*p++ != '{') {
+			return -1;
+		}
+
+		for (;;) {
+			char* name;
+			char* str;
+
+			p = (char*) json_skip_ws (p);
+			if (*p == '}') {
+				p++;
+				break;
+			}
+			if ((p = json_parse_string (p, &name)) == NULL) {
+				return -1;
+			}
+			p = (char*) json_skip_ws (p);
+			if (*p++ != ':') {
+				return -1;
+			}
+			p = (char*) json_skip_ws (p);
+			if (strncmp (p, "null", 4) == 0) {
+				str = NULL;
+				p += 4;
+			} else if ((p = json_parse_string (p, &str)) == NULL) {
+				return -1;
+			}
+
+			if (strcmp (name, "subject") == 0) {
+				subject_str = str;
+			} else if (strcmp (name, "key") == 0) {
+				key = str;
+			} else if (strcmp (name, "value") == 0) {
+				value = str;
+			} else if (strcmp (name, "type") == 0) {
+				type = str;
+			}
+
+			p = (char*) json_skip_ws (p);
+			if (*p == ',') {
+				p++;
+			}
+		}
+
+		if (subject_str && key && value) {
+			import_property (client, state, subject_str, key, value, type);
+		} else {
+			fprintf (stderr, "skipping entry without subject, key or value\n");
+			state->failed++;
+		}
+
+		p = (char*) json_skip_ws (p);
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
+
+static int
+import_properties (jack_client_t* client, const char* path)
+{
+	import_state_t state = { 0, 0, 0, NULL, JACK_UUID_EMPTY_INITIALIZER };
+	char* buf;
+
+	if ((buf = read_file (path)) == NULL) {
+		return -1;
+	}
+
+	if (*json_skip_ws (buf) == '[') {
+		if (import_json (client, &state, buf)) {
+			fprintf (stderr, "malformed JSON in %s\n", path);
+			state.failed++;
+		}
+	} else {
+		import_tsv (client, &state, buf);
+	}
+
+	printf ("%d properties set, %d unchanged, %d failed\n", state.set, state.unchanged, state.failed);
+
+	free (state.last_subject);
+	free (buf);
+	return state.failed ? -1 : 0;
+}
+
+static void
+print_escaped (const char* str, int json)
+{
+	if (json) {
+		putchar ('"');
+	}
+	for (; *str; str++) {
+		unsigned char c = (unsigned char) *str;
+		if (c == '\\') {
+			fputs ("\\\\", stdout);
+		} else if (c == '\t') {
+			fputs ("\\t", stdout);
+		} else if (c == '\n') {
+			fputs ("\\n", stdout);
+		} else if (c == '\r') {
+			fputs ("\\r", stdout);
+		} else if (json && c == '"') {
+			fputs ("\\\"", stdout);
+		} else if (json && c < 0x20) {
+			printf ("\\u%04x", c);
+		} else {
+			putchar (c);
+		}
+	}
+	if (json) {
+		putchar ('"');
+	}
+}
+
+/* Returns a port or client name for subject, or NULL. The result must
+   be released with jack_free(). */
+static char*
+subject_name (jack_client_t* client, const char** ports, jack_uuid_t subject)
+{
+	char buf[JACK_UUID_STRING_SIZE];
+	char* name;
+	size_t i;
+
+	for (i = 0; ports && ports[i]; i++) {
+		jack_port_t* port = jack_port_by_name (client, ports[i]);
+		if (port && jack_uuid_compare (jack_port_uuid (port), subject) == 0) {
+			if ((name = malloc (strlen (ports[i]) + 1)) != NULL) {
+				strcpy (name, ports[i]);
+			}
+			return name;
+		}
+	}
+
+	jack_uuid_unparse (subject, buf);
+	return jack_get_client_name_by_uuid (client, buf);
+}
+
+static int
+export_properties (jack_client_t* client, int json, int names)
+{
+	jack_description_t* description;
+	const char** ports = NULL;
+	char buf[JACK_UUID_STRING_SIZE];
+	int cnt, n;
+	size_t p;
+	int first = 1;
+
+	if ((cnt = jack_get_all_properties (&description)) < 0) {
+		fprintf (stderr, "could not retrieve all properties\n");
+		return -1;
+	}
+
+	if (names) {
+		ports = jack_get_ports (client, NULL, NULL, 0);
+	}
+
+	if (json) {
+		printf ("[");
+	}
+
+	for (n = 0; n < cnt; ++n) {
+		char* name = names ? subject_name (client, ports, description[n].subject) : NULL;
+
+		jack_uuid_unparse (description[n].subject, buf);
+
+		for (p = 0; p < description[n].property_cnt; ++p) {
+			const jack_property_t* prop = &description[n].properties[p];
+
+			if (json) {
+				printf ("%s\n  {\"subject\": ", first ? "" : ",");
+				print_escaped (name ? name : buf, 1);
+				printf (", \"key\": ");
+				print_escaped (prop->key, 1);
+				printf (", \"value\": ");
+				print_escaped (prop->data, 1);
+				if (prop->type && prop->type[0]) {
+					printf (", \"type\": ");
+					print_escaped (prop->type, 1);
+				}
+				printf ("}");
+			} else {
+				print_escaped (name ? name : buf, 0);
+				putchar ('\t');
+				print_escaped (prop->key, 0);
+				putchar ('\t');
+				print_escaped (prop->data, 0);
+				if (prop->type && prop->type[0]) {
+					putchar ('\t');
+					print_escaped (prop->type, 0);
+				}
+				putchar ('\n');
+			}
+			first = 0;
+		}
+
+		if (name) {
+			jack_free (name);
+		}
+		jack_free_description (&description[n], 0);
+	}
+
+	if (json) {
+		printf ("\n]\n");
+	}
+
+	if (ports) {
+		jack_free (ports);
+	}
+	free (description);
+	return 0;
+}
+
 int main (int argc, char* argv[])
 {
 	jack_client_t* client = NULL;
@@ -89,6 +634,10 @@ int main (int argc, char* argv[])
 	int set = 1;
 	int delete = 0;
 	int delete_all = 0;
+	int export = 0;
+	int json = 0;
+	int names = 0;
+	char* import_file = NULL;
 	int c;
 	int option_index;
 	extern int optind;
@@ -99,6 +648,10 @@ int main (int argc, char* argv[])
 		{ "list", 0, 0, 'l' },
 		{ "client", 0, 0, 'c' },
 		{ "port", 0, 0, 'p' },
+		{ "import", 1, 0, 'i' },
+		{ "export", 0, 0, 'x' },
+		{ "json", 0, 0, 'j' },
+		{ "names", 0, 0, 'n' },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -107,7 +660,7 @@ int main (int argc, char* argv[])
 		exit (1);
 	}
 
-	while ((c = getopt_long (argc, argv, "sdDlApc", long_options, &option_index)) >= 0) {
+	while ((c = getopt_long (argc, argv, "sdDlApci:xjn", long_options, &option_index)) >= 0) {
 		switch (c) {
 		case 's':
 			if (argc < 5) {
@@ -145,6 +698,22 @@ int main (int argc, char* argv[])
 			subject_is_client = 1;
 			break;
 
+		case 'i':
+			import_file = optarg;
+			break;
+
+		case 'x':
+			export = 1;
+			break;
+
+		case 'j':
+			json = 1;
+			break;
+
+		case 'n':
+			names = 1;
+			break;
+
 		case '?':
 		default:
 			show_usage ();
@@ -157,6 +726,18 @@ int main (int argc, char* argv[])
 		exit (1);
 	}
 
+	if (import_file) {
+		int rc = import_properties (client, import_file);
+		jack_client_close (client);
+		return rc ? 1 : 0;
+	}
+
+	if (export) {
+		int rc = export_properties (client, json, names);
+		jack_client_close (client);
+		return rc ? 1 : 0;
+	}
+
 	if (delete_all) {
 
 		if (jack_remove_all_properties (client) == 0) {
@@ -5,15 +5,205 @@
 #include <getopt.h>
 
 #include <time.h>
+#include <errno.h>
+
+#ifndef WIN32
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <jack/jack.h>
 
+#define RETRY_MIN_MSECS 10
+#define RETRY_MAX_MSECS 1000
+
 char * my_name;
 
+static volatile int server_gone = 0;
+#ifndef WIN32
+static int shutdown_pipe[2] = { -1, -1 };
+#endif
+
 void silent_function( const char *ignore )
 {
 }
 
+static long long
+now_msecs (void)
+{
+#ifdef WIN32
+	return GetTickCount64 ();
+#else
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/* Milliseconds left until the timeout expires, or -1 without timeout */
+static long long
+msecs_left (long long deadline)
+{
+	long long left;
+
+	if (deadline < 0) {
+		return -1;
+	}
+	left = deadline - now_msecs ();
+	return left > 0 ? left : 0;
+}
+
+static jack_client_t *
+open_client (const char *client_name, jack_options_t options, const char *server_name, jack_status_t *status)
+{
+	return jack_client_open (client_name ? client_name : "wait", options, status, server_name);
+}
+
+static void
+on_info_shutdown (jack_status_t code, const char *reason, void *arg)
+{
+	server_gone = 1;
+#ifndef WIN32
+	char c = 0;
+	if (write (shutdown_pipe[1], &c, 1) < 0) {
+		/* nothing to do, the flag is checked again on the next wakeup */
+	}
+#endif
+}
+
+#ifndef WIN32
+
+/* Sleep on fd until it becomes readable or timeout_msecs elapse
+   (forever if negative). Returns > 0 if fd is readable. */
+static int
+wait_readable (int fd, long long timeout_msecs)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do {
+		rc = poll (&pfd, fd >= 0 ? 1 : 0, timeout_msecs > 0x7fffffff ? 0x7fffffff : (int) timeout_msecs);
+	} while (rc < 0 && errno == EINTR);
+	return rc;
+}
+#endif
+
+#ifdef __linux__
+/* Directories in which the jack implementations place their server
+   sockets; creating or touching any entry in them triggers a retry. */
+static int
+watch_server_dirs (void)
+{
+	const char *dirs[5];
+	int ndirs = 0;
+	int fd;
+	int i;
+
+	if ((fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	dirs[ndirs++] = getenv ("JACK_TMPDIR");
+	dirs[ndirs++] = getenv ("XDG_RUNTIME_DIR");
+	dirs[ndirs++] = "/dev/shm";
+	dirs[ndirs++] = "/tmp";
+
+	for (i = 0; i < ndirs; i++) {
+		if (dirs[i]) {
+			inotify_add_watch (fd, dirs[i], IN_CREATE | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+		}
+	}
+	return fd;
+}
+
+static void
+drain_events (int fd)
+{
+	char buf[4096];
+
+	while (read (fd, buf, sizeof (buf)) > 0) {
+	}
+}
+#endif
+
+/* Wait until a client can be opened. Retries are triggered by file
+   system events in the server socket directories where available,
+   with a backed off retry as a fallback. */
+static jack_client_t *
+wait_for_server_start (const char *client_name, jack_options_t options, const char *server_name,
+		 jack_status_t *status, long long deadline)
+{
+	jack_client_t *client;
+	long long retry = RETRY_MAX_MSECS;
+	long long left;
+	int fd = -1;
+
+#ifdef __linux__
+	fd = watch_server_dirs ();
+#endif
+
+	while ((client = open_client (client_name, options, server_name, status)) == NULL) {
+		if (!(*status & JackServerFailed)) {
+			break;
+		}
+		if ((left = msecs_left (deadline)) == 0) {
+			break;
+		}
+		if (left > 0 && left < retry) {
+			retry = left;
+		}
+#ifdef WIN32
+		Sleep(retry);
+		retry = RETRY_MAX_MSECS;
+#else
+		if (wait_readable (fd, retry) > 0) {
+#ifdef __linux__
+			drain_events (fd);
+#endif
+			/* the server may still be starting up, retry quickly for a while */
+			retry = RETRY_MIN_MSECS;
+		} else if (retry < RETRY_MAX_MSECS) {
+			retry *= 2;
+		}
+#endif
+	}
+
+	if (fd >= 0) {
+		close (fd);
+	}
+	return client;
+}
+
+/* Wait until the server of client goes away. Returns 0 if it did, 1 on
+   timeout and -1 on error. */
+static int
+wait_for_server_quit (jack_client_t *client, long long deadline)
+{
+	long long left;
+
+	jack_on_info_shutdown (client, on_info_shutdown, NULL);
+	if (jack_activate (client)) {
+		fprintf (stderr, "cannot activate client\n");
+		return -1;
+	}
+
+	while (!server_gone) {
+		if ((left = msecs_left (deadline)) == 0) {
+			return 1;
+		}
+#ifdef WIN32
+		Sleep((left < 0 || left > 10) ? 10 : left);
+#else
+		wait_readable (shutdown_pipe[0], left);
+#endif
+	}
+	return 0;
+}
+
 void
 show_usage(void)
 {
@@ -44,7 +234,7 @@ main(int argc, char *argv[])
 	int wait_for_quit = 0;
 	int just_check = 0;
 	int wait_timeout = 0;
-	time_t start_timestamp;
+	long long deadline = -1;
 
 
 	struct option long_options[] = {
@@ -99,58 +289,83 @@ main(int argc, char *argv[])
 
 	jack_set_info_function(silent_function);
 
-	/* try to open server in a loop. breaking under certein conditions */
+	if (wait_timeout) {
+		deadline = now_msecs () + (long long) wait_timeout * 1000;
+	}
 
-	start_timestamp = time(NULL);
+#ifndef WIN32
+	if (pipe (shutdown_pipe)) {
+		perror ("pipe");
+		return 1;
+	}
+#endif
 
-	while (1) {
-		if (client_name) {
-			client = jack_client_open (client_name, options, &status, server_name);
-		}
-		else {
-			client = jack_client_open ("wait", options, &status, server_name);
-		}
-		/* check for some real error and bail out */
-		if ((client == NULL) && !(status & JackServerFailed)) {
-			fprintf (stderr, "jack_client_open() failed, "
-					"status = 0x%2.0x\n", status);
-			return 1;
+	client = open_client (client_name, options, server_name, &status);
+
+	/* check for some real error and bail out */
+	if ((client == NULL) && !(status & JackServerFailed)) {
+		fprintf (stderr, "jack_client_open() failed, "
+				"status = 0x%2.0x\n", status);
+		return 1;
+	}
+
+	if (just_check) {
+		fprintf(stdout, client ? "running\n" : "not running\n");
+		if (client) {
+			jack_client_close(client);
 		}
+		exit(0);
+	}
 
+	if (wait_for_start) {
 		if (client == NULL) {
-			if (wait_for_quit) {
-				fprintf(stdout, "server is gone\n");
-				break;
-			}
-			if (just_check) {
-				fprintf(stdout, "not running\n");
-				break;
-			}
-		} else {
-			jack_client_close(client);
-			if (wait_for_start) {
-				fprintf(stdout, "server is available\n");
-				break;
-			}
-			if (just_check) {
-				fprintf(stdout, "running\n");
-				break;
+			client = wait_for_server_start (client_name, options, server_name, &status, deadline);
+		}
+		if (client == NULL) {
+			if (!(status & JackServerFailed)) {
+				fprintf (stderr, "jack_client_open() failed, "
+						"status = 0x%2.0x\n", status);
+				return 1;
 			}
+			fprintf(stdout, "timeout\n");
+			exit(EXIT_FAILURE);
 		}
-		if (wait_timeout) {
-			if ((time(NULL) - start_timestamp) > wait_timeout) {
+		jack_client_close(client);
+		fprintf(stdout, "server is available\n");
+		exit(0);
+	}
+
+	if (wait_for_quit) {
+		if (client) {
+			/* keep this client open and get notified when the server goes */
+			int rc = wait_for_server_quit (client, deadline);
+			if (rc < 0) {
+				jack_client_close(client);
+				return 1;
+			}
+			if (rc > 0) {
+				jack_client_close(client);
 				fprintf(stdout, "timeout\n");
 				exit(EXIT_FAILURE);
 			}
+			jack_client_close(client);
 		}
+		fprintf(stdout, "server is gone\n");
+		exit(0);
+	}
 
-		// Wait a second, and repeat
+	/* nothing to wait for, just sit out the timeout */
+
+	if (client) {
+		jack_client_close(client);
+	}
+	while (msecs_left (deadline) != 0) {
 #ifdef WIN32
 		Sleep(1*1000);
 #else
 		sleep(1);
 #endif
 	}
-
-	exit(0);
+	fprintf(stdout, "timeout\n");
+	exit(EXIT_FAILURE);
 }
@@ -32,7 +32,9 @@ Jackclient::Jackclient (jack_client_t* cl, const char *jserv, int mode, int ncha
     _nchan (nchan),     
     _state (INIT),
     _freew (false),
-    _resamp (0)
+    _commq (0),
+    _resamp (0),
+    _alsadev (0)
 {
     init (jserv);
     if (!sync) _resamp = new VResampler ();
@@ -170,10 +172,54 @@ void Jackclient::start (Lfq_audio   *audioq,
 }
 
 
+// Direct mode: with the device on the same word clock as the
+// Jack master, transfer between the ALSA mmap area and the Jack
+// ports in the process callback. There is no ALSA thread, audio
+// queue or resampler, and the device holds only one period plus
+// a margin for scheduling jitter.
+
+void Jackclient::start_direct (Alsa_pcmi   *alsadev,
+                               Lfq_jdata   *infoq,
+                               int         ltcor)
+{
+    snd_pcm_uframes_t  bsize, psize;
+
+    _alsadev = alsadev;
+    _handle = (_mode == PLAY) ? alsadev->play_handle () : alsadev->capt_handle ();
+    snd_pcm_get_params (_handle, &bsize, &psize);
+    _dsize = bsize;
+    _infoq = infoq;
+    _ratio = 1.0;
+    _rcorr = 1.0;
+    _bstat = 0;
+    _margin = _bsize / 2;
+    // For playback this is the lowest possible, direct_latency()
+    // updates it after direct_playback() has synced.
+    _delay = (_mode == PLAY) ? _margin : _bsize + _margin;
+    _dlevel = (int) _delay;
+    _ltcor = ltcor;
+    _ppsec = (_fsamp + _bsize / 2) / _bsize;
+    initwait (_ppsec / 2);
+    jack_recompute_total_latencies (_client);
+}
+
+
+void Jackclient::direct_latency (void)
+{
+    // Called from a non-realtime thread: report the
+    // level found by the last sync as the latency.
+    if (_dlevel != (int) _delay)
+    {
+        _delay = _dlevel;
+        jack_recompute_total_latencies (_client);
+    }
+}
+
+
 void Jackclient::initwait (int nwait)
 {
     _count = -nwait;
-    _commq->wr_int32 (Alsathread::WAIT);
+    if (_commq) _commq->wr_int32 (Alsathread::WAIT);
     _state = WAIT;
     if (nwait > _ppsec) sendinfo (WAIT, 0, 0);
 }
@@ -333,6 +379,193 @@ void Jackclient::capture (int nframes)
 }
 
 
+void Jackclient::initdirect (void)
+{
+    // (Re)start the ALSA device. For playback this
+    // fills the entire buffer with silence.
+    _alsadev->pcm_stop ();
+    snd_pcm_prepare (_handle);
+    if (_alsadev->pcm_start ())
+    {
+        initwait (10 * _ppsec);
+	return;
+    }
+    _state = SYNC0;
+    sendinfo (SYNC0, 0, 0);
+}
+
+
+void Jackclient::direct_skip (int nframes)
+{
+    int  i, k;
+
+    // Drop captured frames, or write silence for playback.
+    // The loop takes care of wraparound.
+    for (; nframes > 0; nframes -= k)
+    {
+	if (_mode == PLAY)
+	{
+	    k = _alsadev->play_init (nframes);
+	    if (k <= 0) return;
+	    for (i = 0; i < _alsadev->nplay (); i++) _alsadev->clear_chan (i, k);
+	    _alsadev->play_done (k);
+	}
+	else
+	{
+	    k = _alsadev->capt_init (nframes);
+	    if (k <= 0) return;
+	    _alsadev->capt_done (k);
+	}
+    }
+}
+
+
+void Jackclient::direct_playback (int nframes)
+{
+    int    i, k, n, a, f;
+    float  *inp [MAXCHAN];
+
+    a = snd_pcm_avail_update (_handle);
+    if ((a < 0) || (a > _dsize))
+    {
+	// Underrun, restart the device.
+	initwait (_ppsec / 2);
+	return;
+    }
+    // Frames written but not yet played.
+    f = _dsize - a;
+    if (_state == SYNC0)
+    {
+	// Take back the silence written at start down to the
+	// margin, as far as the device allows, and let it play
+	// out otherwise. The level is then the margin, or up
+	// to a period more if the device can't rewind.
+	if (f > _margin)
+	{
+	    k = snd_pcm_rewind (_handle, f - _margin);
+	    if (k > 0) f -= k;
+	}
+	if (f >= _bsize + _margin) return;
+	_level = (f > _margin) ? f : _margin;
+	direct_skip (_level - f);
+	f = _level;
+	a = _dsize - f;
+	_dlevel = _level;
+	_state = PROC1;
+    }
+    if ((f >= _level + _bsize) || (a < nframes))
+    {
+	// Too far ahead, let a period play out.
+	sendinfo (_state, f - _level, 1.0);
+	return;
+    }
+    if (_level - f >= _bsize / 2)
+    {
+	// Behind after skipped cycles.
+	direct_skip (_level - f);
+    }
+    _bstat = f;
+    sendinfo (_state, f - _level, 1.0);
+
+    for (i = 0; i < _nchan; i++)
+    {
+        inp [i] = (float *)(jack_port_get_buffer (_ports [i], nframes));
+    }
+    // Convert straight from the ports into the mmap area.
+    // The loop takes care of wraparound.
+    for (n = 0; n < nframes; n += k)
+    {
+	k = _alsadev->play_init (nframes - n);
+	if (k <= 0) break;
+	for (i = 0; i < _nchan; i++) _alsadev->play_chan (i, inp [i] + n, k, 1);
+	for (; i < _alsadev->nplay (); i++) _alsadev->clear_chan (i, k);
+	_alsadev->play_done (k);
+    }
+    if (n < nframes) initwait (_ppsec / 2);
+}
+
+
+void Jackclient::direct_capture (int nframes)
+{
+    int    i, k, m, n, a;
+    float  *out [MAXCHAN];
+
+    a = snd_pcm_avail_update (_handle);
+    if ((a < 0) || (a > _dsize))
+    {
+	// Overrun, restart the device.
+	silence (nframes);
+	initwait (_ppsec / 2);
+	return;
+    }
+    if (_state == SYNC0)
+    {
+	// Keep only the margin, so that there will be a period
+	// plus the margin in the next cycle. This sets the latency.
+	silence (nframes);
+	if (a < _margin) return;
+	direct_skip (a - _margin);
+	_level = _bsize + _margin;
+	_state = PROC1;
+	return;
+    }
+    if (a - _level >= _bsize / 2)
+    {
+	// Behind after skipped cycles.
+	direct_skip (a - _level);
+	a = _level;
+    }
+    sendinfo (_state, a - _level, 1.0);
+
+    for (i = 0; i < _nchan; i++)
+    {
+        out [i] = (float *)(jack_port_get_buffer (_ports [i], nframes));
+    }
+    // Normally read a period. If the device is early, read what
+    // it has less the margin and pad the start with silence, so
+    // that the level is back to a period plus the margin in the
+    // next cycle.
+    m = nframes;
+    if (a < nframes)
+    {
+	m = (a > _margin) ? a - _margin : 0;
+	for (i = 0; i < _nchan; i++) memset (out [i], 0, (nframes - m) * sizeof (float));
+    }
+    _bstat = a - m;
+    // Convert straight from the mmap area into the ports.
+    // The loop takes care of wraparound.
+    for (n = nframes - m; n < nframes; n += k)
+    {
+	k = _alsadev->capt_init (nframes - n);
+	if (k <= 0) break;
+	for (i = 0; i < _nchan; i++) _alsadev->capt_chan (i, out [i] + n, k, 1);
+	_alsadev->capt_done (k);
+    }
+    if (n < nframes)
+    {
+	for (i = 0; i < _nchan; i++) memset (out [i] + n, 0, (nframes - n) * sizeof (float));
+	initwait (_ppsec / 2);
+    }
+}
+
+
+int Jackclient::direct_process (int nframes)
+{
+    // Start the device 1/2 second after entering the
+    // WAIT state, as for the ALSA thread.
+    if (_state == WAIT)
+    {
+	if (_freew) return 0;
+	if (_mode == CAPT) silence (nframes);
+        if (++_count == 0) initdirect ();
+	return 0;
+    }
+    if (_mode == PLAY) direct_playback (nframes);
+    else               direct_capture (nframes);
+    return 0;
+}
+
+
 void Jackclient::silence (int nframes)
 {
     int    i;
@@ -410,6 +643,7 @@ int Jackclient::jack_process (int nframes)
     }
     // Skip cylce if ports may not yet exist.
     if (_state < WAIT) return 0;
+    if (_alsadev) return direct_process (nframes);
 
     // Start synchronisation 1/2 second after entering
     // the WAIT state. This delay allows the ALSA thread
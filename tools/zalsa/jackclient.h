@@ -23,6 +23,7 @@
 
 
 #include <zita-resampler/vresampler.h>
+#include <zita-alsa-pcmi.h>
 #include "jack/jack.h"
 #include "lfqueue.h"
 
@@ -46,6 +47,11 @@ public:
 	        int         ltcor,
 	        int         rqual);
 
+    void start_direct (Alsa_pcmi   *alsadev,
+                       Lfq_jdata   *infoq,
+                       int         ltcor);
+    void direct_latency (void);
+
     const char *jname (void) const { return _jname; }
     int fsamp (void) const { return _fsamp; }
     int bsize (void) const { return _bsize; }
@@ -63,6 +69,11 @@ private:
     void playback (int nframes);
     void capture (int nframes);
     void sendinfo (int state, double error, double ratio);
+    void initdirect (void);
+    void direct_skip (int nframes);
+    void direct_playback (int nframes);
+    void direct_capture (int nframes);
+    int  direct_process (int nframes);
 
     virtual void thr_main (void) {}
 
@@ -109,6 +120,13 @@ private:
     double          _rcorr;
     VResampler     *_resamp;
 
+    Alsa_pcmi      *_alsadev;
+    snd_pcm_t      *_handle;
+    int             _dsize;
+    int             _level;
+    int             _margin;
+    volatile int    _dlevel;
+
     static void jack_static_shutdown (void *arg);
     static int  jack_static_buffsize (jack_nframes_t nframes, void *arg);
     static void jack_static_freewheel (int state, void *arg);
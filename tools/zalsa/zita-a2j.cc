@@ -28,7 +28,7 @@
 #include "lfqueue.h"
 #include "jack/control.h"
 
-static const char *clopt = "hvLSwj:d:r:p:n:c:Q:I:";
+static const char *clopt = "hvLSDwj:d:r:p:n:c:Q:I:";
 
 static void help (void)
 {
@@ -44,6 +44,7 @@ static void help (void)
     jack_info ("  -n <nfrags>        Number of fragments [2]");
     jack_info ("  -c <nchannels>     Number of channels [2]");
     jack_info ("  -S                 Word clock sync, no resampling");
+    jack_info ("  -D                 As -S, with ALSA I/O in the Jack thread");
     jack_info ("  -Q <quality>       Resampling quality, 16..96 [auto]");
     jack_info ("  -I <samples>       Latency adjustment [0]");
     jack_info ("  -L                 Force 16-bit and 2 channels [off]");
@@ -61,6 +62,7 @@ class zita_a2j
 	bool v_opt;
 	bool L_opt;
 	bool S_opt;
+	bool D_opt;
 	bool w_opt;
 	char *jname;
 	char *device;
@@ -83,6 +85,7 @@ public:
         v_opt = false;
         L_opt = false;
         S_opt = false;
+        D_opt = false;
         w_opt = false;
         jname = strdup(APPNAME);
         device = 0;
@@ -120,6 +123,7 @@ private:
             case 'v' : v_opt = true; break;
             case 'L' : L_opt = true; break;
             case 'S' : S_opt = true; break;
+            case 'D' : D_opt = S_opt = true; break;
             case 'w' : w_opt = true; break;
             case 'j' : jname = optarg; break;
             case 'd' : device = optarg; break;
@@ -350,6 +354,16 @@ public:
         double         t_jack;
         double         t_del;
 
+        if (D_opt)
+        {
+            if (((int) A->fsize () == J->bsize ()) && ((int) A->fsamp () == J->fsamp ()))
+            {
+                J->start_direct (A, infoq, ltcor);
+                return;
+            }
+            jack_error (APPNAME ": -D needs the Jack period size and sample rate, using -S.");
+        }
+
         t_alsa = (double) bsize / fsamp;
         if (t_alsa < 1e-3) t_alsa = 1e-3;
         t_jack = (double) J->bsize () / J->fsamp (); 
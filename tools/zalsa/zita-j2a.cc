@@ -28,7 +28,7 @@
 #include "lfqueue.h"
 #include "jack/control.h"
 
-static const char *clopt = "hvLSwj:d:r:p:n:c:Q:O:";
+static const char *clopt = "hvLSDwj:d:r:p:n:c:Q:O:";
 
 static void help (void)
 {
@@ -44,6 +44,7 @@ static void help (void)
     jack_info ("  -n <nfrags>        Number of fragments [2]");
     jack_info ("  -c <nchannels>     Number of channels [2]");
     jack_info ("  -S                 Word clock sync, no resampling");
+    jack_info ("  -D                 As -S, with ALSA I/O in the Jack thread");
     jack_info ("  -Q <quality>       Resampling quality, 16..96 [auto]");
     jack_info ("  -O <samples>       Latency adjustment [0]");
     jack_info ("  -L                 Force 16-bit and 2 channels [off]");
@@ -61,6 +62,7 @@ class zita_j2a
 	bool v_opt;
 	bool L_opt;
 	bool S_opt;
+	bool D_opt;
 	bool w_opt;
 	char *jname;
 	char *device;
@@ -83,6 +85,7 @@ public:
         v_opt = false;
         L_opt = false;
         S_opt = false;
+        D_opt = false;
         w_opt = false;
         jname = strdup(APPNAME);
         device = 0;
@@ -96,6 +99,7 @@ public:
         P = 0;
         J = 0;
         t = 0;
+        lt = 0;
     }
 
 private:
@@ -120,6 +124,7 @@ private:
             case 'v' : v_opt = true; break;
             case 'L' : L_opt = true; break;
             case 'S' : S_opt = true; break;
+            case 'D' : D_opt = S_opt = true; break;
             case 'w' : w_opt = true; break;
             case 'j' : jname = optarg; break;
             case 'd' : device = optarg; break;
@@ -233,6 +238,7 @@ private:
     Jackclient     *J;
 
     pthread_t t;
+    pthread_t lt;
     int       topts;
 
     static void* _retry_alsa_pcmi (void *arg)
@@ -268,6 +274,24 @@ private:
         t = 0;
     }
 
+    static void* _direct_latency (void *arg)
+    {
+        ((zita_j2a*)arg)->direct_latency ();
+        return NULL;
+    }
+
+    void direct_latency ()
+    {
+        // The playback latency is known once the direct
+        // mode has synced, report it from here rather
+        // than from the process callback.
+        while (! stop)
+        {
+            usleep (100*1000);
+            J->direct_latency ();
+        }
+    }
+
 public:
 
     int jack_initialize (jack_client_t* client, const char* load_init)
@@ -348,6 +372,17 @@ public:
         double         t_alsa;
         double         t_del;
 
+        if (D_opt)
+        {
+            if (((int) A->fsize () == J->bsize ()) && ((int) A->fsamp () == J->fsamp ()))
+            {
+                J->start_direct (A, infoq, ltcor);
+                pthread_create (&lt, NULL, _direct_latency, this);
+                return;
+            }
+            jack_error (APPNAME ": -D needs the Jack period size and sample rate, using -S.");
+        }
+
         t_alsa = (double) bsize / fsamp;
         if (t_alsa < 1e-3) t_alsa = 1e-3;
         t_jack = (double) J->bsize () / J->fsamp (); 
@@ -377,6 +412,12 @@ public:
             pthread_join(t, NULL);
             t = 0;
         }
+        if (lt != 0)
+        {
+            stop = true;
+            pthread_join(lt, NULL);
+            lt = 0;
+        }
 
         commq->wr_int32 (Alsathread::TERM);
         usleep (100*1000);